@@ -18,12 +18,99 @@
 #define DYNAMIC_ARRAY_LOAD_AFTER_EXPANSION 0.6
 #define DYNAMIC_ARRAY_LOAD_AFTER_SHRINKING 0.8
 
-/*! \brief Number of elements stored in each list node.
-    Should be at most a small multiple of the cache line size.
-    By default we set it to 72/sizeof(void*), since a Pentium 4
-    cache line is 128 bytes, and the node metadata (12 bytes)
-    plus the allocation metadata roughly fills out the rest.
+/*! \brief Size in bytes of a cache line on the target machine.
+    List nodes are sized in whole cache lines and aligned to them.
+    Must be a power of two.
+*/
+#define LIST_CACHE_LINE_SIZE  64
+
+/*! \brief Maximum number of elements stored in each list node.
+    Each list chooses its own node capacity, up to this limit, when
+    it is created. This bounds the data array of a list node, and
+    is enough to fill four cache lines.
+*/
+#define ELEMENTS_PER_LIST_NODE  ((int)((4*LIST_CACHE_LINE_SIZE)/sizeof(void*)))
+
+/*! \brief Number of cache lines filled by each node of a list
+    created without an explicit node capacity. Two 64-byte lines
+    hold a node's metadata plus 12 elements on 64-bit machines.
+*/
+#define LIST_DEFAULT_NODE_CACHE_LINES  2
+
+/*! \brief Default high-water mark of the cache of spare nodes each
+    list keeps. A list whose size oscillates across a node boundary
+    reuses a cached node instead of freeing and reallocating one.
+*/
+#define LIST_DEFAULT_MAX_SPARE_NODES  2
+
+/*! \brief Define as 0 where POSIX threads and file descriptors are
+    unavailable, as with Visual C++. The list_io, list_parallel and
+    list_queue modules need them, and are then left out of the build
+    along with their tests.
+*/
+#ifndef LIST_HAVE_POSIX
+#if defined(_MSC_VER)
+#define LIST_HAVE_POSIX  0
+#else
+#define LIST_HAVE_POSIX  1
+#endif
+#endif
+
+/*! \brief Define as 1 to shrink the metadata of each list node
+    from four pointers' worth to three, by leaving out its link to
+    the order-statistics index. On 64-bit machines a node of two
+    cache lines then holds 13 elements rather than 12, and one of a
+    single cache line 5 rather than 4. Lists can then not be indexed:
+    list_build_index() always fails.
+*/
+#ifndef LIST_COMPACT_NODES
+#define LIST_COMPACT_NODES  0
+#endif
+
+/*! \brief Define as 0 to make list_find() and list_count() always
+    use their portable scalar loops. Otherwise they use SSE2 or AVX2
+    compares, chosen at run time, when built by GCC or Clang for x86-64.
+*/
+#ifndef LIST_USE_SIMD
+#define LIST_USE_SIMD  1
+#endif
+
+/*! \brief Default number of nodes carved out of each slab allocated
+    by a list_node_pool.
+*/
+#define LIST_NODE_POOL_DEFAULT_SLAB_NODES  64
+
+/*! \brief Number of elements list_sort() sorts at a time in a
+    temporary array to form its initial runs. It allocates twice this
+    many pointers while it runs. Must be at least ELEMENTS_PER_LIST_NODE.
+*/
+#define LIST_SORT_BUFFER_ELEMENTS  16384
+
+/*! \brief Number of elements stored in each list_queue node,
+    chosen so that a node, with its counters and links, fills eight
+    cache lines.
+*/
+#define LIST_QUEUE_NODE_ELEMENTS  ((int)((8*LIST_CACHE_LINE_SIZE)/sizeof(void*)) - 4)
+
+/*! \brief Address list_write_image() lays images out for by default.
+    An image mapped at the address it was laid out for needs no
+    relocation. Must be a multiple of the page size, and should lie
+    in a range the system leaves free for mappings.
+*/
+#define LIST_IMAGE_DEFAULT_BASE_ADDRESS \
+    ((void *)((size_t)0x30000 << (sizeof(void*) > 4 ? 28 : 12)))
+
+/*! \brief Size in bytes of the buffer list_write() and list_read()
+    use to batch system calls.
+*/
+#define LIST_IO_BUFFER_SIZE  65536
+
+/*! \brief Largest number of I/O vectors list_readv_append() passes
+    to each system call, further limited by the system's IOV_MAX.
+*/
+#define LIST_IO_MAX_VECTORS  1024
 
-    May not be less than 2.
+/*! \brief Maximum number of threads used by the list_parallel
+    functions, however many are requested.
 */
-#define ELEMENTS_PER_LIST_NODE  ((int)((72)/sizeof(void*)))
+#define LIST_PARALLEL_MAX_THREADS  64
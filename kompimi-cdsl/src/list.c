@@ -9,18 +9,74 @@
 #include <assert.h>
 
 #include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "list.h"
 
+#if LIST_USE_SIMD && defined(__GNUC__) && defined(__x86_64__)
+/* SSE2 is always available on x86-64; AVX2 is detected at run time */
+#define LIST_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+/*! \brief Pointer to the first element stored in a node. Elements
+    occupy the range [start, start + count) of the node's data array. */
+#define NODE_ELEMENTS(node)  ((node)->data + (node)->start)
+
+/* Node reference counts may be released by snapshots on other
+   threads, so are updated atomically where the compiler allows */
+#if defined(__GNUC__)
+#define load_refcount(node) __atomic_load_n(&(node)->refcount, __ATOMIC_ACQUIRE)
+#define add_refcount(node, delta) \
+    __atomic_add_fetch(&(node)->refcount, (delta), __ATOMIC_ACQ_REL)
+#else
+#define load_refcount(node) ((node)->refcount)
+#define add_refcount(node, delta) ((node)->refcount += (delta))
+#endif
+
+/* Compact nodes have no index entry. Lists of them are never indexed,
+   so the index code sees every node as having none. */
+#if LIST_COMPACT_NODES
+#define node_index_entry(node) ((list_index_entry *)NULL)
+#define set_node_index_entry(node, entry) ((void)(node), (void)(entry))
+#else
+#define node_index_entry(node) ((node)->index_entry)
+#define set_node_index_entry(node, entry) ((node)->index_entry = (entry))
+#endif
+
+/* Fingers on a node being refilled by list_batch_apply() are held
+   here, so that none is moved twice */
+static char batch_finger_marker;
+#define BATCH_FINGER_NODE ((list_node *)(void *)&batch_finger_marker)
+
 /*! \brief Splits a full node into two consecutive nodes, distributing
   its elements among them. */
 static int split_node(list_iter* iter);
 
+/*! \brief Makes room in a full node by moving the elements before
+  or after the iterator into whichever neighbor can take more of
+  them. The iterator keeps referring to the same element, in the same
+  node. Returns zero if neither neighbor has room. */
+static int spill_to_neighbor(list_iter* iter);
+
 /*! \brief Merge a given node with its neighbors, if possible,
   to limit wasted space. */
 static void rebalance_nodes(list_iter* iter);
 
+/*! \brief Makes room for one element at the given logical offset of a
+    node that is not full, shifting whichever side of it is cheaper.
+    Returns a pointer to the new slot. */
+static void** open_gap(list* lst, list_node* node, int offset);
+
+/*! \brief Removes the element at the given logical offset of a node,
+    shifting whichever side of it is cheaper. */
+static void close_gap(list* lst, list_node* node, int offset);
+
+/*! \brief Moves a node's elements to the start of its data array,
+    leaving all free space after them. */
+static void pack_node_front(list_node* node);
+
 /*! \brief Inserts a new node containing zero elements after the given node. */
 static int insert_empty_node_after(list* lst, list_node* node);
 
@@ -30,9 +86,159 @@ static int insert_empty_node_before(list* lst, list_node* node);
 /*! \brief Inserts a new empty node into an empty list with no nodes. */
 static int insert_empty_sole_node(list* lst);
 
+/*! \brief Inserts the given number of new empty nodes after the
+    given node. On failure, removes any it inserted. */
+static int insert_empty_nodes_after(list* lst, list_node* node, int num_nodes);
+
+/*! \brief (Internal) A sequence of elements drawn in order from up
+    to three separate arrays, used to pack elements into nodes. */
+typedef struct
+{
+    void** data[3];
+    int count[3];
+    int segment;
+} element_stream;
+
+/*! \brief Copies the next elements of a stream into an array. */
+static void stream_copy(element_stream* stream, void** dest, int count);
+
+/*! \brief Moves the elements in [first, last) of one list before dst_iter
+    in another, relinking whole nodes. */
+static int move_range(list_iter* dst_iter, list_iter* first, list_iter* last);
+
+/*! \brief Repacks a list into full nodes in one pass, freeing the
+    nodes left empty. If iter is not NULL, it is updated to refer to
+    the same element. Returns zero if out of memory copying nodes
+    shared with a snapshot, leaving the list sparse. */
+static int compact_nodes(list* lst, list_iter* iter);
+
+/*! \brief Merges adjacent nodes whose elements fit in one node,
+    examining a bounded number of consecutive pairs. */
+static void merge_small_nodes(list* lst, list_node* node, int num_pairs, list_iter* iter);
+
+/*! \brief Detaches a chain of consecutive nodes from a list's linked
+    list of nodes, without freeing them. */
+static void unlink_nodes(list* lst, list_node* first, list_node* last);
+
+/*! \brief Links a chain of nodes into a list after the given node,
+    or at the beginning if it is NULL. */
+static void link_nodes(list* lst, list_node* after, list_node* first, list_node* last);
+
+/*! \brief Returns the end iterator of a list. */
+static list_iter end_iter(list* lst);
+
+/*! \brief Sorts the elements of one node in place, stably. */
+static void sort_node(list_node* node, list_comparator cmp, void* context);
+
+/*! \brief Sorts an array stably by merging, using a scratch array of
+    the same size. Returns whichever of the two holds the result. */
+static void** sort_array(void** values, void** scratch, int count,
+                         list_comparator cmp, void* context);
+
+/*! \brief Takes consecutive nodes from the front of the chain *nodes
+    and sorts their elements into an initial run for list_sort().
+    With a buffer, takes as many nodes as fit in buffer_size elements,
+    sorts them there and packs them back into full nodes, pushing any
+    left empty onto *free_nodes. Without one, takes a single node. */
+static list_node* sort_run(list_node** nodes, void** buffer, int buffer_size,
+                           list_comparator cmp, void* context, int capacity,
+                           list_node** free_nodes);
+
+/*! \brief Merges two sorted, NULL-terminated chains of nodes into one,
+    preferring elements of a over equivalent elements of b. Output
+    nodes are taken from *free_nodes, and input nodes are pushed onto
+    it as they are consumed, so two free nodes on entry suffice. Full
+    input nodes are linked in whole where they fit between elements of
+    the other chain, and the rest of one chain is linked in as it is
+    once the other runs out on a node boundary. If both chains have
+    every node but the last full, so does the output chain. Otherwise
+    the output may have more nodes than its elements need, but never
+    more than the two chains together. Fingers of a_lst and b_lst, if
+    not NULL, on input nodes that are used up are parked, and those on
+    nodes linked in stay put. */
+static list_node* merge_chains(list_node* a, list_node* b, list_comparator cmp,
+                               void* context, int capacity, list_node** free_nodes,
+                               list* a_lst, list* b_lst);
+
+/*! \brief Appends to dst the elements of two sorted lists that a set
+    operation keeps, reading both node chains together and writing
+    straight into dst's last node and then new full nodes. keep_a,
+    keep_b and keep_both say whether an element of a ordering before
+    the other list's next element, one of b ordering before it, or
+    one of a equivalent to it is kept. */
+static int merge_sets(list* dst, list* a, list* b, list_comparator cmp, void* context,
+                      int keep_a, int keep_b, int keep_both);
+
+/*! \brief Returns the last node of a NULL-terminated chain of nodes. */
+static list_node* chain_last(list_node* node);
+
+/*! \brief Allocates the given number of nodes onto a chain of free
+    nodes linked through next. On failure, frees any it allocated. */
+static int allocate_spare_nodes(list* lst, list_node** free_nodes, int num_nodes);
+
+/*! \brief Frees a chain of free nodes linked through next. */
+static void free_chain(list* lst, list_node* free_nodes);
+
+/*! \brief Detaches every index entry from the nodes of a list, pushing
+    them onto a chain of entries linked through parent, and returns
+    the chain. The list's index is left empty. */
+static list_index_entry* detach_index(list* lst, list_index_entry* entries);
+
+/*! \brief Gives every node of an indexed list an entry from a chain
+    detached by detach_index(), freeing any left over. Frees the whole
+    chain if the list is not indexed. */
+static void attach_index(list* lst, list_index_entry* entries);
+
 /*! \brief Removes a node from the linked list of nodes. */
 static void remove_node(list* lst, list_node* node);
 
+/*! \brief Returns the number of bytes allocated for a node of the
+    given capacity, rounded up to a whole number of cache lines. */
+static size_t node_size(int node_capacity);
+
+/*! \brief Allocates an uninitialized node, from the list's spare
+    node cache if it is not empty, else from its pool if it has one. */
+static list_node* allocate_node(list* lst);
+
+/*! \brief Releases a node allocated by allocate_node(), keeping it
+    in the list's spare node cache if that is below its high-water mark. */
+static void free_node(list* lst, list_node* node);
+
+/*! \brief Allocates an uninitialized node from the list's pool, or
+    from the system, bypassing the spare node cache. */
+static list_node* acquire_node(list* lst);
+
+/*! \brief Returns a node to the list's pool, or to the system. */
+static void release_node(list* lst, list_node* node);
+
+/*! \brief Adds a new slab of the given number of free nodes to a
+    pool. Its nodes are handed out next, in address order. */
+static int allocate_slab(list_node_pool* pool, int num_nodes);
+
+/*! \brief Adds an index entry for a newly linked node, if the list
+    is indexed. Does not modify the list on failure. */
+static int index_insert_entry(list* lst, list_node* node);
+
+/*! \brief Links a preallocated entry into the index for a newly
+    linked node of an indexed list. */
+static void index_link_entry(list* lst, list_node* node, list_index_entry* entry);
+
+/*! \brief Removes a node's index entry, if it has one. */
+static void index_remove_entry(list* lst, list_node* node);
+
+/*! \brief Propagates a change in a node's element count to the index. */
+static void update_index_count(list* lst, list_node* node);
+
+/*! \brief Returns the total weight of a node's elements in a list
+    with a weighted index. */
+static long node_weight(list* lst, list_node* node);
+
+/*! \brief Rotates an index entry above its parent. */
+static void index_rotate_up(list* lst, list_index_entry* entry);
+
+/*! \brief Chooses a treap priority for a new index entry. */
+static unsigned int index_priority(list_index_entry* entry);
+
 /*! \brief Verifies the current list data structure is valid and
     satisfies all algorithmic invariants. */
 static void check_list_invariants(list* lst);
@@ -41,6 +247,10 @@ static void check_list_invariants(list* lst);
     satisfies all algorithmic invariants. */
 static void check_iter_invariants(list_iter* iter);
 
+/*! \brief Verifies the order-statistics index of a list is consistent
+    with its nodes. */
+static void check_index_invariants(list* lst);
+
 /* \brief Returns nonzero if and only if the given list contains the
    given node in its linked list of nodes. */
 static int list_contains_node(list* lst, list_node* node_to_find);
@@ -49,29 +259,245 @@ static int list_contains_node(list* lst, list_node* node_to_find);
    across nodes. */
 static void fixup_iter_node(list_iter* iter);
 
+/*! \brief Makes sure a node is not shared with a snapshot before it
+    is modified, replacing *node_ptr with a private copy linked in its
+    place if it is. Returns zero if out of memory. */
+static int own_node(list* lst, list_node** node_ptr);
+
+/*! \brief Replaces a node shared with a snapshot by a private copy,
+    for own_node(). */
+static int copy_shared_node(list* lst, list_node** node_ptr);
+
+/*! \brief Links replacement in place of node, taking over its index
+    entry and fingers, and frees node. Copies no elements. */
+static void replace_node(list* lst, list_node* node, list_node* replacement);
+
+/*! \brief Moves the fingers on count elements of a node, starting
+    at the given offset, to new_offset onwards in new_node, where the
+    elements are being moved. A NULL new_node with new_offset zero
+    stands for the end iterator, when count is one. */
+static void move_fingers(list* lst, list_node* node, int offset, int count,
+                         list_node* new_node, int new_offset);
+
+/*! \brief Moves the fingers on count elements of a node, starting at
+    the given offset, all to the one position given, because the
+    elements are being removed. */
+static void drop_fingers(list* lst, list_node* node, int offset, int count,
+                         list_node* new_node, int new_offset);
+
+/*! \brief Like move_fingers(), but for elements moving from src to
+    new_node in dst, so the fingers are also registered with dst. */
+static void pass_fingers(list* src, list* dst, list_node* node, int offset, int count,
+                         list_node* new_node, int new_offset);
+
+/*! \brief Unregisters a finger from its list and registers it with
+    dst, keeping its node and offset. */
+static void transfer_finger(list_finger* finger, list* dst);
+
+/*! \brief Registers with dst every finger of src not on the end
+    iterator, when all of src's nodes are moving to dst unchanged. */
+static void pass_node_fingers(list* src, list* dst);
+
+/*! \brief Fixes up the fingers after the element at the given offset
+    of a node has been removed and the node's count reduced. Fingers
+    on it move to the element after it, which may be in the next node. */
+static void close_fingers_gap(list* lst, list_node* node, int offset);
+
+/*! \brief Returns nonzero if any finger of a list refers to an element
+    of the given node. */
+static int node_has_fingers(list* lst, list_node* node);
+
+/*! \brief Moves every finger of a list to the end iterator. */
+static void park_fingers(list* lst);
+
+/*! \brief Appends an edit to a batch, growing its array as needed,
+    and keeping a removal after the insertions at its position.
+    Returns zero if out of memory. */
+static int record_edit(list_batch* batch, list_iter iter, int remove, void* value);
+
+/*! \brief Checks that iter is no earlier in the list than the last
+    edit recorded in a batch. */
+static void check_edit_order(list_batch* batch, list_iter iter);
+
+/*! \brief Returns the number of elements a node will hold after its
+    batch edits starting at first_edit, and sets *end_edit past
+    them. */
+static int count_batch_node(list_batch_edit* edits, int num_edits, int first_edit,
+                            int* end_edit);
+
+/*! \brief Rebuilds the node of the batch edits from first_edit
+    up to end_edit, copying its elements out to scratch first. Refills
+    the node itself, replaced if shared, and as many more nodes as
+    needed, evenly, taken from the given chains of free nodes and index
+    entries. Removes the node if nothing is left of it. Returns the
+    last node filled, or NULL if none was. */
+static list_node* apply_batch_node(list* lst, list_batch_edit* edits, int first_edit,
+                                   int end_edit, int total, void** scratch,
+                                   list_node** free_nodes, list_index_entry** entries);
+
+/*! \brief Makes sure none of a list's nodes are shared with a
+    snapshot, updating up to three iterators (each may be NULL) that
+    refer to nodes replaced by copies. Returns zero if out of memory. */
+static int unshare_nodes(list* lst, list_iter* iter1, list_iter* iter2, list_iter* iter3);
+
+/*! \brief Finds the first element equal to value, starting at the
+    given offset of a node and continuing through the nodes after it.
+    Returns the node containing it and sets *found_offset to its
+    offset, or returns NULL if there is none. */
+static list_node* find_in_nodes(list_node* node, int offset, void* value, int* found_offset);
+
+/*! \brief Counts the elements equal to value in a node and the nodes after it. */
+static int count_in_nodes(list_node* node, void* value);
+
+#ifndef LIST_SIMD_X86
+/*! \brief Portable version of find_in_nodes(). */
+static list_node* find_in_nodes_scalar(list_node* node, int offset, void* value, int* found_offset);
+
+/*! \brief Portable version of count_in_nodes(). */
+static int count_in_nodes_scalar(list_node* node, void* value);
+#else
+/*! \brief Returns nonzero if the processor supports AVX2. */
+static int have_avx2(void);
+
+/*! \brief Version of find_in_nodes() comparing two elements at a time. */
+static list_node* find_in_nodes_sse2(list_node* node, int offset, void* value, int* found_offset);
+
+/*! \brief Version of count_in_nodes() comparing two elements at a time. */
+static int count_in_nodes_sse2(list_node* node, void* value);
+
+/*! \brief Version of find_in_nodes() comparing four elements at a time. */
+static list_node* find_in_nodes_avx2(list_node* node, int offset, void* value, int* found_offset)
+    __attribute__((target("avx2")));
+
+/*! \brief Version of count_in_nodes() comparing four elements at a time. */
+static int count_in_nodes_avx2(list_node* node, void* value)
+    __attribute__((target("avx2")));
+#endif
+
 list list_create(void)
+{
+    return list_create_with_capacity(0);
+}
+
+list list_create_with_capacity(int node_capacity)
 {
     list result;
+    assert(node_capacity == 0 ||
+           (node_capacity >= 2 && node_capacity <= ELEMENTS_PER_LIST_NODE));
     result.size = 0;
+    result.node_capacity = (node_capacity > 0) ? node_capacity
+        : list_node_capacity_for_cache_lines(LIST_DEFAULT_NODE_CACHE_LINES);
     result.first_node = NULL;
     result.last_node = NULL;
+    result.pool = NULL;
+    result.indexed = 0;
+    result.index_root = NULL;
+    result.spare_nodes = NULL;
+    result.num_spare_nodes = 0;
+    result.max_spare_nodes = LIST_DEFAULT_MAX_SPARE_NODES;
+    result.max_lazy_removals = 0;
+    result.num_lazy_removals = 0;
+    result.sparse = 0;
+    result.shared = 0;
+    result.weight = NULL;
+    result.weight_context = NULL;
+    result.fingers = NULL;
     check_list_invariants(&result);
     return result;
 }
 
+list list_create_pooled(list_node_pool* pool)
+{
+    list result;
+    assert(pool != NULL);
+    result = list_create_with_capacity(pool->node_capacity);
+    result.pool = pool;
+    return result;
+}
+
 void list_destroy(list* lst)
 {
     list_node* node;
     list_node* next_node;
-    for (node = lst->first_node; node != NULL; node = next_node)
+    int max_spare_nodes;
+    list_drop_index(lst);
+    if (lst->shared)
     {
-        next_node = node->next;
-        free(node);
+        /* Nodes still held by snapshots are freed when they are released */
+        for (node = lst->first_node; node != NULL; node = next_node)
+        {
+            next_node = node->next;
+            if (add_refcount(node, -1) == 0)
+            {
+                release_node(lst, node);
+            }
+        }
+    }
+    else if (lst->pool != NULL)
+    {
+        /* The node chain is already linked through next, so it can
+           be prepended to the pool's free list as a whole. */
+        if (lst->last_node != NULL)
+        {
+            lst->last_node->next = lst->pool->free_nodes;
+            lst->pool->free_nodes = lst->first_node;
+        }
+    }
+    else
+    {
+        for (node = lst->first_node; node != NULL; node = next_node)
+        {
+            next_node = node->next;
+            free(node);
+        }
     }
 
+    /* Release the spare nodes, but keep the mark in case the list is reused */
+    max_spare_nodes = lst->max_spare_nodes;
+    list_set_max_spare_nodes(lst, 0);
+    lst->max_spare_nodes = max_spare_nodes;
+
     lst->size = 0;
     lst->first_node = NULL;
     lst->last_node = NULL;
+    lst->sparse = 0;
+    lst->shared = 0;
+    lst->num_lazy_removals = 0;
+    park_fingers(lst);
+}
+
+int list_reserve(list* lst, int num_elements)
+{
+    int num_nodes = 0;
+    if (num_elements > lst->size)
+    {
+        num_nodes = (num_elements - lst->size + lst->node_capacity - 1) / lst->node_capacity;
+    }
+    while (lst->num_spare_nodes < num_nodes)
+    {
+        list_node* node = acquire_node(lst);
+        if (node == NULL)
+        {
+            return 0;
+        }
+        node->next = lst->spare_nodes;
+        lst->spare_nodes = node;
+        lst->num_spare_nodes++;
+    }
+    return 1;
+}
+
+void list_set_max_spare_nodes(list* lst, int max_spare_nodes)
+{
+    assert(max_spare_nodes >= 0);
+    lst->max_spare_nodes = max_spare_nodes;
+    while (lst->num_spare_nodes > max_spare_nodes)
+    {
+        list_node* node = lst->spare_nodes;
+        lst->spare_nodes = node->next;
+        lst->num_spare_nodes--;
+        release_node(lst, node);
+    }
 }
 
 int list_insert_after(list_iter* iter, void* value)
@@ -79,21 +505,22 @@ int list_insert_after(list_iter* iter, void* value)
     check_list_invariants(iter->lst);
     check_iter_invariants(iter);
     assert (!list_at_end(*iter));
-    if (iter->node->count == ELEMENTS_PER_LIST_NODE)
+    if (iter->node->count == iter->lst->node_capacity)
     {
-        if (!split_node(iter))
+        if (!spill_to_neighbor(iter) && !split_node(iter))
         {
             return 0;
         }
     }
+    if (!own_node(iter->lst, &iter->node))
+    {
+        return 0;
+    }
     {
         list_node* node = iter->node;
-        memmove(node->data + iter->offset + 2,
-                node->data + iter->offset + 1,
-                (node->count - (iter->offset + 1)) * sizeof(void *));
-        node->count++;
+        *open_gap(iter->lst, node, iter->offset + 1) = value;
         iter->lst->size++;
-        node->data[iter->offset + 1] = value;
+        update_index_count(iter->lst, node);
     }
     check_list_invariants(iter->lst);
     check_iter_invariants(iter);
@@ -109,22 +536,23 @@ int list_insert_before(list_iter* iter, void* value)
         /* Insert before end iterator is insert at end */
         return list_insert_end(iter->lst, value);
     }
-    if (iter->node->count == ELEMENTS_PER_LIST_NODE)
+    if (iter->node->count == iter->lst->node_capacity)
     {
-        if (!split_node(iter))
+        if (!spill_to_neighbor(iter) && !split_node(iter))
         {
             return 0;
         }
     }
+    if (!own_node(iter->lst, &iter->node))
+    {
+        return 0;
+    }
     {
         list_node* node = iter->node;
-        memmove(node->data + iter->offset + 1,
-                node->data + iter->offset,
-                (node->count - iter->offset) * sizeof(void *));
-        node->count++;
+        *open_gap(iter->lst, node, iter->offset) = value;
         iter->lst->size++;
-        node->data[iter->offset] = value;
         iter->offset++;
+        update_index_count(iter->lst, node);
     }
     check_list_invariants(iter->lst);
     check_iter_invariants(iter);
@@ -133,28 +561,27 @@ int list_insert_before(list_iter* iter, void* value)
 
 int list_insert_beginning(list* lst, void* value)
 {
-    if (lst->first_node == NULL)
+    if (lst->first_node == NULL ||
+        lst->first_node->count == lst->node_capacity)
     {
-        if (!insert_empty_sole_node(lst))
+        if (!(lst->first_node == NULL ? insert_empty_sole_node(lst)
+                                      : insert_empty_node_before(lst, lst->first_node)))
         {
             return 0;
         }
+        /* Fill new front nodes from the back, so that further
+           insertions at the beginning need not move anything */
+        lst->first_node->start = lst->node_capacity;
     }
-    if (lst->first_node->count == ELEMENTS_PER_LIST_NODE)
+    else if (!own_node(lst, &lst->first_node))
     {
-        if (!insert_empty_node_before(lst, lst->first_node))
-        {
-            return 0;
-        }
+        return 0;
     }
     {
         list_node* node = lst->first_node;
-        memmove(node->data + 1,
-                node->data,
-                node->count * sizeof(void *));
-        node->count++;
+        *open_gap(lst, node, 0) = value;
         lst->size++;
-        node->data[0] = value;
+        update_index_count(lst, node);
     }
     check_list_invariants(lst);
     return 1;
@@ -169,353 +596,3746 @@ int list_insert_end(list* lst, void* value)
             return 0;
         }
     }
-    if (lst->last_node->count == ELEMENTS_PER_LIST_NODE)
+    if (lst->last_node->count == lst->node_capacity)
     {
         if (!insert_empty_node_after(lst, lst->last_node))
         {
             return 0;
         }
     }
+    else if (!own_node(lst, &lst->last_node))
+    {
+        return 0;
+    }
     {
         list_node* node = lst->last_node;
-        node->data[node->count] = value;
+        if (node->start + node->count == lst->node_capacity)
+        {
+            pack_node_front(node);
+        }
+        NODE_ELEMENTS(node)[node->count] = value;
         node->count++;
         lst->size++;
+        update_index_count(lst, node);
     }
     check_list_invariants(lst);
     return 1;
 }
 
-void list_remove(list_iter* iter)
+int list_insert_range_after(list_iter* iter, void** values, int num_values)
 {
     list_node* node;
+    int total, num_nodes, i;
+    int base;
+    int tail_count;
+    void* tail[ELEMENTS_PER_LIST_NODE];
+    element_stream stream;
     check_list_invariants(iter->lst);
     check_iter_invariants(iter);
     assert (!list_at_end(*iter));
+    assert (num_values >= 0);
+    if (!own_node(iter->lst, &iter->node))
+    {
+        return 0;
+    }
     node = iter->node;
-    memmove(node->data + iter->offset,
-            node->data + iter->offset + 1,
-            (node->count - (iter->offset + 1)) * sizeof(void *));
-    node->count--;
-    iter->lst->size--;
-    rebalance_nodes(iter);
-    /* Need to fix up if deleted rightmost element in the node */
+    total = node->count + num_values;
+    pack_node_front(node);
+    if (total <= iter->lst->node_capacity)
+    {
+        move_fingers(iter->lst, node, iter->offset + 1, node->count - (iter->offset + 1),
+                     node, iter->offset + 1 + num_values);
+        memmove(node->data + iter->offset + 1 + num_values,
+                node->data + iter->offset + 1,
+                (node->count - (iter->offset + 1)) * sizeof(void *));
+        memcpy(node->data + iter->offset + 1,
+               values,
+               num_values * sizeof(void *));
+        node->count = total;
+        iter->lst->size += num_values;
+        update_index_count(iter->lst, node);
+        check_list_invariants(iter->lst);
+        check_iter_invariants(iter);
+        return 1;
+    }
+
+    /* Spread the node's elements plus the new values evenly over as
+       few nodes as possible, each at least half full. */
+    num_nodes = (total + iter->lst->node_capacity - 1)/iter->lst->node_capacity;
+    if (!insert_empty_nodes_after(iter->lst, node, num_nodes - 1))
+    {
+        return 0;
+    }
+    tail_count = node->count - (iter->offset + 1);
+    move_fingers(iter->lst, node, iter->offset + 1, tail_count,
+                 node, iter->offset + 1 + num_values);
+    memcpy(tail, node->data + iter->offset + 1, tail_count * sizeof(void *));
+    stream.data[0] = node->data;
+    stream.count[0] = iter->offset + 1;
+    stream.data[1] = values;
+    stream.count[1] = num_values;
+    stream.data[2] = tail;
+    stream.count[2] = tail_count;
+    stream.segment = 0;
+    /* The fingers on iter's node now have offsets into the whole
+       stream, and each new node takes its share of them */
+    base = 0;
+    for (i = 0; i < num_nodes; i++)
+    {
+        node->count = total/num_nodes + ((i < total % num_nodes) ? 1 : 0);
+        stream_copy(&stream, node->data, node->count);
+        update_index_count(iter->lst, node);
+        if (node != iter->node)
+        {
+            move_fingers(iter->lst, iter->node, base, node->count, node, 0);
+        }
+        base += node->count;
+        node = node->next;
+    }
+    iter->lst->size += num_values;
     fixup_iter_node(iter);
     check_list_invariants(iter->lst);
     check_iter_invariants(iter);
+    return 1;
 }
 
-void list_remove_beginning(list* lst)
+int list_append_range(list* lst, void** values, int num_values)
 {
-    list_node* node = lst->first_node;
-    memmove(node->data,
-	    node->data + 1,
-	    (node->count - 1) * sizeof(void *));
-    node->count--;
-    lst->size--;
-    if (node->count == 0)
+    list_node* node;
+    int created_sole_node = 0;
+    int num_new_nodes;
+    check_list_invariants(lst);
+    assert (num_values >= 0);
+    if (num_values == 0)
     {
-	remove_node(lst, node);
+        return 1;
+    }
+    if (lst->last_node == NULL)
+    {
+        if (!insert_empty_sole_node(lst))
+        {
+            return 0;
+        }
+        created_sole_node = 1;
+    }
+    else if (!own_node(lst, &lst->last_node))
+    {
+        return 0;
     }
-    check_list_invariants(lst);
-}
 
-void list_remove_end(list* lst)
-{
-    lst->last_node->count--;
-    lst->size--;
-    if (lst->last_node->count == 0)
+    /* Top off the last node, then fill new nodes completely */
+    node = lst->last_node;
+    pack_node_front(node);
+    num_new_nodes = (node->count + num_values - 1)/lst->node_capacity;
+    if (!insert_empty_nodes_after(lst, node, num_new_nodes))
     {
-	remove_node(lst, lst->last_node);
+        if (created_sole_node)
+        {
+            remove_node(lst, node);
+        }
+        return 0;
+    }
+    lst->size += num_values;
+    for ( ; node != NULL; node = node->next)
+    {
+        int num_copied = lst->node_capacity - node->count;
+        if (num_copied > num_values)
+        {
+            num_copied = num_values;
+        }
+        if (values != NULL)
+        {
+            memcpy(node->data + node->count, values, num_copied * sizeof(void *));
+            values += num_copied;
+        }
+        node->count += num_copied;
+        num_values -= num_copied;
+        update_index_count(lst, node);
     }
     check_list_invariants(lst);
+    return 1;
 }
 
-list_iter list_first(list* lst)
+int list_splice(list_iter* dst_iter, list* src)
 {
-    list_iter result;
-    result.lst = lst;
-    result.node = lst->first_node; /* Okay if NULL */
-    result.offset = 0;
-    return result;
+    list_iter first = list_first(src);
+    list_iter last = end_iter(src);
+    return move_range(dst_iter, &first, &last);
 }
 
-list_iter list_last(list* lst)
+int list_splice_range(list_iter* dst_iter, list_iter* first, list_iter* last)
 {
-    list_iter result;
-    result.lst = lst;
-    result.node = lst->last_node; /* Okay if NULL */
-    if (result.node != NULL)
-    {
-        result.offset = result.node->count - 1;
-    }
-    else
-    {
-        result.offset = 0;
-    }
-    return result;
+    return move_range(dst_iter, first, last);
 }
 
-void list_swap(list* lst1, list* lst2)
+int list_chop(list_iter* iter, list* out)
 {
-    /* Just use memberwise struct copy */
-    list temp;
-    temp = *lst1;
-    *lst1 = *lst2;
-    *lst2 = temp;
-
-    check_list_invariants(lst1);
-    check_list_invariants(lst2);
+    list_iter dst_iter = end_iter(out);
+    list_iter last = end_iter(iter->lst);
+    return move_range(&dst_iter, iter, &last);
 }
 
-static int split_node(list_iter* iter)
+int list_remove(list_iter* iter)
 {
-    list_node* node = iter->node;
-    assert(node->count == ELEMENTS_PER_LIST_NODE);
-    if (!insert_empty_node_after(iter->lst, node))
+    list_node* node;
+    check_list_invariants(iter->lst);
+    check_iter_invariants(iter);
+    assert (!list_at_end(*iter));
+    if (!own_node(iter->lst, &iter->node))
     {
         return 0;
     }
-    node->next->count = node->count - node->count/2;
-    node->count = node->count/2;
-    memcpy(node->next->data,
-	   node->data + node->count,
-           node->next->count * sizeof(void *));
-    if (iter->offset >= node->count)
+    node = iter->node;
+    close_gap(iter->lst, node, iter->offset);
+    iter->lst->size--;
+    update_index_count(iter->lst, node);
+    if (iter->lst->max_lazy_removals == 0)
     {
-        iter->node = node->next;
-        iter->offset -= node->count;
+        rebalance_nodes(iter);
     }
-    return 1;
-}
-
-static void rebalance_nodes(list_iter* iter)
-{
-    list_node* node = iter->node;
-    if (node->next == NULL || node->prev == NULL)
+    else
     {
-        /* If it's the first or last node, it's allowed to be
-           underfull, but not empty */
+        iter->lst->sparse = 1;
         if (node->count == 0)
         {
             fixup_iter_node(iter);
-	    remove_node(iter->lst, node);
+            remove_node(iter->lst, node);
         }
-        return;
     }
+    /* Need to fix up if deleted rightmost element in the node */
+    fixup_iter_node(iter);
+    if (iter->lst->max_lazy_removals > 0 &&
+        ++iter->lst->num_lazy_removals >= iter->lst->max_lazy_removals)
+    {
+        /* If this runs out of memory, the list just stays sparse */
+        compact_nodes(iter->lst, iter);
+    }
+    check_list_invariants(iter->lst);
+    check_iter_invariants(iter);
+    return 1;
+}
 
-    /* Sum the number of elements in this node, its predecessor, and
-       its successor. Fit the result into as few nodes as possible. */
+void list_set_lazy_rebalancing(list* lst, int max_lazy_removals)
+{
+    assert(max_lazy_removals >= 0);
+    if (max_lazy_removals == 0 && lst->sparse)
+    {
+        compact_nodes(lst, NULL);
+    }
+    lst->max_lazy_removals = max_lazy_removals;
+    lst->num_lazy_removals = 0;
+}
+
+int list_compact(list* lst)
+{
+    int result = compact_nodes(lst, NULL);
+    check_list_invariants(lst);
+    return result;
+}
+
+int list_compact_contiguous(list* lst)
+{
+    int num_nodes = (lst->size + lst->node_capacity - 1) / lst->node_capacity;
+    list_node* new_nodes = NULL;
+    list_node* new_last = NULL;
+    list_index_entry* entries;
+    list_node* node;
+    list_node* next_node;
+    list_node* write;
+    int i;
+    check_list_invariants(lst);
+    if (num_nodes == 0)
+    {
+        return 1;
+    }
+    if (lst->pool != NULL && !allocate_slab(lst->pool, num_nodes))
+    {
+        return 0;
+    }
+    /* A fresh slab's nodes are at the top of the pool's free list,
+       in address order, so they are taken in that order here */
+    for (i = 0; i < num_nodes; i++)
+    {
+        node = acquire_node(lst);
+        if (node == NULL)
+        {
+            while (new_nodes != NULL)
+            {
+                node = new_nodes;
+                new_nodes = node->next;
+                release_node(lst, node);
+            }
+            return 0;
+        }
+        node->start = 0;
+        node->count = 0;
+        node->refcount = 1;
+        set_node_index_entry(node, NULL);
+        node->next = NULL;
+        node->prev = new_last;
+        if (new_last != NULL)
+        {
+            new_last->next = node;
+        }
+        else
+        {
+            new_nodes = node;
+        }
+        new_last = node;
+    }
+
+    entries = detach_index(lst, NULL);
+    write = new_nodes;
+    for (node = lst->first_node; node != NULL; node = next_node)
+    {
+        int offset = 0;
+        next_node = node->next;
+        while (offset < node->count)
+        {
+            int num_copied = lst->node_capacity - write->count;
+            if (num_copied > node->count - offset)
+            {
+                num_copied = node->count - offset;
+            }
+            memcpy(write->data + write->count,
+                   NODE_ELEMENTS(node) + offset,
+                   num_copied * sizeof(void *));
+            move_fingers(lst, node, offset, num_copied, write, write->count);
+            write->count += num_copied;
+            offset += num_copied;
+            if (write->count == lst->node_capacity)
+            {
+                write = write->next;
+            }
+        }
+        free_node(lst, node);
+    }
+    lst->first_node = new_nodes;
+    lst->last_node = new_last;
+    lst->sparse = 0;
+    lst->shared = 0;
+    lst->num_lazy_removals = 0;
+    attach_index(lst, entries);
+    check_list_invariants(lst);
+    return 1;
+}
+
+int list_remove_range(list_iter* first, list_iter* last)
+{
+    list* lst = first->lst;
+    list_node* seam_left;
+    list_node* node;
+    list_node* next_node;
+    check_list_invariants(lst);
+    check_iter_invariants(first);
+    check_iter_invariants(last);
+    assert (last->lst == lst);
+    if (!unshare_nodes(lst, first, last, NULL))
+    {
+        return 0;
+    }
+    if (first->node == last->node &&
+        (first->node == NULL || first->offset == last->offset))
+    {
+        return 1;
+    }
+    assert (first->node != last->node || first->offset < last->offset);
+
+    if (first->node == last->node)
+    {
+        node = first->node;
+        drop_fingers(lst, node, first->offset, last->offset - first->offset,
+                     node, last->offset);
+        move_fingers(lst, node, last->offset, node->count - last->offset,
+                     node, first->offset);
+        memmove(NODE_ELEMENTS(node) + first->offset,
+                NODE_ELEMENTS(node) + last->offset,
+                (node->count - last->offset) * sizeof(void *));
+        node->count -= last->offset - first->offset;
+        lst->size -= last->offset - first->offset;
+        update_index_count(lst, node);
+        move_fingers(lst, node, node->count, 1, node->next, 0);
+        last->offset = first->offset;
+        fixup_iter_node(last);
+        seam_left = node;
+    }
+    else
+    {
+        /* Fingers on removed elements move to the one at last */
+        for (node = first->node; node != last->node; node = node->next)
+        {
+            int offset = (node == first->node) ? first->offset : 0;
+            drop_fingers(lst, node, offset, node->count - offset,
+                         last->node, last->offset);
+        }
+        if (last->node != NULL)
+        {
+            drop_fingers(lst, last->node, 0, last->offset,
+                         last->node, last->offset);
+            move_fingers(lst, last->node, 0, last->node->count,
+                         last->node, -last->offset);
+        }
+
+        /* Trim the partial nodes at either end, then free every node
+           in between without looking at its elements */
+        if (first->offset > 0)
+        {
+            seam_left = first->node;
+            lst->size -= seam_left->count - first->offset;
+            seam_left->count = first->offset;
+            update_index_count(lst, seam_left);
+        }
+        else
+        {
+            seam_left = first->node->prev;
+        }
+        if (last->node != NULL)
+        {
+            node = last->node;
+            node->start += last->offset;
+            node->count -= last->offset;
+            lst->size -= last->offset;
+            last->offset = 0;
+            update_index_count(lst, node);
+        }
+        for (node = (seam_left != NULL) ? seam_left->next : lst->first_node;
+             node != last->node;
+             node = next_node)
+        {
+            next_node = node->next;
+            lst->size -= node->count;
+            remove_node(lst, node);
+        }
+    }
+    merge_small_nodes(lst,
+                      (seam_left == NULL) ? lst->first_node :
+                      (seam_left->prev != NULL) ? seam_left->prev : seam_left,
+                      3, last);
+    *first = *last;
+    check_list_invariants(lst);
+    check_iter_invariants(last);
+    return 1;
+}
+
+int list_remove_if(list* lst, list_predicate pred, void* context)
+{
+    list_node* read_node;
+    list_node* write_node;
+    int write_offset = 0;
+    int old_size = lst->size;
+    check_list_invariants(lst);
+    if (!unshare_nodes(lst, NULL, NULL, NULL))
+    {
+        return -1;
+    }
+
+    /* The write position never passes the read position, so
+       survivors can be packed into the nodes already read. */
+    write_node = lst->first_node;
+    lst->size = 0;
+    for (read_node = lst->first_node; read_node != NULL; read_node = read_node->next)
+    {
+        void** read_elements = NODE_ELEMENTS(read_node);
+        int read_count = read_node->count;
+        int has_fingers = node_has_fingers(lst, read_node);
+        int i;
+        for (i = 0; i < read_count; i++)
+        {
+            void* value = read_elements[i];
+            if (has_fingers)
+            {
+                /* The next element kept is written where the write
+                   position is now, whether or not this one is kept */
+                move_fingers(lst, read_node, i, 1, write_node, write_offset);
+            }
+            if (!pred(value, context))
+            {
+                write_node->data[write_offset++] = value;
+                if (write_offset == lst->node_capacity)
+                {
+                    write_node->start = 0;
+                    write_node->count = write_offset;
+                    update_index_count(lst, write_node);
+                    lst->size += write_offset;
+                    write_node = write_node->next;
+                    write_offset = 0;
+                }
+            }
+        }
+    }
+
+    /* Trim the last partially written node and free the rest */
+    if (write_node != NULL)
+    {
+        list_node* node;
+        list_node* next_node;
+        drop_fingers(lst, write_node, write_offset, 1, NULL, 0);
+        if (write_offset > 0)
+        {
+            write_node->start = 0;
+            write_node->count = write_offset;
+            update_index_count(lst, write_node);
+            lst->size += write_offset;
+            write_node = write_node->next;
+        }
+        for (node = write_node; node != NULL; node = next_node)
+        {
+            next_node = node->next;
+            remove_node(lst, node);
+        }
+    }
+    check_list_invariants(lst);
+    return old_size - lst->size;
+}
+
+int list_sort(list* lst, list_comparator cmp, void* context)
+{
+    /* runs[i] holds a sorted chain of 2^i nodes' elements, or NULL,
+       like the digits of a binary counter. 32 is enough for any
+       number of nodes an int-sized list can have. */
+    list_node* runs[32];
+    int num_runs = 0;
+    list_node* free_nodes = NULL;
+    list_index_entry* entries;
+    void** buffer;
+    list_node* node;
+    list_node* run;
+    int i;
+    check_list_invariants(lst);
+    if (!unshare_nodes(lst, NULL, NULL, NULL))
+    {
+        return 0;
+    }
+    if (lst->first_node == NULL || lst->first_node->next == NULL)
+    {
+        if (lst->first_node != NULL)
+        {
+            sort_node(lst->first_node, cmp, context);
+        }
+        park_fingers(lst);
+        return 1;
+    }
+    if (!allocate_spare_nodes(lst, &free_nodes, 2))
+    {
+        return 0;
+    }
+    entries = detach_index(lst, NULL);
+    park_fingers(lst);
+
+    /* Initial runs are sorted as arrays in a fixed-size buffer where
+       possible, which is much faster than merging nodes pairwise */
+    buffer = (void **)malloc(2 * LIST_SORT_BUFFER_ELEMENTS * sizeof(void *));
+    node = lst->first_node;
+    while (node != NULL)
+    {
+        run = sort_run(&node, buffer, LIST_SORT_BUFFER_ELEMENTS, cmp, context,
+                       lst->node_capacity, &free_nodes);
+        for (i = 0; i < num_runs && runs[i] != NULL; i++)
+        {
+            run = merge_chains(runs[i], run, cmp, context,
+                               lst->node_capacity, &free_nodes, NULL, NULL);
+            runs[i] = NULL;
+        }
+        if (i == num_runs)
+        {
+            num_runs++;
+        }
+        runs[i] = run;
+    }
+    free(buffer);
+    /* Larger runs hold earlier elements, so merge them in front */
+    run = NULL;
+    for (i = 0; i < num_runs; i++)
+    {
+        if (runs[i] != NULL)
+        {
+            run = (run == NULL) ? runs[i]
+                : merge_chains(runs[i], run, cmp, context,
+                               lst->node_capacity, &free_nodes, NULL, NULL);
+        }
+    }
+    lst->first_node = run;
+    lst->last_node = chain_last(run);
+
+    free_chain(lst, free_nodes);
+    attach_index(lst, entries);
+    check_list_invariants(lst);
+    return 1;
+}
+
+int list_merge_sorted(list* dst, list* src, list_comparator cmp, void* context)
+{
+    list_node* free_nodes = NULL;
+    list_index_entry* entries = NULL;
+    check_list_invariants(dst);
+    check_list_invariants(src);
+    assert (dst != src);
+    assert (src->pool == dst->pool);
+    assert (src->node_capacity == dst->node_capacity);
+    if (src->first_node == NULL)
+    {
+        return 1;
+    }
+    if (!unshare_nodes(dst, NULL, NULL, NULL) || !unshare_nodes(src, NULL, NULL, NULL))
+    {
+        return 0;
+    }
+
+    /* Allocate everything up front, so failure leaves both lists alone.
+       The merged list needs no more nodes than the two lists have, but
+       may need all of them, since part-full nodes can be linked in as
+       they are, so src needs an index entry for each of its nodes. */
+    if (!allocate_spare_nodes(dst, &free_nodes, 2))
+    {
+        return 0;
+    }
+    if (dst->indexed && !src->indexed)
+    {
+        list_node* node;
+        for (node = src->first_node; node != NULL; node = node->next)
+        {
+            list_index_entry* entry = (list_index_entry *)malloc(sizeof(list_index_entry));
+            if (entry == NULL)
+            {
+                while (entries != NULL)
+                {
+                    entry = entries;
+                    entries = entries->parent;
+                    free(entry);
+                }
+                free_chain(dst, free_nodes);
+                return 0;
+            }
+            entry->parent = entries;
+            entries = entry;
+        }
+    }
+    entries = detach_index(dst, entries);
+    entries = detach_index(src, entries);
+
+    /* Fingers on nodes linked in whole stay put, and go to dst */
+    dst->first_node = merge_chains(dst->first_node, src->first_node, cmp, context,
+                                   dst->node_capacity, &free_nodes, dst, src);
+    pass_node_fingers(src, dst);
+    dst->last_node = chain_last(dst->first_node);
+    dst->size += src->size;
+    dst->sparse = dst->sparse || src->sparse;
+    src->first_node = NULL;
+    src->last_node = NULL;
+    src->size = 0;
+
+    free_chain(dst, free_nodes);
+    attach_index(dst, entries);
+    check_list_invariants(dst);
+    check_list_invariants(src);
+    return 1;
+}
+
+int list_set_union(list* dst, list* a, list* b, list_comparator cmp, void* context)
+{
+    return merge_sets(dst, a, b, cmp, context, 1, 1, 1);
+}
+
+int list_set_intersection(list* dst, list* a, list* b, list_comparator cmp, void* context)
+{
+    return merge_sets(dst, a, b, cmp, context, 0, 0, 1);
+}
+
+int list_set_difference(list* dst, list* a, list* b, list_comparator cmp, void* context)
+{
+    return merge_sets(dst, a, b, cmp, context, 1, 0, 0);
+}
+
+void list_remove_beginning(list* lst)
+{
+    list_node* node = lst->first_node;
+    node->start++;
+    node->count--;
+    lst->size--;
+    update_index_count(lst, node);
+    close_fingers_gap(lst, node, 0);
+    if (node->count == 0)
+    {
+	remove_node(lst, node);
+    }
+    check_list_invariants(lst);
+}
+
+void list_remove_end(list* lst)
+{
+    lst->last_node->count--;
+    lst->size--;
+    update_index_count(lst, lst->last_node);
+    close_fingers_gap(lst, lst->last_node, lst->last_node->count);
+    if (lst->last_node->count == 0)
+    {
+	remove_node(lst, lst->last_node);
+    }
+    check_list_invariants(lst);
+}
+
+list_iter list_first(list* lst)
+{
+    list_iter result;
+    result.lst = lst;
+    result.node = lst->first_node; /* Okay if NULL */
+    result.offset = 0;
+    return result;
+}
+
+list_iter list_last(list* lst)
+{
+    list_iter result;
+    result.lst = lst;
+    result.node = lst->last_node; /* Okay if NULL */
+    if (result.node != NULL)
+    {
+        result.offset = result.node->count - 1;
+    }
+    else
+    {
+        result.offset = 0;
+    }
+    return result;
+}
+
+list_node_pool list_node_pool_create(int nodes_per_slab)
+{
+    return list_node_pool_create_with_capacity(nodes_per_slab, 0);
+}
+
+list_node_pool list_node_pool_create_with_capacity(int nodes_per_slab, int node_capacity)
+{
+    list_node_pool result;
+    assert(nodes_per_slab >= 0);
+    assert(node_capacity == 0 ||
+           (node_capacity >= 2 && node_capacity <= ELEMENTS_PER_LIST_NODE));
+    result.node_capacity = (node_capacity > 0) ? node_capacity
+        : list_node_capacity_for_cache_lines(LIST_DEFAULT_NODE_CACHE_LINES);
+    result.nodes_per_slab = (nodes_per_slab > 0) ? nodes_per_slab
+                                                 : LIST_NODE_POOL_DEFAULT_SLAB_NODES;
+    result.num_slabs = 0;
+    result.slabs = NULL;
+    result.free_nodes = NULL;
+    return result;
+}
+
+void list_node_pool_destroy(list_node_pool* pool)
+{
+    void* slab;
+    void* next_slab;
+    for (slab = pool->slabs; slab != NULL; slab = next_slab)
+    {
+        next_slab = *(void **)slab;
+        free(slab);
+    }
+    pool->num_slabs = 0;
+    pool->slabs = NULL;
+    pool->free_nodes = NULL;
+}
+
+int list_build_index(list* lst)
+{
+#if !LIST_COMPACT_NODES
+    list_node* node;
+#endif
+    if (lst->indexed)
+    {
+        return 1;
+    }
+#if LIST_COMPACT_NODES
+    return 0;
+#else
+    lst->indexed = 1;
+    for (node = lst->first_node; node != NULL; node = node->next)
+    {
+        set_node_index_entry(node, NULL);
+    }
+    for (node = lst->first_node; node != NULL; node = node->next)
+    {
+        if (!index_insert_entry(lst, node))
+        {
+            list_drop_index(lst);
+            return 0;
+        }
+        update_index_count(lst, node);
+    }
+    check_list_invariants(lst);
+    return 1;
+#endif
+}
+
+void list_drop_index(list* lst)
+{
+    list_node* node;
+    if (!lst->indexed)
+    {
+        return;
+    }
+    for (node = lst->first_node; node != NULL; node = node->next)
+    {
+        free(node_index_entry(node));
+        set_node_index_entry(node, NULL);
+    }
+    lst->indexed = 0;
+    lst->index_root = NULL;
+    lst->weight = NULL;
+    lst->weight_context = NULL;
+    check_list_invariants(lst);
+}
+
+int list_build_weighted_index(list* lst, list_weight_function weight, void* context)
+{
+    assert(weight != NULL);
+    list_drop_index(lst);
+    lst->weight = weight;
+    lst->weight_context = context;
+    if (!list_build_index(lst))
+    {
+        lst->weight = NULL;
+        lst->weight_context = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+list_iter list_iter_at(list* lst, int index)
+{
+    list_iter result;
+    assert(index >= 0 && index <= lst->size);
+    result.lst = lst;
+    result.node = NULL;
+    result.offset = 0;
+    if (index == lst->size)
+    {
+        return result;
+    }
+    if (lst->indexed)
+    {
+        list_index_entry* entry = lst->index_root;
+        while (1)
+        {
+            int left_count = (entry->left != NULL) ? entry->left->subtree_count : 0;
+            if (index < left_count)
+            {
+                entry = entry->left;
+            }
+            else if (index < left_count + entry->count)
+            {
+                result.node = entry->node;
+                result.offset = index - left_count;
+                break;
+            }
+            else
+            {
+                index -= left_count + entry->count;
+                entry = entry->right;
+            }
+        }
+    }
+    else if (index < lst->size/2)
+    {
+        for (result.node = lst->first_node;
+             index >= result.node->count;
+             result.node = result.node->next)
+        {
+            index -= result.node->count;
+        }
+        result.offset = index;
+    }
+    else
+    {
+        /* Count backwards from the end, which is closer */
+        index = lst->size - 1 - index;
+        for (result.node = lst->last_node;
+             index >= result.node->count;
+             result.node = result.node->prev)
+        {
+            index -= result.node->count;
+        }
+        result.offset = result.node->count - 1 - index;
+    }
+    check_iter_invariants(&result);
+    return result;
+}
+
+int list_iter_index(list_iter iter)
+{
+    int result;
+    check_iter_invariants(&iter);
+    if (list_at_end(iter))
+    {
+        return iter.lst->size;
+    }
+    result = iter.offset;
+    if (iter.lst->indexed)
+    {
+        list_index_entry* entry = node_index_entry(iter.node);
+        if (entry->left != NULL)
+        {
+            result += entry->left->subtree_count;
+        }
+        for ( ; entry->parent != NULL; entry = entry->parent)
+        {
+            if (entry == entry->parent->right)
+            {
+                result += entry->parent->count;
+                if (entry->parent->left != NULL)
+                {
+                    result += entry->parent->left->subtree_count;
+                }
+            }
+        }
+    }
+    else
+    {
+        list_node* node;
+        for (node = iter.node->prev; node != NULL; node = node->prev)
+        {
+            result += node->count;
+        }
+    }
+    return result;
+}
+
+list_iter list_seek_weight(list* lst, long weight)
+{
+    list_iter result;
+    list_index_entry* entry = lst->index_root;
+    assert(lst->weight != NULL && weight >= 0);
+    result.lst = lst;
+    result.node = NULL;
+    result.offset = 0;
+    if (entry == NULL || weight >= entry->subtree_weight)
+    {
+        return result;
+    }
+    while (1)
+    {
+        long left_weight = (entry->left != NULL) ? entry->left->subtree_weight : 0;
+        if (weight < left_weight)
+        {
+            entry = entry->left;
+        }
+        else if (weight < left_weight + entry->weight)
+        {
+            break;
+        }
+        else
+        {
+            weight -= left_weight + entry->weight;
+            entry = entry->right;
+        }
+    }
+
+    /* Weigh the node's elements up to the one containing the offset */
+    weight -= (entry->left != NULL) ? entry->left->subtree_weight : 0;
+    result.node = entry->node;
+    while (1)
+    {
+        long element_weight = lst->weight(NODE_ELEMENTS(result.node)[result.offset],
+                                          lst->weight_context);
+        if (weight < element_weight)
+        {
+            break;
+        }
+        weight -= element_weight;
+        result.offset++;
+    }
+    check_iter_invariants(&result);
+    return result;
+}
+
+long list_prefix_weight(list_iter iter)
+{
+    list* lst = iter.lst;
+    list_index_entry* entry;
+    long result = 0;
+    int i;
+    check_iter_invariants(&iter);
+    assert(lst->weight != NULL);
+    if (list_at_end(iter))
+    {
+        return (lst->index_root != NULL) ? lst->index_root->subtree_weight : 0;
+    }
+    for (i = 0; i < iter.offset; i++)
+    {
+        result += lst->weight(NODE_ELEMENTS(iter.node)[i], lst->weight_context);
+    }
+    entry = node_index_entry(iter.node);
+    if (entry->left != NULL)
+    {
+        result += entry->left->subtree_weight;
+    }
+    for ( ; entry->parent != NULL; entry = entry->parent)
+    {
+        if (entry == entry->parent->right)
+        {
+            result += entry->parent->weight;
+            if (entry->parent->left != NULL)
+            {
+                result += entry->parent->left->subtree_weight;
+            }
+        }
+    }
+    return result;
+}
+
+void list_update_weight(list_iter iter)
+{
+    check_iter_invariants(&iter);
+    assert(iter.lst->weight != NULL && !list_at_end(iter));
+    update_index_count(iter.lst, iter.node);
+    check_list_invariants(iter.lst);
+}
+
+void list_for_each_span(list* lst, list_span_function fn, void* context)
+{
+    check_list_invariants(lst);
+    LIST_ITERATE_SPANS(lst, data, count)
+        fn(data, count, context);
+    LIST_ITERATE_SPANS_END()
+}
+
+list_iter list_find(list* lst, void* value)
+{
+    return list_find_from(list_first(lst), value);
+}
+
+list_iter list_find_from(list_iter iter, void* value)
+{
+    check_list_invariants(iter.lst);
+    check_iter_invariants(&iter);
+    if (iter.node != NULL)
+    {
+        iter.node = find_in_nodes(iter.node, iter.offset, value, &iter.offset);
+        if (iter.node == NULL)
+        {
+            iter.offset = 0;
+        }
+    }
+    return iter;
+}
+
+int list_count(list* lst, void* value)
+{
+    check_list_invariants(lst);
+    if (lst->first_node == NULL)
+    {
+        return 0;
+    }
+    return count_in_nodes(lst->first_node, value);
+}
+
+int list_take_snapshot(list* lst, list_snapshot* snapshot)
+{
+    list_node* node;
+    int num_nodes = 0;
+    int i = 0;
+    check_list_invariants(lst);
+    for (node = lst->first_node; node != NULL; node = node->next)
+    {
+        num_nodes++;
+    }
+    snapshot->size = lst->size;
+    snapshot->num_spans = num_nodes;
+    snapshot->spans = NULL;
+    snapshot->pool = lst->pool;
+    if (num_nodes == 0)
+    {
+        return 1;
+    }
+    snapshot->spans = (list_snapshot_span *)malloc(num_nodes * sizeof(list_snapshot_span));
+    if (snapshot->spans == NULL)
+    {
+        snapshot->num_spans = 0;
+        return 0;
+    }
+    for (node = lst->first_node; node != NULL; node = node->next)
+    {
+        list_prefetch(node->next);
+        snapshot->spans[i].node = node;
+        snapshot->spans[i].data = NODE_ELEMENTS(node);
+        snapshot->spans[i].count = node->count;
+        add_refcount(node, 1);
+        i++;
+    }
+    lst->shared = 1;
+    return 1;
+}
+
+void list_snapshot_destroy(list_snapshot* snapshot)
+{
+    int i;
+    for (i = 0; i < snapshot->num_spans; i++)
+    {
+        list_node* node = snapshot->spans[i].node;
+        if (add_refcount(node, -1) == 0)
+        {
+            /* The list has already let go of the node */
+            if (snapshot->pool == NULL)
+            {
+                free(node);
+            }
+            else
+            {
+                node->next = snapshot->pool->free_nodes;
+                snapshot->pool->free_nodes = node;
+            }
+        }
+    }
+    free(snapshot->spans);
+    snapshot->size = 0;
+    snapshot->num_spans = 0;
+    snapshot->spans = NULL;
+}
+
+int list_unshare(list* lst)
+{
+    int result = unshare_nodes(lst, NULL, NULL, NULL);
+    check_list_invariants(lst);
+    return result;
+}
+
+list_snapshot_iter list_snapshot_first(list_snapshot* snapshot)
+{
+    list_snapshot_iter result;
+    result.snapshot = snapshot;
+    result.span = 0;
+    result.offset = 0;
+    return result;
+}
+
+void list_swap(list* lst1, list* lst2)
+{
+    /* Just use memberwise struct copy */
+    list temp;
+    list_finger* finger;
+    temp = *lst1;
+    *lst1 = *lst2;
+    *lst2 = temp;
+    for (finger = lst1->fingers; finger != NULL; finger = finger->next)
+    {
+        finger->iter.lst = lst1;
+    }
+    for (finger = lst2->fingers; finger != NULL; finger = finger->next)
+    {
+        finger->iter.lst = lst2;
+    }
+
+    check_list_invariants(lst1);
+    check_list_invariants(lst2);
+}
+
+void list_add_finger(list_finger* finger, list_iter iter)
+{
+    list* lst = iter.lst;
+    check_iter_invariants(&iter);
+    finger->iter = iter;
+    finger->prev = NULL;
+    finger->next = lst->fingers;
+    if (lst->fingers != NULL)
+    {
+        lst->fingers->prev = finger;
+    }
+    lst->fingers = finger;
+    check_list_invariants(lst);
+}
+
+void list_remove_finger(list_finger* finger)
+{
+    if (finger->prev != NULL)
+    {
+        finger->prev->next = finger->next;
+    }
+    else
+    {
+        finger->iter.lst->fingers = finger->next;
+    }
+    if (finger->next != NULL)
+    {
+        finger->next->prev = finger->prev;
+    }
+    finger->next = NULL;
+    finger->prev = NULL;
+}
+
+list_iter list_finger_iter(list_finger* finger)
+{
+    check_iter_invariants(&finger->iter);
+    return finger->iter;
+}
+
+void list_set_finger(list_finger* finger, list_iter iter)
+{
+    check_iter_invariants(&iter);
+    assert (iter.lst == finger->iter.lst);
+    finger->iter = iter;
+}
+
+list_batch list_batch_create(list* lst)
+{
+    list_batch result;
+    result.lst = lst;
+    result.edits = NULL;
+    result.num_edits = 0;
+    result.max_edits = 0;
+    return result;
+}
+
+void list_batch_destroy(list_batch* batch)
+{
+    free(batch->edits);
+    batch->edits = NULL;
+    batch->num_edits = 0;
+    batch->max_edits = 0;
+}
+
+int list_batch_insert(list_batch* batch, list_iter iter, void* value)
+{
+    return record_edit(batch, iter, 0, value);
+}
+
+int list_batch_remove(list_batch* batch, list_iter iter)
+{
+    assert (!list_at_end(iter));
+    return record_edit(batch, iter, 1, NULL);
+}
+
+int list_batch_apply(list_batch* batch)
+{
+    list* lst = batch->lst;
+    list_batch_edit* edits = batch->edits;
+    int num_edits = batch->num_edits;
+    list_node* free_nodes = NULL;
+    list_index_entry* entries = NULL;
+    void** scratch;
+    int num_nodes, num_entries, e, end_edit, i;
+    check_list_invariants(lst);
+    if (num_edits == 0)
+    {
+        return 1;
+    }
+    if (lst->first_node == NULL)
+    {
+        /* Only insertions at the end are possible, in recorded order */
+        void** values = (void **)malloc(num_edits * sizeof(void *));
+        if (values == NULL)
+        {
+            return 0;
+        }
+        for (i = 0; i < num_edits; i++)
+        {
+            assert (!edits[i].remove);
+            values[i] = edits[i].value;
+        }
+        if (!list_append_range(lst, values, num_edits))
+        {
+            free(values);
+            return 0;
+        }
+        free(values);
+        batch->num_edits = 0;
+        return 1;
+    }
+
+    /* Insertions at the end go after the last element of the last
+       node, and were recorded last */
+    for (i = num_edits - 1; i >= 0 && edits[i].node == NULL; i--)
+    {
+        edits[i].node = lst->last_node;
+        edits[i].offset = lst->last_node->count;
+    }
+
+    /* Allocate the nodes added or replacing shared ones, and their
+       index entries, up front, so failure leaves the list alone */
+    num_nodes = 0;
+    num_entries = 0;
+    for (e = 0; e < num_edits; e = end_edit)
+    {
+        int total = count_batch_node(edits, num_edits, e, &end_edit);
+        int num_out = (total + lst->node_capacity - 1)/lst->node_capacity;
+        if (num_out > 0)
+        {
+            num_nodes += num_out - 1;
+            num_entries += num_out - 1;
+            if (lst->shared && load_refcount(edits[e].node) > 1)
+            {
+                num_nodes++;
+            }
+        }
+    }
+    scratch = (void **)malloc(lst->node_capacity * sizeof(void *));
+    if (scratch == NULL)
+    {
+        return 0;
+    }
+    if (!allocate_spare_nodes(lst, &free_nodes, num_nodes))
+    {
+        free(scratch);
+        return 0;
+    }
+    for (i = 0; lst->indexed && i < num_entries; i++)
+    {
+        list_index_entry* entry = (list_index_entry *)malloc(sizeof(list_index_entry));
+        if (entry == NULL)
+        {
+            while (entries != NULL)
+            {
+                entry = entries;
+                entries = entries->parent;
+                free(entry);
+            }
+            free_chain(lst, free_nodes);
+            free(scratch);
+            return 0;
+        }
+        entry->parent = entries;
+        entries = entry;
+    }
+
+    /* Nodes are rebuilt in list order, so that fingers passed on from
+       one node land on an original element of the next */
+    for (e = 0; e < num_edits; e = end_edit)
+    {
+        int num_old = edits[e].node->count;
+        int total = count_batch_node(edits, num_edits, e, &end_edit);
+        list_node* node = apply_batch_node(lst, edits, e, end_edit, total, scratch,
+                                           &free_nodes, &entries);
+        if (total < num_old && node != NULL)
+        {
+            /* Merge with the neighbors as list_remove() would, unless
+               the next node is still to be rebuilt */
+            if (lst->max_lazy_removals == 0 &&
+                (end_edit == num_edits || edits[end_edit].node != node->next))
+            {
+                list_iter iter;
+                iter.lst = lst;
+                iter.node = node;
+                iter.offset = 0;
+                rebalance_nodes(&iter);
+            }
+            else
+            {
+                lst->sparse = 1;
+            }
+        }
+    }
+    assert (free_nodes == NULL && entries == NULL);
+    free(scratch);
+    batch->num_edits = 0;
+    check_list_invariants(lst);
+    return 1;
+}
+
+static int split_node(list_iter* iter)
+{
+    list_node* node = iter->node;
+    assert(node->count == iter->lst->node_capacity);
+    if (!insert_empty_node_after(iter->lst, node))
+    {
+        return 0;
+    }
+    move_fingers(iter->lst, node, node->count/2, node->count - node->count/2,
+                 node->next, 0);
+    node->next->count = node->count - node->count/2;
+    node->count = node->count/2;
+    memcpy(node->next->data,
+	   NODE_ELEMENTS(node) + node->count,
+           node->next->count * sizeof(void *));
+    update_index_count(iter->lst, node);
+    update_index_count(iter->lst, node->next);
+    if (iter->offset >= node->count)
+    {
+        iter->node = node->next;
+        iter->offset -= node->count;
+    }
+    return 1;
+}
+
+static int spill_to_neighbor(list_iter* iter)
+{
+    list_node* node = iter->node;
+    list_node* prev = node->prev;
+    list_node* next = node->next;
+    int capacity = iter->lst->node_capacity;
+    int head = 0, tail = 0;
+    assert(node->count == capacity);
+    if (prev != NULL)
+    {
+        head = capacity - prev->count;
+        if (head > iter->offset)
+        {
+            head = iter->offset;
+        }
+    }
+    if (next != NULL)
+    {
+        tail = capacity - next->count;
+        if (tail > node->count - (iter->offset + 1))
+        {
+            tail = node->count - (iter->offset + 1);
+        }
+    }
+    if (head == 0 && tail == 0)
+    {
+        return 0;
+    }
+    if (!own_node(iter->lst, &iter->node))
+    {
+        return 0;
+    }
+    node = iter->node;
+    if (head >= tail)
+    {
+        if (!own_node(iter->lst, &prev))
+        {
+            return 0;
+        }
+        if (prev->start + prev->count + head > capacity)
+        {
+            pack_node_front(prev);
+        }
+        memcpy(NODE_ELEMENTS(prev) + prev->count,
+               NODE_ELEMENTS(node),
+               head * sizeof(void *));
+        move_fingers(iter->lst, node, 0, head, prev, prev->count);
+        move_fingers(iter->lst, node, head, node->count - head, node, 0);
+        prev->count += head;
+        node->start += head;
+        node->count -= head;
+        iter->offset -= head;
+        update_index_count(iter->lst, prev);
+    }
+    else
+    {
+        if (!own_node(iter->lst, &next))
+        {
+            return 0;
+        }
+        if (next->start < tail)
+        {
+            memmove(next->data + capacity - next->count,
+                    NODE_ELEMENTS(next),
+                    next->count * sizeof(void *));
+            next->start = capacity - next->count;
+        }
+        move_fingers(iter->lst, next, 0, next->count, next, tail);
+        move_fingers(iter->lst, node, node->count - tail, tail, next, 0);
+        next->start -= tail;
+        next->count += tail;
+        node->count -= tail;
+        memcpy(NODE_ELEMENTS(next),
+               NODE_ELEMENTS(node) + node->count,
+               tail * sizeof(void *));
+        update_index_count(iter->lst, next);
+    }
+    update_index_count(iter->lst, node);
+    return 1;
+}
+
+static void rebalance_nodes(list_iter* iter)
+{
+    list_node* node = iter->node;
+    int capacity = iter->lst->node_capacity;
+    if (node->next == NULL || node->prev == NULL)
+    {
+        /* If it's the first or last node, it's allowed to be
+           underfull, but not empty */
+        if (node->count == 0)
+        {
+            fixup_iter_node(iter);
+	    remove_node(iter->lst, node);
+        }
+        return;
+    }
+
+    /* Sum the number of elements in this node, its predecessor, and
+       its successor. Fit the result into as few nodes as possible. */
     {
         int elements_sum;
         elements_sum = node->next->count + node->count + node->prev->count;
-        if (elements_sum <= ELEMENTS_PER_LIST_NODE)
+        if (elements_sum <= capacity)
 	{
             /* Merge into one node - can happen if prev/next is
 	       first/last node */
+            pack_node_front(node);
 	    memmove(node->data + node->prev->count,
 		    node->data,
 		    node->count * sizeof(void *));
 	    memcpy(node->data,
-		   node->prev->data,
+		   NODE_ELEMENTS(node->prev),
 		   node->prev->count * sizeof(void *));
 	    memcpy(node->data + node->prev->count + node->count,
-		   node->next->data,
+		   NODE_ELEMENTS(node->next),
 		   node->next->count * sizeof(void *));
+            move_fingers(iter->lst, node, 0, node->count, node, node->prev->count);
+            move_fingers(iter->lst, node->prev, 0, node->prev->count, node, 0);
+            move_fingers(iter->lst, node->next, 0, node->next->count,
+                         node, node->prev->count + node->count);
 	    node->count = elements_sum;
 	    iter->offset += node->prev->count;
+            update_index_count(iter->lst, node);
             remove_node(iter->lst, node->prev);
             remove_node(iter->lst, node->next);
 	}
-        else if ((elements_sum + 1)/2 <= ELEMENTS_PER_LIST_NODE)
+        else if ((elements_sum + 1)/2 <= capacity)
+        {
+            /* Merge into two nodes. The previous node takes the
+               smaller half, which may require elements from both
+               this node and the next one. */
+            int node1_count = (elements_sum + 0)/2;
+            int node2_count = (elements_sum + 1)/2;
+            if (!own_node(iter->lst, &node->prev))
+            {
+                /* Leave the nodes underfull until the list is compacted */
+                iter->lst->sparse = 1;
+                return;
+            }
+            pack_node_front(node->prev);
+            pack_node_front(node);
+            if (node->prev->count <= node1_count)
+            {
+                /* Fill out the previous node from the front of this
+                   node, and if that runs out, from the front of the
+                   next node. */
+                int move_total = node1_count - node->prev->count;
+                int move_1 = (move_total < node->count) ? move_total : node->count;
+                int move_2 = move_total - move_1;
+                memcpy(node->prev->data + node->prev->count,
+                       node->data,
+                       move_1 * sizeof(void *));
+                memcpy(node->prev->data + node->prev->count + move_1,
+                       NODE_ELEMENTS(node->next),
+                       move_2 * sizeof(void *));
+                memmove(node->data,
+                        node->data + move_1,
+                        (node->count - move_1) * sizeof(void *));
+                memcpy(node->data + node->count - move_1,
+                       NODE_ELEMENTS(node->next) + move_2,
+                       (node->next->count - move_2) * sizeof(void *));
+                move_fingers(iter->lst, node, 0, move_1, node->prev, node->prev->count);
+                move_fingers(iter->lst, node->next, 0, move_2,
+                             node->prev, node->prev->count + move_1);
+                move_fingers(iter->lst, node, move_1, node->count - move_1, node, 0);
+                move_fingers(iter->lst, node->next, move_2, node->next->count - move_2,
+                             node, node->count - move_1);
+                iter->offset -= move_total;
+            }
+            else
+            {
+                int move_1 = node->prev->count - node1_count;
+                memmove(node->data + move_1,
+                        node->data,
+                        node->count * sizeof(void *));
+                memcpy(node->data,
+                       node->prev->data + node1_count,
+                       move_1 * sizeof(void *));
+                memcpy(node->data + node->count + move_1,
+                       NODE_ELEMENTS(node->next),
+                       node->next->count * sizeof(void *));
+                move_fingers(iter->lst, node, 0, node->count, node, move_1);
+                move_fingers(iter->lst, node->prev, node1_count, move_1, node, 0);
+                move_fingers(iter->lst, node->next, 0, node->next->count,
+                             node, node->count + move_1);
+                iter->offset += move_1;
+            }
+            node->prev->count = node1_count;
+            node->count = node2_count;
+            update_index_count(iter->lst, node->prev);
+            update_index_count(iter->lst, node);
+            remove_node(iter->lst, node->next);
+        }
+    }
+}
+
+static void** open_gap(list* lst, list_node* node, int offset)
+{
+    void** elements;
+    assert (node->count < lst->node_capacity);
+    move_fingers(lst, node, offset, node->count - offset, node, offset + 1);
+    if (node->start > 0 &&
+        (offset < node->count - offset ||
+         node->start + node->count == lst->node_capacity))
+    {
+        /* Shift the elements before offset down into the free space */
+        node->start--;
+        elements = NODE_ELEMENTS(node);
+        memmove(elements, elements + 1, offset * sizeof(void *));
+    }
+    else
+    {
+        elements = NODE_ELEMENTS(node);
+        memmove(elements + offset + 1,
+                elements + offset,
+                (node->count - offset) * sizeof(void *));
+    }
+    node->count++;
+    return elements + offset;
+}
+
+static void close_gap(list* lst, list_node* node, int offset)
+{
+    void** elements = NODE_ELEMENTS(node);
+    if (offset < node->count - (offset + 1))
+    {
+        memmove(elements + 1, elements, offset * sizeof(void *));
+        node->start++;
+    }
+    else
+    {
+        memmove(elements + offset,
+                elements + offset + 1,
+                (node->count - (offset + 1)) * sizeof(void *));
+    }
+    node->count--;
+    close_fingers_gap(lst, node, offset);
+}
+
+static void pack_node_front(list_node* node)
+{
+    if (node->start > 0)
+    {
+        memmove(node->data, NODE_ELEMENTS(node), node->count * sizeof(void *));
+        node->start = 0;
+    }
+}
+
+static int insert_empty_node_after(list* lst, list_node* node)
+{
+    list_node* new_node = allocate_node(lst);
+    if (new_node == NULL)
+    {
+        return 0;
+    }
+    new_node->count = 0;
+    new_node->start = 0;
+    new_node->next = node->next;
+    new_node->prev = node;
+    node->next = new_node;
+    if (new_node->next != NULL)
+    {
+        new_node->next->prev = new_node;
+    }
+    else
+    {
+        lst->last_node = new_node;
+    }
+    if (!index_insert_entry(lst, new_node))
+    {
+        remove_node(lst, new_node);
+        return 0;
+    }
+    return 1;
+}
+
+static int insert_empty_node_before(list* lst, list_node* node)
+{
+    list_node* new_node = allocate_node(lst);
+    if (new_node == NULL)
+    {
+        return 0;
+    }
+    new_node->count = 0;
+    new_node->start = 0;
+    new_node->prev = node->prev;
+    new_node->next = node;
+    node->prev = new_node;
+    if (new_node->prev != NULL)
+    {
+        new_node->prev->next = new_node;
+    }
+    else
+    {
+        lst->first_node = new_node;
+    }
+    if (!index_insert_entry(lst, new_node))
+    {
+        remove_node(lst, new_node);
+        return 0;
+    }
+    return 1;
+}
+
+static int insert_empty_sole_node(list* lst)
+{
+    list_node* new_node = allocate_node(lst);
+    if (new_node == NULL)
+    {
+        return 0;
+    }
+    new_node->count = 0;
+    new_node->start = 0;
+    new_node->prev = NULL;
+    new_node->next = NULL;
+    lst->first_node = new_node;
+    lst->last_node = new_node;
+    if (!index_insert_entry(lst, new_node))
+    {
+        remove_node(lst, new_node);
+        return 0;
+    }
+    return 1;
+}
+
+static int move_range(list_iter* dst_iter, list_iter* first, list_iter* last)
+{
+    list* src = first->lst;
+    list* dst = dst_iter->lst;
+    list_node* spares[4];
+    int num_spares, i;
+    list_index_entry* entries = NULL;
+    list_node* whole_first;
+    list_node* whole_last;
+    list_node* chain_first;
+    list_node* chain_last;
+    list_node* src_left;
+    list_node* dst_after;
+    list_node* node;
+    int same_node, split_first, split_last, split_dst;
+    int whole_list;
+    int moved;
+
+    check_list_invariants(src);
+    check_list_invariants(dst);
+    check_iter_invariants(dst_iter);
+    check_iter_invariants(first);
+    check_iter_invariants(last);
+    assert (last->lst == src);
+    assert (src != dst);
+    assert (src->pool == dst->pool);
+    assert (src->node_capacity == dst->node_capacity);
+    if (first->node == last->node &&
+        (first->node == NULL || first->offset == last->offset))
+    {
+        return 1;
+    }
+    assert (first->node != last->node || first->offset < last->offset);
+    if (!unshare_nodes(src, first, last, NULL) ||
+        !unshare_nodes(dst, dst_iter, NULL, NULL))
+    {
+        return 0;
+    }
+
+    /* Elements before first or from last onward in the same node stay
+       behind, so the moved parts of those nodes are copied into new
+       nodes. Likewise the node containing dst_iter is split. Every
+       other node in the range is moved whole. */
+    same_node = (first->node == last->node);
+    split_first = !same_node && first->offset > 0;
+    split_last = !same_node && last->node != NULL && last->offset > 0;
+    split_dst = (dst_iter->node != NULL && dst_iter->offset > 0);
+    whole_first = NULL;
+    whole_last = NULL;
+    if (!same_node)
+    {
+        whole_first = split_first ? first->node->next : first->node;
+        whole_last = (last->node != NULL) ? last->node->prev : src->last_node;
+        if (whole_first == last->node)
+        {
+            whole_first = NULL;
+            whole_last = NULL;
+        }
+    }
+
+    /* Allocate everything up front, so failure leaves both lists alone */
+    num_spares = same_node + split_first + split_last + split_dst;
+    for (i = 0; i < num_spares; i++)
+    {
+        spares[i] = allocate_node(dst);
+        if (spares[i] == NULL)
+        {
+            for (i--; i >= 0; i--)
+            {
+                free_node(dst, spares[i]);
+            }
+            return 0;
+        }
+        spares[i]->start = 0;
+        set_node_index_entry(spares[i], NULL);
+    }
+    if (dst->indexed)
+    {
+        int num_entries = num_spares;
+        if (whole_first != NULL)
+        {
+            for (node = whole_first; node != whole_last->next; node = node->next)
+            {
+                num_entries++;
+            }
+        }
+        for (i = 0; i < num_entries; i++)
+        {
+            list_index_entry* entry = (list_index_entry *)malloc(sizeof(list_index_entry));
+            if (entry == NULL)
+            {
+                while (entries != NULL)
+                {
+                    entry = entries;
+                    entries = entries->parent;
+                    free(entry);
+                }
+                for (i = 0; i < num_spares; i++)
+                {
+                    free_node(dst, spares[i]);
+                }
+                return 0;
+            }
+            entry->parent = entries;
+            entries = entry;
+        }
+    }
+
+    /* Detach the range from the source list. Moving a whole list
+       does not require counting the elements moved. Fingers in the
+       range go along with their elements, to dst. */
+    whole_list = (list_at_beginning(*first) && list_at_end(*last));
+    moved = whole_list ? src->size : 0;
+    if (same_node)
+    {
+        node = first->node;
+        chain_first = chain_last = spares[--num_spares];
+        chain_first->count = last->offset - first->offset;
+        memcpy(chain_first->data,
+               NODE_ELEMENTS(node) + first->offset,
+               chain_first->count * sizeof(void *));
+        pass_fingers(src, dst, node, first->offset, chain_first->count, chain_first, 0);
+        move_fingers(src, node, last->offset, node->count - last->offset,
+                     node, first->offset);
+        memmove(NODE_ELEMENTS(node) + first->offset,
+                NODE_ELEMENTS(node) + last->offset,
+                (node->count - last->offset) * sizeof(void *));
+        node->count -= chain_first->count;
+        update_index_count(src, node);
+        moved = chain_first->count;
+        last->offset = first->offset;
+        fixup_iter_node(last);
+        src_left = node;
+    }
+    else
+    {
+        chain_first = whole_first;
+        chain_last = whole_last;
+        src_left = split_first ? first->node : (whole_first != NULL ? whole_first->prev : NULL);
+        if (whole_first != NULL)
+        {
+            if (!whole_list || src->indexed)
+            {
+                for (node = whole_first; node != whole_last->next; node = node->next)
+                {
+                    if (!whole_list)
+                    {
+                        moved += node->count;
+                        pass_fingers(src, dst, node, 0, node->count, node, 0);
+                    }
+                    index_remove_entry(src, node);
+                }
+            }
+            if (whole_list)
+            {
+                pass_node_fingers(src, dst);
+            }
+            unlink_nodes(src, whole_first, whole_last);
+        }
+        if (split_first)
+        {
+            node = spares[--num_spares];
+            node->count = first->node->count - first->offset;
+            memcpy(node->data,
+                   NODE_ELEMENTS(first->node) + first->offset,
+                   node->count * sizeof(void *));
+            pass_fingers(src, dst, first->node, first->offset, node->count, node, 0);
+            first->node->count = first->offset;
+            update_index_count(src, first->node);
+            moved += node->count;
+            node->prev = NULL;
+            node->next = chain_first;
+            if (chain_first != NULL)
+            {
+                chain_first->prev = node;
+            }
+            else
+            {
+                chain_last = node;
+            }
+            chain_first = node;
+        }
+        if (split_last)
+        {
+            node = spares[--num_spares];
+            node->count = last->offset;
+            memcpy(node->data,
+                   NODE_ELEMENTS(last->node),
+                   node->count * sizeof(void *));
+            pass_fingers(src, dst, last->node, 0, node->count, node, 0);
+            move_fingers(src, last->node, last->offset, last->node->count - last->offset,
+                         last->node, 0);
+            last->node->start += last->offset;
+            last->node->count -= last->offset;
+            last->offset = 0;
+            update_index_count(src, last->node);
+            moved += node->count;
+            node->next = NULL;
+            node->prev = chain_last;
+            if (chain_last != NULL)
+            {
+                chain_last->next = node;
+            }
+            else
+            {
+                chain_first = node;
+            }
+            chain_last = node;
+        }
+    }
+    src->size -= moved;
+    merge_small_nodes(src,
+                      (src_left == NULL) ? src->first_node :
+                      (src_left->prev != NULL) ? src_left->prev : src_left,
+                      3, last);
+    *first = *last;
+
+    /* Split the destination node and link the chain in before dst_iter */
+    if (split_dst)
+    {
+        list_node* split = dst_iter->node;
+        node = spares[--num_spares];
+        node->count = split->count - dst_iter->offset;
+        memcpy(node->data,
+               NODE_ELEMENTS(split) + dst_iter->offset,
+               node->count * sizeof(void *));
+        move_fingers(dst, split, dst_iter->offset, node->count, node, 0);
+        split->count = dst_iter->offset;
+        link_nodes(dst, split, node, node);
+        if (dst->indexed)
+        {
+            list_index_entry* entry = entries;
+            entries = entries->parent;
+            index_link_entry(dst, node, entry);
+            update_index_count(dst, node);
+            update_index_count(dst, split);
+        }
+        dst_iter->node = node;
+        dst_iter->offset = 0;
+    }
+    dst_after = (dst_iter->node != NULL) ? dst_iter->node->prev : dst->last_node;
+    link_nodes(dst, dst_after, chain_first, chain_last);
+    dst->size += moved;
+    dst->sparse = dst->sparse || src->sparse;
+    if (dst->indexed)
+    {
+        /* Link entries outward from a neighbor that already has one */
+        node = (dst_after != NULL) ? chain_first : chain_last;
+        while (node != NULL && node_index_entry(node) == NULL)
+        {
+            list_index_entry* entry = entries;
+            entries = entries->parent;
+            index_link_entry(dst, node, entry);
+            update_index_count(dst, node);
+            node = (dst_after != NULL) ? node->next : node->prev;
+        }
+    }
+    assert (num_spares == 0 && entries == NULL);
+
+    /* Merging only ever removes the right node of a pair, so the
+       right seam is handled first to keep dst_after valid. */
+    merge_small_nodes(dst,
+                      (chain_last->prev != NULL) ? chain_last->prev : chain_last,
+                      3, dst_iter);
+    merge_small_nodes(dst,
+                      (dst_after == NULL) ? dst->first_node :
+                      (dst_after->prev != NULL) ? dst_after->prev : dst_after,
+                      3, dst_iter);
+
+    check_list_invariants(src);
+    check_list_invariants(dst);
+    check_iter_invariants(dst_iter);
+    check_iter_invariants(last);
+    return 1;
+}
+
+static int compact_nodes(list* lst, list_iter* iter)
+{
+    int capacity = lst->node_capacity;
+    list_node* write = lst->first_node;
+    list_node* node;
+    list_node* next_node;
+    if (write == NULL)
+    {
+        return 1;
+    }
+    if (!unshare_nodes(lst, iter, NULL, NULL))
+    {
+        /* Stays sparse until a later compaction succeeds */
+        return 0;
+    }
+    write = lst->first_node;
+    for (node = write->next; node != NULL; node = next_node)
+    {
+        int num_moved = capacity - write->count;
+        next_node = node->next;
+        if (num_moved > node->count)
+        {
+            num_moved = node->count;
+        }
+        if (num_moved > 0)
+        {
+            /* Elements are taken from the front of the node just by
+               advancing its start, so each is copied at most twice */
+            if (write->start + write->count + num_moved > capacity)
+            {
+                pack_node_front(write);
+            }
+            memcpy(NODE_ELEMENTS(write) + write->count,
+                   NODE_ELEMENTS(node),
+                   num_moved * sizeof(void *));
+            if (iter != NULL && iter->node == node)
+            {
+                if (iter->offset < num_moved)
+                {
+                    iter->node = write;
+                    iter->offset += write->count;
+                }
+                else
+                {
+                    iter->offset -= num_moved;
+                }
+            }
+            move_fingers(lst, node, 0, num_moved, write, write->count);
+            move_fingers(lst, node, num_moved, node->count - num_moved, node, 0);
+            write->count += num_moved;
+            node->start += num_moved;
+            node->count -= num_moved;
+            update_index_count(lst, write);
+            update_index_count(lst, node);
+        }
+        if (node->count == 0)
+        {
+            remove_node(lst, node);
+        }
+        else
+        {
+            write = node;
+        }
+    }
+    lst->sparse = 0;
+    lst->num_lazy_removals = 0;
+    return 1;
+}
+
+static void merge_small_nodes(list* lst, list_node* node, int num_pairs, list_iter* iter)
+{
+    for ( ; node != NULL && node->next != NULL && num_pairs > 0; num_pairs--)
+    {
+        list_node* next = node->next;
+        if (node->count + next->count <= lst->node_capacity)
+        {
+            if (iter->node == next)
+            {
+                iter->node = node;
+                iter->offset += node->count;
+            }
+            if (node->start + node->count + next->count > lst->node_capacity)
+            {
+                pack_node_front(node);
+            }
+            memcpy(NODE_ELEMENTS(node) + node->count,
+                   NODE_ELEMENTS(next),
+                   next->count * sizeof(void *));
+            move_fingers(lst, next, 0, next->count, node, node->count);
+            node->count += next->count;
+            update_index_count(lst, node);
+            remove_node(lst, next);
+        }
+        else
+        {
+            node = next;
+        }
+    }
+}
+
+static void unlink_nodes(list* lst, list_node* first, list_node* last)
+{
+    if (first->prev != NULL)
+    {
+        first->prev->next = last->next;
+    }
+    else
+    {
+        lst->first_node = last->next;
+    }
+    if (last->next != NULL)
+    {
+        last->next->prev = first->prev;
+    }
+    else
+    {
+        lst->last_node = first->prev;
+    }
+    first->prev = NULL;
+    last->next = NULL;
+}
+
+static void link_nodes(list* lst, list_node* after, list_node* first, list_node* last)
+{
+    list_node* before = (after != NULL) ? after->next : lst->first_node;
+    first->prev = after;
+    last->next = before;
+    if (after != NULL)
+    {
+        after->next = first;
+    }
+    else
+    {
+        lst->first_node = first;
+    }
+    if (before != NULL)
+    {
+        before->prev = last;
+    }
+    else
+    {
+        lst->last_node = last;
+    }
+}
+
+static list_iter end_iter(list* lst)
+{
+    list_iter result;
+    result.lst = lst;
+    result.node = NULL;
+    result.offset = 0;
+    return result;
+}
+
+static int insert_empty_nodes_after(list* lst, list_node* node, int num_nodes)
+{
+    int i;
+    for (i = 0; i < num_nodes; i++)
+    {
+        if (!insert_empty_node_after(lst, node))
+        {
+            for ( ; i > 0; i--)
+            {
+                remove_node(lst, node->next);
+            }
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void stream_copy(element_stream* stream, void** dest, int count)
+{
+    while (count > 0)
+    {
+        int num_copied = stream->count[stream->segment];
+        if (num_copied > count)
+        {
+            num_copied = count;
+        }
+        /* The first segment may already be in place */
+        if (dest != stream->data[stream->segment])
+        {
+            memcpy(dest,
+                   stream->data[stream->segment],
+                   num_copied * sizeof(void *));
+        }
+        dest += num_copied;
+        count -= num_copied;
+        stream->data[stream->segment] += num_copied;
+        stream->count[stream->segment] -= num_copied;
+        if (stream->count[stream->segment] == 0)
+        {
+            stream->segment++;
+        }
+    }
+}
+
+static void sort_node(list_node* node, list_comparator cmp, void* context)
+{
+    /* Insertion sort, which is stable and fast for node-sized arrays */
+    void** elements = NODE_ELEMENTS(node);
+    int i, j;
+    for (i = 1; i < node->count; i++)
+    {
+        void* value = elements[i];
+        for (j = i; j > 0 && cmp(elements[j - 1], value, context) > 0; j--)
+        {
+            elements[j] = elements[j - 1];
+        }
+        elements[j] = value;
+    }
+}
+
+static void** sort_array(void** values, void** scratch, int count,
+                         list_comparator cmp, void* context)
+{
+    int width, start, i, j;
+    /* Insertion sort short blocks, then merge them bottom-up, moving
+       between the two arrays on each pass */
+    for (start = 0; start < count; start += 8)
+    {
+        int end = (start + 8 < count) ? start + 8 : count;
+        for (i = start + 1; i < end; i++)
+        {
+            void* value = values[i];
+            for (j = i; j > start && cmp(values[j - 1], value, context) > 0; j--)
+            {
+                values[j] = values[j - 1];
+            }
+            values[j] = value;
+        }
+    }
+    for (width = 8; width < count; width *= 2)
+    {
+        void** out = scratch;
+        for (start = 0; start < count; start += 2*width)
+        {
+            void** a_next = values + start;
+            void** a_end = values + ((start + width < count) ? start + width : count);
+            void** b_next = a_end;
+            void** b_end = values + ((start + 2*width < count) ? start + 2*width : count);
+            while (a_next < a_end && b_next < b_end)
+            {
+                int take_b = (cmp(*b_next, *a_next, context) < 0);
+                *out++ = take_b ? *b_next : *a_next;
+                b_next += take_b;
+                a_next += !take_b;
+            }
+            memcpy(out, a_next, (a_end - a_next) * sizeof(void *));
+            out += a_end - a_next;
+            memcpy(out, b_next, (b_end - b_next) * sizeof(void *));
+            out += b_end - b_next;
+        }
+        scratch = values;
+        values = out - count;
+    }
+    return values;
+}
+
+static list_node* sort_run(list_node** nodes, void** buffer, int buffer_size,
+                           list_comparator cmp, void* context, int capacity,
+                           list_node** free_nodes)
+{
+    list_node* first = *nodes;
+    list_node* node;
+    void** sorted;
+    int count = 0;
+    assert(buffer_size >= capacity);
+    if (buffer == NULL)
+    {
+        *nodes = first->next;
+        first->prev = NULL;
+        first->next = NULL;
+        sort_node(first, cmp, context);
+        return first;
+    }
+    for (node = first; node != NULL && count + node->count <= buffer_size; node = node->next)
+    {
+        memcpy(buffer + count, NODE_ELEMENTS(node), node->count * sizeof(void *));
+        count += node->count;
+    }
+    *nodes = node;
+    sorted = sort_array(buffer, buffer + buffer_size, count, cmp, context);
+
+    /* Pack the sorted elements back into full nodes, freeing the rest */
+    first->prev = NULL;
+    node = first;
+    for (;;)
+    {
+        int num_copied = (count < capacity) ? count : capacity;
+        memcpy(node->data, sorted, num_copied * sizeof(void *));
+        node->start = 0;
+        node->count = num_copied;
+        sorted += num_copied;
+        count -= num_copied;
+        if (count == 0)
+        {
+            break;
+        }
+        node = node->next;
+    }
+    while (node->next != *nodes)
+    {
+        list_node* empty = node->next;
+        node->next = empty->next;
+        empty->next = *free_nodes;
+        *free_nodes = empty;
+    }
+    node->next = NULL;
+    return first;
+}
+
+static list_node* merge_chains(list_node* a, list_node* b, list_comparator cmp,
+                               void* context, int capacity, list_node** free_nodes,
+                               list* a_lst, list* b_lst)
+{
+    list_node* head = NULL;
+    list_node* tail = NULL;
+    int a_offset = 0, b_offset = 0;
+    while (a != NULL || b != NULL)
+    {
+        if (a == NULL || b == NULL)
+        {
+            /* Only one chain is left. If it starts on a node boundary
+               and the output node is full, link it in as it is. */
+            list_node* rest = (a != NULL) ? a : b;
+            int rest_offset = (a != NULL) ? a_offset : b_offset;
+            if (rest_offset == 0 && (tail == NULL || tail->count == capacity))
+            {
+                rest->prev = tail;
+                if (tail != NULL)
+                {
+                    tail->next = rest;
+                }
+                else
+                {
+                    head = rest;
+                }
+                break;
+            }
+        }
+        if ((tail == NULL || tail->count == capacity) && a != NULL && b != NULL)
+        {
+            /* A full input node that orders entirely before the other
+               chain's next element is linked in as it is */
+            list_node* whole = NULL;
+            if (a_offset == 0 && a->count == capacity &&
+                cmp(NODE_ELEMENTS(b)[b_offset], NODE_ELEMENTS(a)[capacity - 1], context) >= 0)
+            {
+                whole = a;
+                a = a->next;
+            }
+            else if (b_offset == 0 && b->count == capacity &&
+                     cmp(NODE_ELEMENTS(b)[capacity - 1], NODE_ELEMENTS(a)[a_offset], context) < 0)
+            {
+                whole = b;
+                b = b->next;
+            }
+            if (whole != NULL)
+            {
+                whole->prev = tail;
+                whole->next = NULL;
+                if (tail != NULL)
+                {
+                    tail->next = whole;
+                }
+                else
+                {
+                    head = whole;
+                }
+                tail = whole;
+                continue;
+            }
+        }
+        if (tail == NULL || tail->count == capacity)
+        {
+            list_node* node = *free_nodes;
+            assert (node != NULL);
+            *free_nodes = node->next;
+            node->start = 0;
+            node->count = 0;
+            set_node_index_entry(node, NULL);
+            node->prev = tail;
+            node->next = NULL;
+            if (tail != NULL)
+            {
+                tail->next = node;
+            }
+            else
+            {
+                head = node;
+            }
+            tail = node;
+        }
+
+        /* Merge until the output node fills or an input node runs out,
+           keeping the per-element loop free of node bookkeeping */
+        {
+            void** out = tail->data + tail->count;
+            void** out_end = tail->data + capacity;
+            if (a != NULL && b != NULL)
+            {
+                void** a_next = NODE_ELEMENTS(a) + a_offset;
+                void** a_end = NODE_ELEMENTS(a) + a->count;
+                void** b_next = NODE_ELEMENTS(b) + b_offset;
+                void** b_end = NODE_ELEMENTS(b) + b->count;
+                while (out < out_end && a_next < a_end && b_next < b_end)
+                {
+                    /* Branch-free, since the comparison outcome is
+                       unpredictable for unsorted input */
+                    int take_b = (cmp(*b_next, *a_next, context) < 0);
+                    *out++ = take_b ? *b_next : *a_next;
+                    b_next += take_b;
+                    a_next += !take_b;
+                }
+                a_offset = a_next - NODE_ELEMENTS(a);
+                b_offset = b_next - NODE_ELEMENTS(b);
+            }
+            else if (a != NULL)
+            {
+                int num_copied = a->count - a_offset;
+                if (num_copied > out_end - out)
+                {
+                    num_copied = out_end - out;
+                }
+                memcpy(out, NODE_ELEMENTS(a) + a_offset, num_copied * sizeof(void *));
+                out += num_copied;
+                a_offset += num_copied;
+            }
+            else
+            {
+                int num_copied = b->count - b_offset;
+                if (num_copied > out_end - out)
+                {
+                    num_copied = out_end - out;
+                }
+                memcpy(out, NODE_ELEMENTS(b) + b_offset, num_copied * sizeof(void *));
+                out += num_copied;
+                b_offset += num_copied;
+            }
+            tail->count = out - tail->data;
+        }
+
+        /* Recycle input nodes that are used up */
+        if (a != NULL && a_offset == a->count)
+        {
+            list_node* next = a->next;
+            if (a_lst != NULL)
+            {
+                drop_fingers(a_lst, a, 0, a->count, NULL, 0);
+            }
+            a->next = *free_nodes;
+            *free_nodes = a;
+            a = next;
+            a_offset = 0;
+            if (a != NULL)
+            {
+                list_prefetch(a->next);
+            }
+        }
+        if (b != NULL && b_offset == b->count)
+        {
+            list_node* next = b->next;
+            if (b_lst != NULL)
+            {
+                drop_fingers(b_lst, b, 0, b->count, NULL, 0);
+            }
+            b->next = *free_nodes;
+            *free_nodes = b;
+            b = next;
+            b_offset = 0;
+            if (b != NULL)
+            {
+                list_prefetch(b->next);
+            }
+        }
+    }
+    return head;
+}
+
+static int merge_sets(list* dst, list* a, list* b, list_comparator cmp, void* context,
+                      int keep_a, int keep_b, int keep_both)
+{
+    list_node* a_node = a->first_node;
+    list_node* b_node = b->first_node;
+    int a_offset = 0, b_offset = 0;
+    list_node* old_last;
+    int old_count = 0;
+    int old_size = dst->size;
+    list_node* tail;
+    void** out = NULL;
+    void** out_end = NULL;
+    int success = 1;
+    check_list_invariants(dst);
+    check_list_invariants(a);
+    check_list_invariants(b);
+    assert (dst != a && dst != b);
+    if (dst->last_node != NULL)
+    {
+        if (!own_node(dst, &dst->last_node))
+        {
+            return 0;
+        }
+        pack_node_front(dst->last_node);
+        old_count = dst->last_node->count;
+        out = dst->last_node->data + old_count;
+        out_end = dst->last_node->data + dst->node_capacity;
+    }
+    old_last = dst->last_node;
+    tail = old_last;
+
+    while (a_node != NULL || b_node != NULL)
+    {
+        if (out == out_end)
+        {
+            /* Finish the output node and start a new one. This may
+               leave an empty node at the end, removed below. */
+            if (tail != NULL)
+            {
+                tail->count = dst->node_capacity;
+                dst->size += tail->count - ((tail == old_last) ? old_count : 0);
+                update_index_count(dst, tail);
+            }
+            if (!((tail == NULL) ? insert_empty_sole_node(dst)
+                                 : insert_empty_node_after(dst, tail)))
+            {
+                success = 0;
+                break;
+            }
+            tail = dst->last_node;
+            out = tail->data;
+            out_end = tail->data + dst->node_capacity;
+        }
+
+        /* Emit until the output node fills or an input node runs out */
+        if (a_node != NULL && b_node != NULL)
+        {
+            void** a_next = NODE_ELEMENTS(a_node) + a_offset;
+            void** a_end = NODE_ELEMENTS(a_node) + a_node->count;
+            void** b_next = NODE_ELEMENTS(b_node) + b_offset;
+            void** b_end = NODE_ELEMENTS(b_node) + b_node->count;
+            while (out < out_end && a_next < a_end && b_next < b_end)
+            {
+                /* Always write, and only advance the output if the
+                   element is kept, to keep the loop branch-free */
+                int order = cmp(*a_next, *b_next, context);
+                *out = (order <= 0) ? *a_next : *b_next;
+                out += (order < 0) ? keep_a : (order > 0) ? keep_b : keep_both;
+                a_next += (order <= 0);
+                b_next += (order >= 0);
+            }
+            a_offset = a_next - NODE_ELEMENTS(a_node);
+            b_offset = b_next - NODE_ELEMENTS(b_node);
+        }
+        else
+        {
+            /* Only one list is left, and is copied whole or dropped */
+            list_node** rest = (a_node != NULL) ? &a_node : &b_node;
+            int* rest_offset = (a_node != NULL) ? &a_offset : &b_offset;
+            int num_copied = (*rest)->count - *rest_offset;
+            if (!((a_node != NULL) ? keep_a : keep_b))
+            {
+                break;
+            }
+            if (num_copied > out_end - out)
+            {
+                num_copied = out_end - out;
+            }
+            memcpy(out, NODE_ELEMENTS(*rest) + *rest_offset, num_copied * sizeof(void *));
+            out += num_copied;
+            *rest_offset += num_copied;
+        }
+
+        if (a_node != NULL && a_offset == a_node->count)
+        {
+            a_node = a_node->next;
+            a_offset = 0;
+            if (a_node != NULL)
+            {
+                list_prefetch(a_node->next);
+            }
+        }
+        if (b_node != NULL && b_offset == b_node->count)
+        {
+            b_node = b_node->next;
+            b_offset = 0;
+            if (b_node != NULL)
+            {
+                list_prefetch(b_node->next);
+            }
+        }
+    }
+
+    if (!success)
+    {
+        while (dst->last_node != old_last)
+        {
+            remove_node(dst, dst->last_node);
+        }
+        if (old_last != NULL)
+        {
+            old_last->count = old_count;
+            update_index_count(dst, old_last);
+        }
+        dst->size = old_size;
+        check_list_invariants(dst);
+        return 0;
+    }
+    if (tail != NULL)
+    {
+        tail->count = out - tail->data;
+        dst->size += tail->count - ((tail == old_last) ? old_count : 0);
+        if (tail->count == 0)
+        {
+            remove_node(dst, tail);
+        }
+        else
+        {
+            update_index_count(dst, tail);
+        }
+    }
+    check_list_invariants(dst);
+    return 1;
+}
+
+static list_node* chain_last(list_node* node)
+{
+    while (node != NULL && node->next != NULL)
+    {
+        node = node->next;
+    }
+    return node;
+}
+
+static int allocate_spare_nodes(list* lst, list_node** free_nodes, int num_nodes)
+{
+    list_node* allocated = NULL;
+    int i;
+    for (i = 0; i < num_nodes; i++)
+    {
+        list_node* node = allocate_node(lst);
+        if (node == NULL)
+        {
+            free_chain(lst, allocated);
+            return 0;
+        }
+        node->next = allocated;
+        allocated = node;
+    }
+    while (allocated != NULL)
+    {
+        list_node* node = allocated;
+        allocated = node->next;
+        node->next = *free_nodes;
+        *free_nodes = node;
+    }
+    return 1;
+}
+
+static void free_chain(list* lst, list_node* free_nodes)
+{
+    while (free_nodes != NULL)
+    {
+        list_node* node = free_nodes;
+        free_nodes = node->next;
+        free_node(lst, node);
+    }
+}
+
+static list_index_entry* detach_index(list* lst, list_index_entry* entries)
+{
+    list_node* node;
+    for (node = lst->first_node; node != NULL; node = node->next)
+    {
+        if (node_index_entry(node) != NULL)
+        {
+            node_index_entry(node)->parent = entries;
+            entries = node_index_entry(node);
+            set_node_index_entry(node, NULL);
+        }
+    }
+    lst->index_root = NULL;
+    return entries;
+}
+
+static void attach_index(list* lst, list_index_entry* entries)
+{
+    list_node* node;
+    if (lst->indexed)
+    {
+        for (node = lst->first_node; node != NULL; node = node->next)
+        {
+            list_index_entry* entry = entries;
+            assert (entry != NULL);
+            entries = entry->parent;
+            index_link_entry(lst, node, entry);
+            update_index_count(lst, node);
+        }
+    }
+    while (entries != NULL)
+    {
+        list_index_entry* entry = entries;
+        entries = entry->parent;
+        free(entry);
+    }
+}
+
+static void remove_node(list* lst, list_node* node)
+{
+    index_remove_entry(lst, node);
+    if (node->prev != NULL)
+    {
+        node->prev->next = node->next;
+    }
+    else
+    {
+        lst->first_node = node->next;
+    }
+    if (node->next != NULL)
+    {
+        node->next->prev = node->prev;
+    }
+    else
+    {
+        lst->last_node = node->prev;
+    }
+    free_node(lst, node);
+}
+
+static size_t node_size(int node_capacity)
+{
+    size_t size = offsetof(list_node, data) + node_capacity * sizeof(void *);
+    return (size + LIST_CACHE_LINE_SIZE - 1) & ~(size_t)(LIST_CACHE_LINE_SIZE - 1);
+}
+
+static list_node* allocate_node(list* lst)
+{
+    list_node* node = lst->spare_nodes;
+    if (node == NULL)
+    {
+        node = acquire_node(lst);
+        if (node == NULL)
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        lst->spare_nodes = node->next;
+        lst->num_spare_nodes--;
+    }
+    node->refcount = 1;
+    return node;
+}
+
+static void free_node(list* lst, list_node* node)
+{
+    if (lst->shared && add_refcount(node, -1) > 0)
+    {
+        /* A snapshot still holds the node, and frees it when released */
+        return;
+    }
+    if (lst->num_spare_nodes < lst->max_spare_nodes)
+    {
+        node->next = lst->spare_nodes;
+        lst->spare_nodes = node;
+        lst->num_spare_nodes++;
+    }
+    else
+    {
+        release_node(lst, node);
+    }
+}
+
+static list_node* acquire_node(list* lst)
+{
+    list_node_pool* pool = lst->pool;
+    list_node* node;
+    if (pool == NULL)
+    {
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+        return (list_node *)aligned_alloc(LIST_CACHE_LINE_SIZE,
+                                          node_size(lst->node_capacity));
+#else
+        return (list_node *)malloc(node_size(lst->node_capacity));
+#endif
+    }
+    if (pool->free_nodes == NULL)
+    {
+        if (!allocate_slab(pool, pool->nodes_per_slab))
+        {
+            return NULL;
+        }
+    }
+    node = pool->free_nodes;
+    pool->free_nodes = node->next;
+    return node;
+}
+
+static void release_node(list* lst, list_node* node)
+{
+    if (lst->pool == NULL)
+    {
+        free(node);
+    }
+    else
+    {
+        node->next = lst->pool->free_nodes;
+        lst->pool->free_nodes = node;
+    }
+}
+
+static int allocate_slab(list_node_pool* pool, int num_nodes)
+{
+    /* A slab starts with a pointer to the previously allocated slab,
+       followed by padding up to a cache line boundary, followed by
+       the nodes themselves. */
+    size_t size = node_size(pool->node_capacity);
+    char* slab = (char *)malloc(sizeof(void *) + LIST_CACHE_LINE_SIZE - 1 +
+                                num_nodes * size);
+    char* nodes;
+    int i;
+    if (slab == NULL)
+    {
+        return 0;
+    }
+    *(void **)slab = pool->slabs;
+    pool->slabs = slab;
+    pool->num_slabs++;
+
+    nodes = slab + sizeof(void *);
+    nodes += (LIST_CACHE_LINE_SIZE - (size_t)nodes % LIST_CACHE_LINE_SIZE) %
+             LIST_CACHE_LINE_SIZE;
+    /* Push in reverse so nodes are handed out in address order */
+    for (i = num_nodes - 1; i >= 0; i--)
+    {
+        list_node* node = (list_node *)(nodes + i * size);
+        node->next = pool->free_nodes;
+        pool->free_nodes = node;
+    }
+    return 1;
+}
+
+static int index_insert_entry(list* lst, list_node* node)
+{
+    list_index_entry* entry;
+    set_node_index_entry(node, NULL);
+    if (!lst->indexed)
+    {
+        return 1;
+    }
+    entry = (list_index_entry *)malloc(sizeof(list_index_entry));
+    if (entry == NULL)
+    {
+        return 0;
+    }
+    index_link_entry(lst, node, entry);
+    return 1;
+}
+
+static void index_link_entry(list* lst, list_node* node, list_index_entry* entry)
+{
+    entry->node = node;
+    entry->left = NULL;
+    entry->right = NULL;
+    entry->count = 0;
+    entry->subtree_count = 0;
+    entry->weight = 0;
+    entry->subtree_weight = 0;
+    entry->priority = index_priority(entry);
+    set_node_index_entry(node, entry);
+
+    /* Attach as a leaf adjacent to a neighboring node's entry, then
+       restore the heap property. The new entry has a count and weight
+       of zero, so no subtree sums change until update_index_count(). When
+       linking several adjacent new nodes, each must be linked next
+       to a node that already has an entry. */
+    if (lst->index_root == NULL)
+    {
+        entry->parent = NULL;
+        lst->index_root = entry;
+    }
+    else if (node->prev != NULL && node_index_entry(node->prev) != NULL)
+    {
+        list_index_entry* pos = node_index_entry(node->prev);
+        if (pos->right == NULL)
+        {
+            pos->right = entry;
+        }
+        else
+        {
+            for (pos = pos->right; pos->left != NULL; pos = pos->left)
+            {
+            }
+            pos->left = entry;
+        }
+        entry->parent = pos;
+    }
+    else
+    {
+        list_index_entry* pos = node_index_entry(node->next);
+        if (pos->left == NULL)
+        {
+            pos->left = entry;
+        }
+        else
+        {
+            for (pos = pos->left; pos->right != NULL; pos = pos->right)
+            {
+            }
+            pos->right = entry;
+        }
+        entry->parent = pos;
+    }
+    while (entry->parent != NULL && entry->priority > entry->parent->priority)
+    {
+        index_rotate_up(lst, entry);
+    }
+}
+
+static void index_remove_entry(list* lst, list_node* node)
+{
+    list_index_entry* entry = node_index_entry(node);
+    list_index_entry* ancestor;
+    if (entry == NULL)
+    {
+        return;
+    }
+    for (ancestor = entry; ancestor != NULL; ancestor = ancestor->parent)
+    {
+        ancestor->subtree_count -= entry->count;
+        ancestor->subtree_weight -= entry->weight;
+    }
+    entry->count = 0;
+    entry->weight = 0;
+
+    /* Rotate the entry down to a leaf, keeping the heap property */
+    while (entry->left != NULL || entry->right != NULL)
+    {
+        if (entry->left == NULL ||
+            (entry->right != NULL && entry->right->priority > entry->left->priority))
+        {
+            index_rotate_up(lst, entry->right);
+        }
+        else
+        {
+            index_rotate_up(lst, entry->left);
+        }
+    }
+    if (entry->parent == NULL)
+    {
+        lst->index_root = NULL;
+    }
+    else if (entry->parent->left == entry)
+    {
+        entry->parent->left = NULL;
+    }
+    else
+    {
+        entry->parent->right = NULL;
+    }
+    free(entry);
+    set_node_index_entry(node, NULL);
+}
+
+static void update_index_count(list* lst, list_node* node)
+{
+    list_index_entry* entry = node_index_entry(node);
+    int delta;
+    long weight_delta = 0;
+    if (entry == NULL)
+    {
+        return;
+    }
+    delta = node->count - entry->count;
+    entry->count = node->count;
+    if (lst->weight != NULL)
+    {
+        /* Elements may have moved in or out with no change in count */
+        long weight = node_weight(lst, node);
+        weight_delta = weight - entry->weight;
+        entry->weight = weight;
+    }
+    for ( ; entry != NULL && (delta != 0 || weight_delta != 0); entry = entry->parent)
+    {
+        entry->subtree_count += delta;
+        entry->subtree_weight += weight_delta;
+    }
+}
+
+static long node_weight(list* lst, list_node* node)
+{
+    long result = 0;
+    int i;
+    for (i = 0; i < node->count; i++)
+    {
+        result += lst->weight(NODE_ELEMENTS(node)[i], lst->weight_context);
+    }
+    return result;
+}
+
+static void index_rotate_up(list* lst, list_index_entry* entry)
+{
+    list_index_entry* parent = entry->parent;
+    list_index_entry* grandparent = parent->parent;
+    if (entry == parent->left)
+    {
+        parent->left = entry->right;
+        if (entry->right != NULL)
+        {
+            entry->right->parent = parent;
+        }
+        entry->right = parent;
+    }
+    else
+    {
+        parent->right = entry->left;
+        if (entry->left != NULL)
+        {
+            entry->left->parent = parent;
+        }
+        entry->left = parent;
+    }
+    parent->parent = entry;
+    entry->parent = grandparent;
+    if (grandparent == NULL)
+    {
+        lst->index_root = entry;
+    }
+    else if (grandparent->left == parent)
+    {
+        grandparent->left = entry;
+    }
+    else
+    {
+        grandparent->right = entry;
+    }
+
+    /* Only the two rotated entries' subtrees changed */
+    entry->subtree_count = parent->subtree_count;
+    entry->subtree_weight = parent->subtree_weight;
+    parent->subtree_count = parent->count +
+        ((parent->left != NULL) ? parent->left->subtree_count : 0) +
+        ((parent->right != NULL) ? parent->right->subtree_count : 0);
+    parent->subtree_weight = parent->weight +
+        ((parent->left != NULL) ? parent->left->subtree_weight : 0) +
+        ((parent->right != NULL) ? parent->right->subtree_weight : 0);
+}
+
+static unsigned int index_priority(list_index_entry* entry)
+{
+    /* A hash of the entry's address serves as well as a random
+       number, and avoids keeping generator state in the list. */
+    unsigned long hash = (unsigned long)(size_t)entry;
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3bUL;
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3bUL;
+    hash ^= hash >> 16;
+    return (unsigned int)hash;
+}
+
+static void check_list_invariants(list* lst)
+{
+#ifndef NDEBUG
+    list_node* node;
+    int count_sum, num_nodes;
+    assert(lst != NULL);
+    assert(lst->size >= 0);
+    assert((lst->size > 0 && lst->first_node != NULL && lst->last_node != NULL) ||
+           (lst->size == 0 && lst->first_node == NULL && lst->last_node == NULL));
+
+    count_sum = 0;
+    num_nodes = 0;
+    for (node = lst->first_node; node != NULL; node=node->next)
+    {
+        assert ((node == lst->first_node) || (node->prev != NULL));
+        assert ((node == lst->last_node)  || (node->next != NULL));
+        assert (node->count >= 1);
+        assert (node->count <= lst->node_capacity);
+        assert (node->start >= 0 &&
+                node->start + node->count <= lst->node_capacity);
+        assert (load_refcount(node) >= 1);
+        assert (lst->shared || load_refcount(node) == 1);
+        count_sum += node->count;
+	num_nodes++;
+    }
+    assert (lst->size == count_sum);
+    /* Rebalancing and splitting guarantees this, -2 is for first and
+       last node, since these nodes can have as little as one element.
+       Note that, rearranging, this guarantees that:
+
+         num_nodes <= 2*lst->size/lst->node_capacity + 2
+    */
+    assert (lst->sparse || count_sum >= (num_nodes - 2) * lst->node_capacity/2);
+
+    num_nodes = 0;
+    for (node = lst->spare_nodes; node != NULL; node=node->next)
+    {
+        num_nodes++;
+    }
+    assert (num_nodes == lst->num_spare_nodes);
+
+    {
+        list_finger* finger;
+        for (finger = lst->fingers; finger != NULL; finger = finger->next)
+        {
+            assert (finger->iter.lst == lst);
+            assert (finger->prev == NULL || finger->prev->next == finger);
+            assert (finger->next == NULL || finger->next->prev == finger);
+            check_iter_invariants(&finger->iter);
+        }
+    }
+#endif
+    check_index_invariants(lst);
+}
+
+static void check_iter_invariants(list_iter* iter)
+{
+#ifndef NDEBUG
+    assert (iter->lst != NULL);
+    assert ((iter->node == NULL) ||
+            (iter->offset >= 0 && iter->offset < iter->node->count));
+    assert (iter->node == NULL ||
+	    list_contains_node(iter->lst, iter->node));
+#endif
+}
+
+static void check_index_invariants(list* lst)
+{
+#ifndef NDEBUG
+    list_node* node;
+    if (!lst->indexed)
+    {
+        assert (lst->index_root == NULL);
+        for (node = lst->first_node; node != NULL; node = node->next)
+        {
+            assert (node_index_entry(node) == NULL);
+        }
+        return;
+    }
+    assert ((lst->index_root == NULL) == (lst->first_node == NULL));
+    assert (lst->index_root == NULL ||
+            (lst->index_root->parent == NULL &&
+             lst->index_root->subtree_count == lst->size));
+    for (node = lst->first_node; node != NULL; node = node->next)
+    {
+        list_index_entry* entry = node_index_entry(node);
+        list_index_entry* successor;
+        assert (entry != NULL && entry->node == node);
+        assert (entry->count == node->count);
+        assert (entry->subtree_count == entry->count +
+                ((entry->left != NULL) ? entry->left->subtree_count : 0) +
+                ((entry->right != NULL) ? entry->right->subtree_count : 0));
+        assert (lst->weight == NULL || entry->weight == node_weight(lst, node));
+        assert (entry->subtree_weight == entry->weight +
+                ((entry->left != NULL) ? entry->left->subtree_weight : 0) +
+                ((entry->right != NULL) ? entry->right->subtree_weight : 0));
+        assert (entry->left == NULL || entry->left->parent == entry);
+        assert (entry->right == NULL || entry->right->parent == entry);
+        assert (entry->parent == NULL || entry->parent->priority >= entry->priority);
+
+        /* The in-order successor must describe the next node */
+        if (entry->right != NULL)
+        {
+            for (successor = entry->right; successor->left != NULL;
+                 successor = successor->left)
+            {
+            }
+        }
+        else
+        {
+            for (successor = entry;
+                 successor->parent != NULL && successor->parent->right == successor;
+                 successor = successor->parent)
+            {
+            }
+            successor = successor->parent;
+        }
+        assert ((node->next == NULL && successor == NULL) ||
+                (node->next != NULL && successor == node_index_entry(node->next)));
+    }
+#endif
+}
+
+static int list_contains_node(list* lst, list_node* node_to_find)
+{
+    list_node* node;
+    for (node = lst->first_node; node != NULL; node=node->next)
+    {
+        if (node == node_to_find)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void fixup_iter_node(list_iter* iter)
+{
+    while (iter->node != NULL &&
+           iter->offset >= iter->node->count)
+    {
+        iter->offset -= iter->node->count;
+        iter->node = iter->node->next;
+    }
+    while (iter->node != iter->lst->first_node &&
+           iter->offset < 0)
+    {
+        iter->node = iter->node->prev;
+        iter->offset += iter->node->count;
+    }
+}
+
+static int own_node(list* lst, list_node** node_ptr)
+{
+    return !lst->shared || load_refcount(*node_ptr) == 1 ||
+           copy_shared_node(lst, node_ptr);
+}
+
+static int copy_shared_node(list* lst, list_node** node_ptr)
+{
+    list_node* node = *node_ptr;
+    list_node* copy = allocate_node(lst);
+    if (copy == NULL)
+    {
+        return 0;
+    }
+    copy->count = node->count;
+    copy->start = node->start;
+    memcpy(NODE_ELEMENTS(copy), NODE_ELEMENTS(node), node->count * sizeof(void *));
+    replace_node(lst, node, copy);
+    *node_ptr = copy;
+    return 1;
+}
+
+static void replace_node(list* lst, list_node* node, list_node* replacement)
+{
+    replacement->next = node->next;
+    replacement->prev = node->prev;
+    set_node_index_entry(replacement, node_index_entry(node));
+
+    /* Link the replacement in place of the node, which snapshots reach
+       through their own arrays rather than through the links */
+    if (replacement->prev != NULL)
+    {
+        replacement->prev->next = replacement;
+    }
+    else
+    {
+        lst->first_node = replacement;
+    }
+    if (replacement->next != NULL)
+    {
+        replacement->next->prev = replacement;
+    }
+    else
+    {
+        lst->last_node = replacement;
+    }
+    if (node_index_entry(replacement) != NULL)
+    {
+        node_index_entry(replacement)->node = replacement;
+    }
+    move_fingers(lst, node, 0, node->count, replacement, 0);
+    free_node(lst, node);
+}
+
+static int unshare_nodes(list* lst, list_iter* iter1, list_iter* iter2, list_iter* iter3)
+{
+    list_node* node;
+    if (!lst->shared)
+    {
+        return 1;
+    }
+    for (node = lst->first_node; node != NULL; node = node->next)
+    {
+        list_node* old_node = node;
+        if (!own_node(lst, &node))
         {
-            /* Merge into two nodes */
-            int node1_count = (elements_sum + 0)/2;
-            int node2_count = (elements_sum + 1)/2;
-            if (node->prev->count < node1_count)
+            return 0;
+        }
+        if (node != old_node)
+        {
+            if (iter1 != NULL && iter1->node == old_node)
             {
-                int move_1 = node1_count - node->prev->count;
-                int move_2 = node->count - move_1;
-                memcpy(node->prev->data + node->prev->count,
-                       node->data,
-                       move_1 * sizeof(void *));
-                memmove(node->data,
-                        node->data + move_1,
-                        move_2 * sizeof(void *));
-                memcpy(node->data + move_2,
-                       node->next->data,
-                       node->next->count * sizeof(void *));
-		iter->offset -= move_1;
+                iter1->node = node;
             }
-            else
+            if (iter2 != NULL && iter2->node == old_node)
             {
-                int move_1 = node->prev->count - node1_count;
-                memmove(node->data + move_1,
-                        node,
-                        node->count * sizeof(void *));
-                memcpy(node->data,
-                       node->prev->data + node1_count,
-                       move_1 * sizeof(void *));
-                memcpy(node->data + node->count + move_1,
-                       node->next->data,
-                       node->next->count * sizeof(void *));
-		iter->offset += move_1;
+                iter2->node = node;
+            }
+            if (iter3 != NULL && iter3->node == old_node)
+            {
+                iter3->node = node;
             }
-            node->prev->count = node1_count;
-            node->count = node2_count;
-            remove_node(iter->lst, node->next);
         }
     }
+    lst->shared = 0;
+    return 1;
 }
 
-static int insert_empty_node_after(list* lst, list_node* node)
+static void move_fingers(list* lst, list_node* node, int offset, int count,
+                         list_node* new_node, int new_offset)
 {
-    list_node* new_node = (list_node *)malloc(sizeof(list_node));
-    if (new_node == NULL)
+    list_finger* finger;
+    assert (node != NULL);
+    for (finger = lst->fingers; finger != NULL; finger = finger->next)
     {
-        return 0;
+        if (finger->iter.node == node &&
+            finger->iter.offset >= offset &&
+            finger->iter.offset < offset + count)
+        {
+            finger->iter.node = new_node;
+            finger->iter.offset += new_offset - offset;
+        }
     }
-    new_node->count = 0;
-    new_node->next = node->next;
-    new_node->prev = node;
-    node->next = new_node;
-    if (new_node->next != NULL)
+}
+
+static void drop_fingers(list* lst, list_node* node, int offset, int count,
+                         list_node* new_node, int new_offset)
+{
+    list_finger* finger;
+    assert (node != NULL);
+    for (finger = lst->fingers; finger != NULL; finger = finger->next)
     {
-        new_node->next->prev = new_node;
+        if (finger->iter.node == node &&
+            finger->iter.offset >= offset &&
+            finger->iter.offset < offset + count)
+        {
+            finger->iter.node = new_node;
+            finger->iter.offset = (new_node != NULL) ? new_offset : 0;
+        }
     }
-    else
+}
+
+static void pass_fingers(list* src, list* dst, list_node* node, int offset, int count,
+                         list_node* new_node, int new_offset)
+{
+    list_finger* finger;
+    list_finger* next;
+    assert (node != NULL);
+    for (finger = src->fingers; finger != NULL; finger = next)
     {
-        lst->last_node = new_node;
+        next = finger->next;
+        if (finger->iter.node == node &&
+            finger->iter.offset >= offset &&
+            finger->iter.offset < offset + count)
+        {
+            finger->iter.node = new_node;
+            finger->iter.offset += new_offset - offset;
+            transfer_finger(finger, dst);
+        }
     }
-    return 1;
 }
 
-static int insert_empty_node_before(list* lst, list_node* node)
+static void transfer_finger(list_finger* finger, list* dst)
 {
-    list_node* new_node = (list_node *)malloc(sizeof(list_node));
-    if (new_node == NULL)
+    list_remove_finger(finger);
+    finger->iter.lst = dst;
+    finger->next = dst->fingers;
+    if (dst->fingers != NULL)
     {
-        return 0;
+        dst->fingers->prev = finger;
     }
-    new_node->count = 0;
-    new_node->prev = node->prev;
-    new_node->next = node;
-    node->prev = new_node;
-    if (new_node->prev != NULL)
+    dst->fingers = finger;
+}
+
+static void pass_node_fingers(list* src, list* dst)
+{
+    list_finger* finger;
+    list_finger* next;
+    for (finger = src->fingers; finger != NULL; finger = next)
     {
-        new_node->prev->next = new_node;
+        next = finger->next;
+        if (finger->iter.node != NULL)
+        {
+            transfer_finger(finger, dst);
+        }
     }
-    else
+}
+
+static void close_fingers_gap(list* lst, list_node* node, int offset)
+{
+    move_fingers(lst, node, offset + 1, node->count - offset, node, offset);
+    move_fingers(lst, node, node->count, 1, node->next, 0);
+}
+
+static int node_has_fingers(list* lst, list_node* node)
+{
+    list_finger* finger;
+    for (finger = lst->fingers; finger != NULL; finger = finger->next)
     {
-        lst->first_node = new_node;
+        if (finger->iter.node == node)
+        {
+            return 1;
+        }
     }
-    return 1;
+    return 0;
 }
 
-static int insert_empty_sole_node(list* lst)
+static void park_fingers(list* lst)
 {
-    list_node* new_node = (list_node *)malloc(sizeof(list_node));
-    if (new_node == NULL)
+    list_finger* finger;
+    for (finger = lst->fingers; finger != NULL; finger = finger->next)
     {
-        return 0;
+        finger->iter.node = NULL;
+        finger->iter.offset = 0;
     }
-    new_node->count = 0;
-    new_node->prev = NULL;
-    new_node->next = NULL;
-    lst->first_node = new_node;
-    lst->last_node = new_node;
+}
+
+static int record_edit(list_batch* batch, list_iter iter, int remove, void* value)
+{
+    list_batch_edit* edit;
+    check_iter_invariants(&iter);
+    assert (iter.lst == batch->lst);
+    check_edit_order(batch, iter);
+    if (batch->num_edits == batch->max_edits)
+    {
+        int max_edits = (batch->max_edits > 0) ? 2*batch->max_edits : 16;
+        list_batch_edit* edits = (list_batch_edit *)realloc(batch->edits,
+                                     max_edits * sizeof(list_batch_edit));
+        if (edits == NULL)
+        {
+            return 0;
+        }
+        batch->edits = edits;
+        batch->max_edits = max_edits;
+    }
+    edit = &batch->edits[batch->num_edits];
+    if (!remove && batch->num_edits > 0 && edit[-1].remove &&
+        edit[-1].node == iter.node && edit[-1].offset == iter.offset)
+    {
+        *edit = edit[-1];
+        edit--;
+    }
+    edit->node = iter.node;
+    edit->offset = iter.offset;
+    edit->remove = remove;
+    edit->value = value;
+    batch->num_edits++;
     return 1;
 }
 
-static void remove_node(list* lst, list_node* node)
+static void check_edit_order(list_batch* batch, list_iter iter)
 {
-    if (node->prev != NULL)
+#ifndef NDEBUG
+    list_batch_edit* last;
+    list_node* node;
+    if (batch->num_edits == 0)
     {
-        node->prev->next = node->next;
+        return;
     }
-    else
+    last = &batch->edits[batch->num_edits - 1];
+    if (iter.node == last->node)
     {
-        lst->first_node = node->next;
+        assert (iter.offset >= last->offset);
+        return;
     }
-    if (node->next != NULL)
+    assert (last->node != NULL);
+    for (node = last->node; node != iter.node; node = node->next)
     {
-        node->next->prev = node->prev;
+        assert (node != NULL);
     }
-    else
+#endif
+}
+
+static int count_batch_node(list_batch_edit* edits, int num_edits, int first_edit,
+                            int* end_edit)
+{
+    list_node* node = edits[first_edit].node;
+    int total = node->count;
+    int e;
+    for (e = first_edit; e < num_edits && edits[e].node == node; e++)
     {
-        lst->last_node = node->prev;
+        total += edits[e].remove ? -1 : 1;
     }
-    free(node);
+    *end_edit = e;
+    return total;
 }
 
-static void check_list_invariants(list* lst)
+static list_node* apply_batch_node(list* lst, list_batch_edit* edits, int first_edit,
+                                   int end_edit, int total, void** scratch,
+                                   list_node** free_nodes, list_index_entry** entries)
 {
-#ifndef NDEBUG
-    list_node* node;
-    int count_sum, num_nodes;
-    assert(lst != NULL);
-    assert(lst->size >= 0);
-    assert((lst->size > 0 && lst->first_node != NULL && lst->last_node != NULL) ||
-           (lst->size == 0 && lst->first_node == NULL && lst->last_node == NULL));
+    int capacity = lst->node_capacity;
+    int num_out = (total + capacity - 1)/capacity;
+    list_node* node = edits[first_edit].node;
+    list_node* after = node->next;
+    list_node* out = NULL;
+    int num_old = node->count;
+    int out_index = -1;
+    int target = 0;
+    int e = first_edit;
+    int i = 0;
 
-    count_sum = 0;
-    num_nodes = 0;
-    for (node = lst->first_node; node != NULL; node=node->next)
+    /* Copy the elements out, holding their fingers on the marker meanwhile */
+    memcpy(scratch, NODE_ELEMENTS(node), num_old * sizeof(void *));
+    move_fingers(lst, node, 0, num_old, BATCH_FINGER_NODE, 0);
+
+    /* Refill the node, then new ones, merging in the insertions.
+       Fingers on a removed element pass to the element after it, and
+       so on to the next one kept, never to an inserted value. */
+    while (i < num_old || e < end_edit)
     {
-        assert ((node == lst->first_node) || (node->prev != NULL));
-        assert ((node == lst->last_node)  || (node->next != NULL));
-        assert (node->count >= 1);
-        assert (node->count <= ELEMENTS_PER_LIST_NODE);
-        count_sum += node->count;
-	num_nodes++;
+        int has_edit = (e < end_edit && edits[e].offset == i);
+        if (has_edit && edits[e].remove)
+        {
+            if (i + 1 < num_old)
+            {
+                drop_fingers(lst, BATCH_FINGER_NODE, i, 1, BATCH_FINGER_NODE, i + 1);
+            }
+            else
+            {
+                drop_fingers(lst, BATCH_FINGER_NODE, i, 1, after, 0);
+            }
+            i++;
+            e++;
+            continue;
+        }
+        if (out == NULL || out->count == target)
+        {
+            if (out == NULL)
+            {
+                out = node;
+                if (lst->shared && load_refcount(out) > 1)
+                {
+                    out = *free_nodes;
+                    *free_nodes = out->next;
+                    replace_node(lst, node, out);
+                }
+            }
+            else
+            {
+                list_node* added = *free_nodes;
+                *free_nodes = added->next;
+                update_index_count(lst, out);
+                set_node_index_entry(added, NULL);
+                link_nodes(lst, out, added, added);
+                if (lst->indexed)
+                {
+                    list_index_entry* entry = *entries;
+                    *entries = entry->parent;
+                    index_link_entry(lst, added, entry);
+                }
+                out = added;
+            }
+            out_index++;
+            out->start = 0;
+            out->count = 0;
+            target = total/num_out + ((out_index < total % num_out) ? 1 : 0);
+        }
+        if (has_edit)
+        {
+            out->data[out->count++] = edits[e].value;
+            e++;
+        }
+        else
+        {
+            int num_copied = ((e < end_edit) ? edits[e].offset : num_old) - i;
+            if (num_copied > target - out->count)
+            {
+                num_copied = target - out->count;
+            }
+            memcpy(out->data + out->count, scratch + i, num_copied * sizeof(void *));
+            move_fingers(lst, BATCH_FINGER_NODE, i, num_copied, out, out->count);
+            out->count += num_copied;
+            i += num_copied;
+        }
     }
-    assert (lst->size == count_sum);
-    /* Rebalancing and splitting guarantees this, -2 is for first and
-       last node, since these nodes can have as little as one element.
-       Note that, rearranging, this guarantees that:
+    assert (out_index == num_out - 1);
+    lst->size += total - num_old;
+    if (out == NULL)
+    {
+        /* Snapshots may still hold it */
+        remove_node(lst, node);
+        return NULL;
+    }
+    assert (out->count == target);
+    update_index_count(lst, out);
+    return out;
+}
 
-         num_nodes <= 2*lst->size/ELEMENTS_PER_LIST_NODE + 2
-    */
-    assert (count_sum >= (num_nodes - 2) * ((int)ELEMENTS_PER_LIST_NODE)/2);
+static list_node* find_in_nodes(list_node* node, int offset, void* value, int* found_offset)
+{
+#ifdef LIST_SIMD_X86
+    if (have_avx2())
+    {
+        return find_in_nodes_avx2(node, offset, value, found_offset);
+    }
+    return find_in_nodes_sse2(node, offset, value, found_offset);
+#else
+    return find_in_nodes_scalar(node, offset, value, found_offset);
 #endif
 }
 
-static void check_iter_invariants(list_iter* iter)
+static int count_in_nodes(list_node* node, void* value)
 {
-#ifndef NDEBUG
-    assert (iter->lst != NULL);
-    assert ((iter->node == NULL) ||
-            (iter->offset >= 0 && iter->offset < iter->node->count));
-    assert (iter->node == NULL ||
-	    list_contains_node(iter->lst, iter->node));
+#ifdef LIST_SIMD_X86
+    if (have_avx2())
+    {
+        return count_in_nodes_avx2(node, value);
+    }
+    return count_in_nodes_sse2(node, value);
+#else
+    return count_in_nodes_scalar(node, value);
 #endif
 }
 
-static int list_contains_node(list* lst, list_node* node_to_find)
+#ifndef LIST_SIMD_X86
+
+static list_node* find_in_nodes_scalar(list_node* node, int offset, void* value, int* found_offset)
 {
-    list_node* node;
-    for (node = lst->first_node; node != NULL; node=node->next)
+    for (; node != NULL; node = node->next, offset = 0)
     {
-        if (node == node_to_find)
+        void** elements = NODE_ELEMENTS(node);
+        int count = node->count;
+        list_prefetch(node->next);
+        for (; offset < count; offset++)
         {
-            return 1;
+            if (elements[offset] == value)
+            {
+                *found_offset = offset;
+                return node;
+            }
         }
     }
-    return 0;
+    return NULL;
 }
 
-static void fixup_iter_node(list_iter* iter)
+static int count_in_nodes_scalar(list_node* node, void* value)
 {
-    while (iter->node != NULL &&
-           iter->offset >= iter->node->count)
+    int total = 0;
+    for (; node != NULL; node = node->next)
     {
-        iter->offset -= iter->node->count;
-        iter->node = iter->node->next;
+        void** elements = NODE_ELEMENTS(node);
+        int count = node->count;
+        int i;
+        list_prefetch(node->next);
+        for (i = 0; i < count; i++)
+        {
+            total += (elements[i] == value);
+        }
     }
-    while (iter->node != iter->lst->first_node &&
-           iter->offset < 0)
+    return total;
+}
+
+#else
+
+static int have_avx2(void)
+{
+    /* Racing threads all store the same answer */
+    static int result = -1;
+    if (result < 0)
     {
-        iter->node = iter->node->prev;
-        iter->offset += iter->node->count;
+        __builtin_cpu_init();
+        result = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return result;
+}
+
+/* SSE2 has no 64-bit compare, so pointers are compared as pairs of
+   32-bit halves, and a pointer matches when both of its halves do */
+#define SSE2_MATCH_MASK(elements, key) \
+    sse2_match_mask(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(elements)), (key)))
+
+/*! \brief Turns a 32-bit comparison of two pointers into a 64-bit
+    one, as a vector of all-ones or all-zero lanes. */
+static __m128i sse2_match_mask(__m128i halves_equal)
+{
+    return _mm_and_si128(halves_equal,
+                         _mm_shuffle_epi32(halves_equal, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+static list_node* find_in_nodes_sse2(list_node* node, int offset, void* value, int* found_offset)
+{
+    __m128i key = _mm_set1_epi64x((size_t)value);
+    for (; node != NULL; node = node->next, offset = 0)
+    {
+        void** elements = NODE_ELEMENTS(node);
+        int count = node->count;
+        list_prefetch(node->next);
+        for (; offset + 2 <= count; offset += 2)
+        {
+            int mask = _mm_movemask_pd(_mm_castsi128_pd(SSE2_MATCH_MASK(elements + offset, key)));
+            if (mask != 0)
+            {
+                *found_offset = offset + ((mask & 1) ? 0 : 1);
+                return node;
+            }
+        }
+        if (offset < count && elements[offset] == value)
+        {
+            *found_offset = offset;
+            return node;
+        }
     }
+    return NULL;
 }
+
+static int count_in_nodes_sse2(list_node* node, void* value)
+{
+    __m128i key = _mm_set1_epi64x((size_t)value);
+    __m128i totals = _mm_setzero_si128();
+    size_t lanes[2];
+    int total = 0;
+    for (; node != NULL; node = node->next)
+    {
+        void** elements = NODE_ELEMENTS(node);
+        int count = node->count;
+        int i;
+        list_prefetch(node->next);
+        for (i = 0; i + 2 <= count; i += 2)
+        {
+            /* Matching lanes are all ones, that is minus one */
+            totals = _mm_sub_epi64(totals, SSE2_MATCH_MASK(elements + i, key));
+        }
+        if (i < count)
+        {
+            total += (elements[i] == value);
+        }
+    }
+    _mm_storeu_si128((__m128i *)lanes, totals);
+    return total + (int)(lanes[0] + lanes[1]);
+}
+
+static list_node* find_in_nodes_avx2(list_node* node, int offset, void* value, int* found_offset)
+{
+    __m256i key = _mm256_set1_epi64x((size_t)value);
+    for (; node != NULL; node = node->next, offset = 0)
+    {
+        void** elements = NODE_ELEMENTS(node);
+        int count = node->count;
+        list_prefetch(node->next);
+        for (; offset + 4 <= count; offset += 4)
+        {
+            __m256i equal = _mm256_cmpeq_epi64(
+                _mm256_loadu_si256((const __m256i *)(elements + offset)), key);
+            int mask = _mm256_movemask_pd(_mm256_castsi256_pd(equal));
+            if (mask != 0)
+            {
+                *found_offset = offset + __builtin_ctz(mask);
+                return node;
+            }
+        }
+        for (; offset < count; offset++)
+        {
+            if (elements[offset] == value)
+            {
+                *found_offset = offset;
+                return node;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int count_in_nodes_avx2(list_node* node, void* value)
+{
+    __m256i key = _mm256_set1_epi64x((size_t)value);
+    __m256i totals = _mm256_setzero_si256();
+    size_t lanes[4];
+    int total = 0;
+    for (; node != NULL; node = node->next)
+    {
+        void** elements = NODE_ELEMENTS(node);
+        int count = node->count;
+        int i;
+        list_prefetch(node->next);
+        for (i = 0; i + 4 <= count; i += 4)
+        {
+            totals = _mm256_sub_epi64(totals, _mm256_cmpeq_epi64(
+                _mm256_loadu_si256((const __m256i *)(elements + i)), key));
+        }
+        for (; i < count; i++)
+        {
+            total += (elements[i] == value);
+        }
+    }
+    _mm256_storeu_si256((__m256i *)lanes, totals);
+    return total + (int)(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+#endif /* #ifndef LIST_SIMD_X86 */
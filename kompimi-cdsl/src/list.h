@@ -10,9 +10,13 @@
     Structures, macros, and methods supporting the list data structure.
 
    list is a data structure that supports efficient insertion and
-   removal anywhere in the list in constant time, but unlike arrays
-   does not support indexing. It supports heterogeneous data - all
-   insertions and retrievals are in the form of untyped void pointers.
+   removal anywhere in the list in constant time. Unlike arrays it
+   does not index elements in constant time: list_iter_at() walks the
+   list in linear time, or in logarithmic time once list_build_index()
+   has added an optional order-statistics index, which then costs
+   logarithmic time per node split or merge. It supports heterogeneous
+   data - all insertions and retrievals are in the form of untyped
+   void pointers.
 
    Its implementation is based on unrolled doubly-linked linked lists
    with external storage, which are more space-efficient and
@@ -24,30 +28,127 @@
 */
 
 #ifndef _LIST_
+#define _LIST_
 
 #include <assert.h>
+#include <stddef.h>
 
 #include "config.h"
 
 /*! \brief (Internal) A list node.
 
-   Holds a small array containing a fixed number of list elements,
+   Holds a small array containing up to the list's node capacity of
+   elements,
    along with a count of how many are in use, and pointers to the
-   previous and next nodes. Should not be accessed directly.
+   previous and next nodes. The elements in use are contiguous but
+   need not start at the beginning of the array, so that elements can
+   be added or removed at the front of a node without moving the
+   rest. Should not be accessed directly.
 */
 typedef struct list_node_t
 {
     /*! \brief Count of how many logical elements are stored in this node. */
-    int count;
+    short count;
+    /*! \brief Index into data of the first logical element. */
+    short start;
+    /*! \brief The number of owners of this node: one for the list
+        linking it, plus one for each list_snapshot holding it. A node
+        with more than one owner is never modified, except for its
+        links, count and start, which snapshots do not read. */
+    int refcount;
     /*! \brief Pointer to next node in list, or NULL if this is the last node. */
     struct list_node_t* next;
     /*! \brief Pointer to previous node in list, or NULL if this is the first node. */
     struct list_node_t* prev;
-    /*! \brief Fixed-size array containing pointers to data.
-        See ::ELEMENTS_PER_LIST_NODE. */
+#if !LIST_COMPACT_NODES
+    /*! \brief This node's entry in the list's order-statistics index,
+        or NULL if the list is not indexed. */
+    struct list_index_entry_t* index_entry;
+#endif
+    /*! \brief Array containing pointers to data. Nodes are allocated
+        with room for only the list's node capacity of elements, not
+        the full ::ELEMENTS_PER_LIST_NODE declared here. */
     void* data[ELEMENTS_PER_LIST_NODE];
 } list_node;
 
+/*! \brief Computes the node capacity that makes each list node fill
+    exactly the given number of cache lines.
+
+    \param num_lines The number of cache lines, from 1 to 4. At least
+    2 on machines where the node metadata fills most of a line.
+
+    \return A node capacity suitable for list_create_with_capacity().
+*/
+#define /*int*/ list_node_capacity_for_cache_lines(/*int*/ num_lines) \
+    ((int)(((num_lines)*LIST_CACHE_LINE_SIZE - offsetof(list_node, data)) / \
+           sizeof(void*)))
+
+/*! \brief (Internal) An entry in a list's order-statistics index.
+
+   The index is a treap with one entry per list node, in the same
+   order as the nodes, augmented with the number of elements in each
+   subtree and, for a weighted index, their total weight. Should not
+   be accessed directly.
+*/
+typedef struct list_index_entry_t
+{
+    /*! \brief The list node this entry describes. */
+    list_node* node;
+    /*! \brief Parent entry, or NULL if this is the root. */
+    struct list_index_entry_t* parent;
+    /*! \brief Left child, covering the preceding nodes, or NULL. */
+    struct list_index_entry_t* left;
+    /*! \brief Right child, covering the following nodes, or NULL. */
+    struct list_index_entry_t* right;
+    /*! \brief The node's element count, as last reported to the index. */
+    int count;
+    /*! \brief Total count of all entries in this subtree. */
+    int subtree_count;
+    /*! \brief The total weight of the node's elements, in a weighted index. */
+    long weight;
+    /*! \brief Total weight of all entries in this subtree, in a weighted index. */
+    long subtree_weight;
+    /*! \brief Heap priority, higher priorities are nearer the root. */
+    unsigned int priority;
+} list_index_entry;
+
+/*! \brief A pool of list nodes, which may be shared by several lists.
+
+   Nodes are carved out of large cache-line-aligned slabs, and nodes
+   freed by lists using the pool are kept on a free list for reuse
+   rather than being returned to the system. This avoids a malloc/free
+   pair on every node split and merge. Slabs are only released, all at
+   once, when the pool is destroyed.
+
+   The structure is intended to be stack-allocated or embedded in
+   other data structures. It must outlive every list using it.
+*/
+typedef struct
+{
+    /*! \brief The number of nodes carved out of each slab. Read-only. */
+    int nodes_per_slab;
+    /*! \brief The node capacity of lists using this pool. Read-only. */
+    int node_capacity;
+    /*! \brief The number of slabs allocated so far. Read-only. */
+    int num_slabs;
+    /*! \brief (Internal) Singly-linked chain of allocated slabs. */
+    void* slabs;
+    /*! \brief (Internal) Singly-linked chain of free nodes, linked
+        through their next pointers. */
+    list_node* free_nodes;
+} list_node_pool;
+
+/*! \brief A function giving the weight of a list element, such as
+    its length in bytes, for a weighted index.
+
+   \param value The element value.
+   \param context The context pointer supplied by the caller.
+
+   \return The weight, which must not be negative, and must not change
+   while the element is in the list unless list_update_weight() is called.
+*/
+typedef long (*list_weight_function)(void* value, void* context);
+
 /*! \brief A list data structure.
 
    The structure is intended to be stack-allocated or embedded in
@@ -62,6 +163,47 @@ typedef struct
     list_node* first_node;
     /*! \brief (Internal) Pointer to last node, or NULL if list is empty. */
     list_node* last_node;
+    /*! \brief The maximum number of elements stored in each node.
+        Read-only, chosen when the list is created. */
+    int node_capacity;
+    /*! \brief (Internal) Pool nodes are allocated from, or NULL to
+        allocate each node with malloc. */
+    list_node_pool* pool;
+    /*! \brief Nonzero if the list maintains an order-statistics index.
+        Read-only, use list_build_index() to create the index. */
+    int indexed;
+    /*! \brief (Internal) Root of the order-statistics index, or NULL
+        if the list is not indexed or is empty. */
+    list_index_entry* index_root;
+    /*! \brief (Internal) Chain of spare nodes kept for reuse, linked
+        through their next pointers. */
+    list_node* spare_nodes;
+    /*! \brief The number of nodes in the spare node cache. Read-only. */
+    int num_spare_nodes;
+    /*! \brief The most nodes freed by the list that are kept in its
+        spare node cache. Read-only, use list_set_max_spare_nodes(). */
+    int max_spare_nodes;
+    /*! \brief The number of removals rebalanced lazily before the list
+        is compacted automatically, or zero if removals rebalance
+        eagerly. Read-only, use list_set_lazy_rebalancing(). */
+    int max_lazy_removals;
+    /*! \brief (Internal) The number of lazy removals since the list
+        was last compacted. */
+    int num_lazy_removals;
+    /*! \brief (Internal) Nonzero if nodes in the middle of the list may
+        be less than half full, because of lazy removals. */
+    int sparse;
+    /*! \brief (Internal) Nonzero if some nodes may be shared with a
+        list_snapshot, and must be copied before being modified. */
+    int shared;
+    /*! \brief (Internal) The function weighing elements for the index,
+        or NULL if the list has no weighted index. */
+    list_weight_function weight;
+    /*! \brief (Internal) Context pointer passed through to weight. */
+    void* weight_context;
+    /*! \brief (Internal) Doubly-linked chain of the fingers registered
+        with the list, or NULL if there are none. */
+    struct list_finger_t* fingers;
 } list;
 
 /*! \brief (Internal) A list iterator, referring to a position in a list.
@@ -75,9 +217,10 @@ typedef struct
   A consequence of this representation is that insertions or removals
   in the same node may invalidate iterators by causing a node split or
   merge. Only insertions at the end are safe against this
-  problem. Design question: should the data structure be fixing up
-  iterators when it splits or merges nodes? Would a list chop
-  primitive help?
+  problem. Positions that must survive edits elsewhere in the list
+  can be kept in a list_finger, which the list fixes up itself. Large
+  rearrangements can avoid the problem with list_splice_range() and
+  list_chop().
 */
 typedef struct
 {
@@ -85,23 +228,146 @@ typedef struct
     list* lst;
     /*! \brief The node containing the current element. */
     list_node* node;
-    /*! \brief The offset into the node's data array of the current element. */
+    /*! \brief The offset of the current element among the node's elements. */
     int offset;
 }  list_iter;
 
-/*! \brief Creates a new empty list. */
+/*! \brief A predicate on list elements.
+
+   \param value The element value being tested.
+   \param context The context pointer supplied by the caller.
+
+   \return Nonzero if the predicate holds for the value, else zero.
+*/
+typedef int (*list_predicate)(void* value, void* context);
+
+/*! \brief A comparison function ordering list elements.
+
+   \param left The first element value being compared.
+   \param right The second element value being compared.
+   \param context The context pointer supplied by the caller.
+
+   \return Negative if left orders before right, positive if after,
+   or zero if they are equivalent.
+*/
+typedef int (*list_comparator)(void* left, void* right, void* context);
+
+/*! \brief A function applied to each span of consecutive list elements.
+
+   \param data Pointer to the first element of the span.
+   \param count The number of elements in the span, at least one.
+   \param context The context pointer supplied by the caller.
+*/
+typedef void (*list_span_function)(void** data, int count, void* context);
+
+/*! \brief Creates a new empty list, whose nodes each fill
+    ::LIST_DEFAULT_NODE_CACHE_LINES cache lines. */
 list list_create(void);
 
+/*! \brief Creates a new empty list with the given node capacity.
+
+    Each node is allocated as a whole number of cache lines, aligned
+    to a cache line boundary where the C library supports it. Larger
+    nodes make iteration and bulk operations faster, while smaller
+    nodes make insertion and removal in the middle cheaper. Use
+    list_node_capacity_for_cache_lines() to choose a capacity that
+    fills its nodes' cache lines exactly.
+
+    \param node_capacity The maximum number of elements in each node,
+    from 2 to ::ELEMENTS_PER_LIST_NODE, or zero for the default.
+*/
+list list_create_with_capacity(int node_capacity);
+
+/*! \brief Creates a new empty list that allocates its nodes from a pool.
+
+    Several lists may share the same pool. The pool must not be
+    destroyed until every list using it has been destroyed. The list
+    takes its node capacity from the pool.
+
+    \param pool Pointer to the pool to allocate nodes from.
+*/
+list list_create_pooled(list_node_pool* pool);
+
 /*! \brief Destroys a list.
     Must be called on a list before it goes out of scope.
+
+    If the list was created with list_create_pooled() and is not
+    indexed, its nodes are returned to the pool in constant (O(1)) time.
+    Spare nodes cached by the list are released as well.
+
     \param lst Pointer to the list to destroy.
 */
 void list_destroy(list* lst);
 
+/*! \brief Preallocates nodes so that a list can grow to a given
+    size without allocating.
+
+    Enough spare nodes are added to the list's spare node cache to
+    hold the elements beyond its current size, filling each node.
+    They stay in the cache until used or the list is destroyed, even
+    beyond its high-water mark. Growth by insertion in the middle can
+    leave nodes partly full, and indexed lists still allocate index
+    entries, so this is a guarantee only for appending to an
+    unindexed list.
+
+    \param lst Pointer to the list.
+    \param num_elements The size the list should be able to reach.
+
+    \return Zero if out of memory, nonzero if successful.
+*/
+int list_reserve(list* lst, int num_elements);
+
+/*! \brief Sets the high-water mark of a list's spare node cache.
+
+    Nodes a list no longer needs are kept in its cache, up to this
+    many, and reused before any new node is allocated, so a list that
+    repeatedly grows and shrinks across a node boundary, such as a
+    stack or queue in steady state, does not allocate at all. Excess
+    cached nodes are released immediately. Lists start with a mark
+    of ::LIST_DEFAULT_MAX_SPARE_NODES.
+
+    \param lst Pointer to the list.
+    \param max_spare_nodes The most spare nodes to keep, zero to
+    release every node as soon as it is no longer needed.
+*/
+void list_set_max_spare_nodes(list* lst, int max_spare_nodes);
+
+/*! \brief Creates a new list node pool.
+
+    No memory is allocated until the first node is requested.
+
+    \param nodes_per_slab The number of nodes to allocate at once
+    whenever the pool runs out of free nodes, or zero to use
+    ::LIST_NODE_POOL_DEFAULT_SLAB_NODES.
+*/
+list_node_pool list_node_pool_create(int nodes_per_slab);
+
+/*! \brief Creates a new list node pool for lists with the given node capacity.
+
+    No memory is allocated until the first node is requested.
+
+    \param nodes_per_slab The number of nodes to allocate at once
+    whenever the pool runs out of free nodes, or zero to use
+    ::LIST_NODE_POOL_DEFAULT_SLAB_NODES.
+    \param node_capacity The node capacity of lists using the pool,
+    as for list_create_with_capacity(), or zero for the default.
+*/
+list_node_pool list_node_pool_create_with_capacity(int nodes_per_slab, int node_capacity);
+
+/*! \brief Destroys a list node pool, releasing all of its slabs at once.
+
+    Every list using the pool must already have been destroyed.
+
+    \param pool Pointer to the pool to destroy.
+*/
+void list_node_pool_destroy(list_node_pool* pool);
+
 /*! \brief Inserts a value into a list after the element referred to by the given iterator.
 
-   Requires constant (O(1)) time. Invalidates all iterators into the
-   list, except the supplied one which is updated as necessary.
+   Requires constant (O(1)) time, plus O(log n) if the list is
+   indexed and O(f) with f fingers registered. Invalidates all
+   iterators into the list, except the supplied one which is updated
+   as necessary.
 
    \param iter A pointer to the iterator to insert after.
    \param value The value to insert.
@@ -112,8 +378,10 @@ int list_insert_after(list_iter* iter, void* value);
 
 /*! \brief Inserts a value into a list before the element referred to by the given iterator.
 
-   Requires constant (O(1)) time. Invalidates all iterators into the
-   list, except the supplied one which is updated as necessary.
+   Requires constant (O(1)) time, plus O(log n) if the list is
+   indexed and O(f) with f fingers registered. Invalidates all
+   iterators into the list, except the supplied one which is updated
+   as necessary.
 
    \param iter A pointer to the iterator to insert before.
    \param value The value to insert.
@@ -124,8 +392,9 @@ int list_insert_before(list_iter* iter, void* value);
 
 /*! \brief Inserts a value at the beginning of a list.
 
-   Requires constant (O(1)) time. Invalidates all iterators into the
-   list.
+   Requires constant (O(1)) time, plus O(log n) if the list is
+   indexed and O(f) with f fingers registered. Invalidates all
+   iterators into the list.
 
    \param lst Pointer to the list to insert into.
    \param value The value to insert.
@@ -136,7 +405,7 @@ int list_insert_beginning(list* lst, void* value);
 
 /*! \brief Inserts a value at the end of a list.
 
-   Requires constant (O(1)) time.
+   Requires constant (O(1)) time, or O(log n) if the list is indexed.
 
    \param lst Pointer to the list to insert into.
    \param value The value to insert.
@@ -145,20 +414,312 @@ int list_insert_beginning(list* lst, void* value);
 */
 int list_insert_end(list* lst, void* value);
 
+/*! \brief Inserts an array of values into a list after the element referred to by the given iterator.
+
+   The node containing the iterator is split at most once, and the
+   values are copied directly into newly allocated, densely packed
+   nodes, so this requires only O(n/list::node_capacity)
+   allocations. Requires linear (O(n)) time in the number of values
+   inserted. Invalidates all iterators into the list, except the
+   supplied one which is updated as necessary. If out of memory,
+   the list is left unmodified.
+
+   \param iter A pointer to the iterator to insert after.
+   \param values The values to insert, in order.
+   \param num_values The number of values to insert.
+
+   \return Zero if out of memory, nonzero if successful.
+*/
+int list_insert_range_after(list_iter* iter, void** values, int num_values);
+
+/*! \brief Inserts an array of values at the end of a list.
+
+   Requires linear (O(n)) time in the number of values inserted, and
+   O(n/list::node_capacity) allocations. Invalidates no
+   iterators. If out of memory, the list is left unmodified.
+
+   \param lst Pointer to the list to insert into.
+   \param values The values to insert, in order, or NULL to append
+     elements with undefined values, to be overwritten in place, as
+     by list_readv_append().
+   \param num_values The number of values to insert.
+
+   \return Zero if out of memory, nonzero if successful.
+*/
+int list_append_range(list* lst, void** values, int num_values);
+
+/*! \brief Moves all elements of one list into another, before the element referred to by the given iterator.
+
+   Whole nodes are relinked rather than copied; only the node
+   containing the iterator and the nodes at the ends of the moved
+   chain are split or merged. Requires constant (O(1)) time, or
+   O(n/list::node_capacity) time if either list is indexed, plus
+   O(f) with f fingers registered with the two lists.
+   Invalidates all iterators into both lists, except the supplied one,
+   which is updated to refer to the same element. Both lists must use
+   the same node pool, or none, and the same node capacity. If out of
+   memory, neither list is modified.
+
+   \param dst_iter A pointer to the iterator to insert before, which may be the end iterator.
+   \param src Pointer to the list to move elements from, which is left empty.
+     Must not be the list dst_iter refers into.
+
+   \return Zero if out of memory, nonzero if successful.
+*/
+int list_splice(list_iter* dst_iter, list* src);
+
+/*! \brief Moves a range of elements from one list into another, before the element referred to by the given iterator.
+
+   Moves the elements from first up to but not including last. Whole
+   nodes are relinked rather than copied, so this requires
+   O(n/list::node_capacity) time in the number of elements moved, or
+   O(f*n/list::node_capacity) with f fingers registered with the two
+   lists.
+   Invalidates all iterators into both lists, except the supplied
+   ones. dst_iter is updated to refer to the same element, and first
+   and last are both updated to refer to the element last referred
+   to. Both lists must use the same node pool, or none, and the same
+   node capacity. If out of memory, neither list is modified.
+
+   \param dst_iter A pointer to the iterator to insert before, which may be the end iterator.
+   \param first A pointer to an iterator referring to the first element to move.
+   \param last A pointer to an iterator referring to the element after the last
+     one to move, which may be the end iterator. Must be in the same list as
+     first, which must not be the list dst_iter refers into.
+
+   \return Zero if out of memory, nonzero if successful.
+*/
+int list_splice_range(list_iter* dst_iter, list_iter* first, list_iter* last);
+
+/*! \brief Moves all elements from the given iterator onward to the end of another list.
+
+   Equivalent to list_splice_range() with the end iterators of both
+   lists. Afterwards iter is the end iterator of its list.
+
+   \param iter A pointer to an iterator referring to the first element to move.
+   \param out Pointer to the list to append the elements to. Must not be
+     the list iter refers into.
+
+   \return Zero if out of memory, nonzero if successful.
+*/
+int list_chop(list_iter* iter, list* out);
+
 /*! \brief Removes an element from a list.
 
-   Requires constant (O(1)) time. Invalidates all iterators
-   except the supplied one, which is updated to refer to the
-   following element.
+   Requires constant (O(1)) time, plus O(log n) if the list is
+   indexed and O(f) with f fingers registered. Invalidates all
+   iterators except the supplied one, which is updated to refer to
+   the following element. With lazy rebalancing, only a node left
+   empty is removed, and every so often the whole list is compacted
+   in linear time, still updating the supplied iterator.
 
    \param iter A pointer to the iterator to remove at.
+
+   \return Zero if out of memory, which can only happen while a
+   snapshot shares the element's node, in which case the list is not
+   modified, nonzero if successful.
+*/
+int list_remove(list_iter* iter);
+
+/*! \brief Removes a range of elements from a list.
+
+   Removes the elements from first up to but not including last.
+   Every node lying entirely inside the range is freed without
+   touching its elements, only the nodes at the two ends of the range
+   are trimmed, and nodes are rebalanced once afterwards. Requires
+   O(n/list::node_capacity) time in the number of elements
+   removed. Invalidates all iterators except the supplied ones, which
+   are both updated to refer to the element last referred to.
+
+   \param first A pointer to an iterator referring to the first element to remove.
+   \param last A pointer to an iterator referring to the element after the last
+     one to remove, which may be the end iterator. Must be in the same list as first.
+
+   \return Zero if out of memory, which can only happen while a
+   snapshot shares nodes of the list, in which case the list is not
+   modified, nonzero if successful.
+*/
+int list_remove_range(list_iter* first, list_iter* last);
+
+/*! \brief Chooses whether removals from a list rebalance its nodes
+    eagerly or lazily.
+
+    By default, list_remove() merges a node with its neighbors as soon
+    as they fit in fewer nodes, which keeps every node at least half
+    full but costs up to three memmoves per removal. Lazily, a removal
+    only drops a node left empty, and after max_lazy_removals such
+    removals the whole list is repacked by list_compact() in one pass,
+    so bursts of removals cost amortized constant time without
+    unbounded waste. Switching back to eager rebalancing compacts the
+    list first. Invalidates all iterators into the list. A compaction
+    that runs out of memory copying nodes shared with a snapshot
+    leaves the list as it is, to be compacted later.
+
+    \param lst Pointer to the list.
+    \param max_lazy_removals The number of lazy removals allowed
+    between compactions, INT_MAX to compact only when list_compact()
+    is called, or zero to rebalance eagerly.
 */
-void list_remove(list_iter* iter);
+void list_set_lazy_rebalancing(list* lst, int max_lazy_removals);
+
+/*! \brief Repacks a list into full nodes.
+
+   Moves the elements forward in one linear pass so that every node
+   but the last is full, and frees the nodes left empty. Each element
+   is copied at most twice, and no memory is allocated unless a
+   snapshot shares nodes of the list. Invalidates all iterators into
+   the list.
+
+   \param lst Pointer to the list to compact.
+
+   \return Zero if out of memory copying nodes shared with a
+   snapshot, in which case the list is not modified, nonzero if
+   successful.
+*/
+int list_compact(list* lst);
+
+/*! \brief Repacks a list into full, freshly allocated nodes laid out
+    in list order.
+
+   Like list_compact(), but copies the elements into new nodes and
+   frees the old ones. For a list using a node pool, the new nodes
+   are carved from one new slab holding exactly as many as needed, so
+   they are contiguous in memory and iteration afterward approaches
+   the locality of an array. Otherwise the nodes are allocated one at
+   a time in list order, which typically, though not certainly, places
+   them near each other. Invalidates all iterators into the list.
+
+   \param lst Pointer to the list to compact.
+
+   \return Zero if out of memory, in which case the list is not
+   modified, nonzero if successful.
+*/
+int list_compact_contiguous(list* lst);
+
+/*! \brief Removes every element of a list satisfying a predicate.
+
+   Streams through the list once, packing the surviving elements
+   densely into the existing nodes in their original order and freeing
+   the nodes left over at the end. Requires linear (O(n)) time and
+   performs no per-element rebalancing. Invalidates all iterators into
+   the list.
+
+   \param lst Pointer to the list to filter.
+   \param pred The predicate, called once for each element in order.
+   \param context A pointer passed through to each call of pred.
+
+   \return The number of elements removed, or -1 if out of memory
+   copying nodes shared with a snapshot, in which case the list is not
+   modified.
+*/
+int list_remove_if(list* lst, list_predicate pred, void* context);
+
+/*! \brief Sorts a list.
+
+   The sort is a stable merge sort: equivalent elements keep their
+   relative order. Consecutive nodes are first sorted as runs in a
+   fixed-size temporary array of LIST_SORT_BUFFER_ELEMENTS elements,
+   then runs are merged bottom-up, each merge writing into nodes
+   freed by the runs it consumes. Beyond that array, only two extra
+   nodes are needed, however long the list, and afterwards every
+   node but the last is full. If the array cannot be allocated, each
+   node forms its own initial run instead. Requires O(n log n) time.
+   Invalidates all iterators into the list. If out of memory, the
+   list is not modified.
+
+   \param lst Pointer to the list to sort.
+   \param cmp The comparison function.
+   \param context A pointer passed through to each call of cmp.
+
+   \return Zero if out of memory, nonzero if successful.
+*/
+int list_sort(list* lst, list_comparator cmp, void* context);
+
+/*! \brief Merges one sorted list into another.
+
+   Both lists must already be sorted according to cmp. Elements of src
+   are moved into dst so that dst remains sorted, with elements of src
+   placed after any equivalent elements of dst. Writes into nodes
+   freed from both lists as they are consumed, filling each one. Full
+   nodes that fit between elements of the other list are moved over
+   whole instead, so lists that overlap in few places merge in little
+   more than O(n/list::node_capacity) time. Once one list runs out at
+   a node boundary, the rest of the other is linked in as it is, so
+   only the nodes taken over from there, and the last node, may be
+   less than full. Requires linear (O(n)) time at most. Invalidates all
+   iterators into both lists. Both lists must use the same node pool,
+   or none, and the same node capacity. If out of memory, neither list
+   is modified.
+
+   \param dst Pointer to the list to merge into.
+   \param src Pointer to the list to merge from, which is left empty.
+     Must not be dst.
+   \param cmp The comparison function.
+   \param context A pointer passed through to each call of cmp.
+
+   \return Zero if out of memory, nonzero if successful.
+*/
+int list_merge_sorted(list* dst, list* src, list_comparator cmp, void* context);
+
+/*! \brief Appends the union of two sorted lists to a list.
+
+   Both lists must already be sorted according to cmp, and are not
+   modified. They are read together in one pass, and the result is
+   written straight into nodes appended to dst, all full but the last,
+   after topping off dst's last node. As with a multiset, an element
+   equivalent to m elements of a and n of b appears max(m, n) times,
+   the first m taken from a and the rest from b. Requires
+   O(n_a + n_b) time. Invalidates no iterators into dst, except
+   that the end iterator continues to refer to the end. If out of
+   memory, dst is not modified.
+
+   \param dst Pointer to the list to append the result to, which
+     need not be empty. Must be neither a nor b.
+   \param a Pointer to the first list. May be the same as b.
+   \param b Pointer to the second list.
+   \param cmp The comparison function.
+   \param context A pointer passed through to each call of cmp.
+
+   \return Zero if out of memory, nonzero if successful.
+*/
+int list_set_union(list* dst, list* a, list* b, list_comparator cmp, void* context);
+
+/*! \brief Appends the intersection of two sorted lists to a list.
+
+   As list_set_union(), except that an element equivalent to m
+   elements of a and n of b appears min(m, n) times, taken from a.
+
+   \param dst Pointer to the list to append the result to.
+   \param a Pointer to the first list.
+   \param b Pointer to the second list.
+   \param cmp The comparison function.
+   \param context A pointer passed through to each call of cmp.
+
+   \return Zero if out of memory, nonzero if successful.
+*/
+int list_set_intersection(list* dst, list* a, list* b, list_comparator cmp, void* context);
+
+/*! \brief Appends the elements of one sorted list missing from
+    another to a list.
+
+   As list_set_union(), except that an element equivalent to m
+   elements of a and n of b appears max(m - n, 0) times, taken from a.
+
+   \param dst Pointer to the list to append the result to.
+   \param a Pointer to the list to take elements from.
+   \param b Pointer to the list of elements to leave out.
+   \param cmp The comparison function.
+   \param context A pointer passed through to each call of cmp.
+
+   \return Zero if out of memory, nonzero if successful.
+*/
+int list_set_difference(list* dst, list* a, list* b, list_comparator cmp, void* context);
 
 /*! \brief Removes a value from the beginning of a nonempty list.
 
-   Requires constant (O(1)) time. Invalidates all iterators
-   into the list.
+   Requires constant (O(1)) time, plus O(log n) if the list is
+   indexed and O(f) with f fingers registered. Invalidates all
+   iterators into the list.
 
    \param lst Pointer to the list to remove from.
 */
@@ -166,7 +727,9 @@ void list_remove_beginning(list* lst);
 
 /*! \brief Removes a value from the end of a nonempty list.
 
-   Requires constant (O(1)) time. Invalidates no iterators.
+   Requires constant (O(1)) time, plus O(log n) if the list is
+   indexed and O(f) with f fingers registered. Invalidates no
+   iterators.
 
    \param lst Pointer to the list to remove from.
 */
@@ -193,6 +756,108 @@ list_iter list_first(list* lst);
 */
 list_iter list_last(list* lst);
 
+/*! \brief Builds an order-statistics index for a list.
+
+   Once built, the index is kept up to date by every operation that
+   modifies the list, at a cost of logarithmic (O(log n)) time per
+   node split or merge, and allows list_iter_at() and list_iter_index()
+   to run in logarithmic time. Requires O(n log n) time. Has no effect
+   if the list is already indexed.
+
+   \param lst Pointer to the list to index.
+
+   \return Zero if out of memory, or if nodes are built without
+   index links by ::LIST_COMPACT_NODES, nonzero if successful.
+*/
+int list_build_index(list* lst);
+
+/*! \brief Builds an order-statistics index for a list that also
+    keeps the total weight of the elements in each subtree.
+
+   Each element has a weight, such as the length of a piece of text,
+   and positions along the list can then be found by total weight,
+   for example by byte offset. Weights are kept up to date like the
+   element counts, but each update to a node weighs all of its
+   elements again, costing O(list::node_capacity) calls of weight.
+   Replaces any existing index. Requires O(n log n) time.
+
+   \param lst Pointer to the list to index.
+   \param weight The function giving the weight of each element.
+   \param context A pointer passed through to each call of weight.
+
+   \return Zero if out of memory, or if nodes are built without
+   index links by ::LIST_COMPACT_NODES, nonzero if successful.
+*/
+int list_build_weighted_index(list* lst, list_weight_function weight, void* context);
+
+/*! \brief Discards a list's order-statistics index, if it has one.
+
+   \param lst Pointer to the list.
+*/
+void list_drop_index(list* lst);
+
+/*! \brief Retrieves an iterator referring to the element at a given position.
+
+   Requires logarithmic (O(log n)) time if the list is indexed,
+   otherwise linear (O(n)) time.
+
+   \param lst Pointer to the list. Is not modified by this call.
+   \param index The zero-based position of the element, which may
+   equal the list size to retrieve the end iterator.
+
+   \return An iterator referring to the element at the given position.
+*/
+list_iter list_iter_at(list* lst, int index);
+
+/*! \brief Determines the position of the element an iterator refers to.
+
+   Requires logarithmic (O(log n)) time if the list is indexed,
+   otherwise linear (O(n)) time.
+
+   \param iter The iterator. For the end iterator, returns the list size.
+
+   \return The zero-based position of the element within its list.
+*/
+int list_iter_index(list_iter iter);
+
+/*! \brief Retrieves an iterator referring to the element that
+    contains a given weight offset.
+
+   Finds the element whose weight spans the offset, counting the
+   weights of all elements before it: the first element for which
+   list_prefix_weight() is at most weight and list_prefix_weight()
+   plus its own weight exceeds it. Elements of zero weight contain
+   no offset. Requires O(log n + list::node_capacity) time.
+
+   \param lst Pointer to a list with a weighted index.
+   \param weight The weight offset, at least zero.
+
+   \return An iterator referring to the element, or the end iterator
+   if weight is at least the total weight of the list.
+*/
+list_iter list_seek_weight(list* lst, long weight);
+
+/*! \brief Determines the total weight of the elements before the one
+    an iterator refers to.
+
+   Requires O(log n + list::node_capacity) time.
+
+   \param iter An iterator into a list with a weighted index. For the
+     end iterator, returns the total weight of the list.
+
+   \return The total weight of the elements before iter.
+*/
+long list_prefix_weight(list_iter iter);
+
+/*! \brief Updates a weighted index after the weight of an element
+    has changed in place.
+
+   Requires O(log n + list::node_capacity) time.
+
+   \param iter An iterator referring to the changed element.
+*/
+void list_update_weight(list_iter iter);
+
 /*! \brief Moves an iterator to the next element of the list.
 
    If the iterator is already the end iterator, fails.
@@ -237,7 +902,7 @@ list_iter list_last(list* lst);
     \return The data referred to by the given iterator.
 */
 #define list_get_data(iter) \
-            ((iter).node->data[(iter).offset])
+            ((iter).node->data[(iter).node->start + (iter).offset])
 
 /*! \brief Moves an iterator to the previous element of the list.
 
@@ -271,9 +936,433 @@ list_iter list_last(list* lst);
         } \
     }
 
+/*! \brief Hints that the memory at an address will be read soon.
+
+   Expands to a prefetch instruction on compilers that support one,
+   and to nothing otherwise. Never faults, even for NULL.
+*/
+#if defined(__GNUC__)
+#define /*void*/ list_prefetch(/*void**/ address) \
+            __builtin_prefetch(address)
+#else
+#define /*void*/ list_prefetch(/*void**/ address) \
+            ((void)0)
+#endif
+
+/*! \brief A macro used to iterate through a list one node at a time.
+
+   Begins the loop that visits each node's elements as one contiguous
+   array, in list order. Unlike LIST_ITERATE(), the body can run a
+   tight loop over each array that the compiler can unroll or
+   vectorize, with no per-element bookkeeping. The next node is
+   prefetched while the body runs. The loop is ended with the matching
+   LIST_ITERATE_SPANS_END() macro. The list must not be modified
+   inside the loop.
+
+   \param lst Pointer to the list to iterate over.
+   \param data_ptr The name to use for the void** which will point successively to each node's elements.
+   \param count The name to use for the int which will hold the number of elements at data_ptr, at least one.
+*/
+#define LIST_ITERATE_SPANS(lst, data_ptr, count) \
+    { \
+        list_node* list_iterate_spans_node; \
+        for (list_iterate_spans_node = (lst)->first_node; \
+             list_iterate_spans_node != NULL; \
+             list_iterate_spans_node = list_iterate_spans_node->next) \
+        { \
+            void** data_ptr = list_iterate_spans_node->data + \
+                              list_iterate_spans_node->start; \
+            int count = list_iterate_spans_node->count; \
+            list_prefetch(list_iterate_spans_node->next); \
+            {
+
+/*! \brief Closes a span iteration loop opened by LIST_ITERATE_SPANS(). */
+#define LIST_ITERATE_SPANS_END() \
+            } \
+        } \
+    }
+
+/*! \brief Applies a function to each node's elements, as one contiguous array at a time.
+
+   Visits every element in list order, in O(n/list::node_capacity)
+   calls. The function must not modify the list. See
+   LIST_ITERATE_SPANS() for the equivalent loop.
+
+   \param lst Pointer to the list. Is not modified by this call.
+   \param fn The function to call on each span.
+   \param context A pointer passed through to each call of fn.
+*/
+void list_for_each_span(list* lst, list_span_function fn, void* context);
+
+/*! \brief Finds the first element of a list equal to a given value.
+
+   Compares the elements of each node as one array, several at a time
+   with SIMD instructions where available (see ::LIST_USE_SIMD).
+   Requires linear (O(n)) time.
+
+   \param lst Pointer to the list. Is not modified by this call.
+   \param value The value to search for.
+
+   \return An iterator referring to the first element equal to value,
+   or the end iterator if there is none.
+*/
+list_iter list_find(list* lst, void* value);
+
+/*! \brief Finds the first element equal to a given value at or after
+   an iterator's position.
+
+   \param iter The iterator to start searching from. May be the end iterator.
+   \param value The value to search for.
+
+   \return An iterator referring to the first element at or after
+   iter equal to value, or the end iterator if there is none.
+*/
+list_iter list_find_from(list_iter iter, void* value);
+
+/*! \brief Counts the elements of a list equal to a given value.
+
+   Requires linear (O(n)) time, comparing several elements at a time
+   like list_find().
+
+   \param lst Pointer to the list. Is not modified by this call.
+   \param value The value to count.
+
+   \return The number of elements equal to value.
+*/
+int list_count(list* lst, void* value);
+
 /*! \brief Cheaply swaps one list's contents with another's. */
 void list_swap(list* lst1, list* lst2);
 
+/*! \brief (Internal) One node's elements as seen by a list_snapshot. */
+typedef struct
+{
+    /*! \brief The node, which the snapshot holds a reference to. */
+    list_node* node;
+    /*! \brief The node's first element when the snapshot was taken. */
+    void** data;
+    /*! \brief The node's element count when the snapshot was taken. */
+    int count;
+} list_snapshot_span;
+
+/*! \brief A read-only view of a list's contents at one moment.
+
+   A snapshot shares the list's nodes rather than copying their
+   elements. Each node is reference counted, and while a snapshot
+   holds a node, the list copies the node before writing any of its
+   elements, so only the nodes touched by later edits are ever
+   copied. The snapshot keeps its own array of nodes rather than
+   following their links, since the list relinks shared nodes freely.
+
+   Snapshots can be read on other threads while the list is being
+   modified, and destroyed on any thread if the list does not use a
+   node pool. Unlike list functions, the list_parallel functions
+   and direct assignments through list_get_data() do not copy
+   shared nodes, so call list_unshare() before using them.
+
+   The fields are internal.
+*/
+typedef struct
+{
+    /*! \brief The number of elements in the snapshot. Read-only. */
+    int size;
+    /*! \brief The number of nodes in the snapshot. */
+    int num_spans;
+    /*! \brief The snapshot's nodes, in list order. */
+    list_snapshot_span* spans;
+    /*! \brief The pool the nodes came from, or NULL. */
+    list_node_pool* pool;
+} list_snapshot;
+
+/*! \brief An iterator referring to a position in a list_snapshot. */
+typedef struct
+{
+    /*! \brief The snapshot into which this iterator points. */
+    list_snapshot* snapshot;
+    /*! \brief The index of the span containing the current element. */
+    int span;
+    /*! \brief The offset of the current element within its span. */
+    int offset;
+} list_snapshot_iter;
+
+/*! \brief Takes a snapshot of a list's current contents.
+
+   Requires O(n/list::node_capacity) time, to record each node, and
+   copies no elements. Later edits to the list copy only the nodes
+   they touch, on their first write after the snapshot.
+
+   \param lst Pointer to the list.
+   \param snapshot Pointer to the snapshot to initialize.
+
+   \return Zero if out of memory, nonzero if successful.
+*/
+int list_take_snapshot(list* lst, list_snapshot* snapshot);
+
+/*! \brief Destroys a snapshot, freeing the nodes no longer used by
+   the list or another snapshot.
+
+   If the list uses a node pool, must be called on the thread
+   modifying the list, and before the pool is destroyed.
+
+   \param snapshot Pointer to the snapshot to destroy.
+*/
+void list_snapshot_destroy(list_snapshot* snapshot);
+
+/*! \brief Copies every node of a list that is shared with a snapshot.
+
+   Afterwards the list's elements can be overwritten in place. List
+   functions that rearrange many nodes call this themselves, and fail
+   if out of memory while copying. Calling this first ensures that
+   list_remove(), list_remove_range() and list_compact() cannot fail.
+
+   \param lst Pointer to the list.
+
+   \return Zero if out of memory, nonzero if successful.
+*/
+int list_unshare(list* lst);
+
+/*! \brief Retrieves an iterator referring to the first element of a snapshot.
+
+   \param snapshot Pointer to the snapshot.
+
+   \return An iterator referring to the first element, or the end
+   iterator if the snapshot is empty.
+*/
+list_snapshot_iter list_snapshot_first(list_snapshot* snapshot);
+
+/*! \brief Determines if a snapshot iterator is the end iterator. */
+#define /*int*/ list_snapshot_at_end(/*list_snapshot_iter*/ iter) \
+            ((iter).span == (iter).snapshot->num_spans)
+
+/*! \brief Moves a snapshot iterator to the next element.
+
+   \param iter Pointer to the iterator, which must not be the end iterator.
+*/
+#define /*void*/ list_snapshot_next(/*list_snapshot_iter* */ iter) \
+    (assert ((iter) != NULL && !list_snapshot_at_end(*(iter))), \
+     (iter)->offset++, \
+     ((iter)->offset == (iter)->snapshot->spans[(iter)->span].count) ? \
+         ((iter)->offset = 0, \
+          (iter)->span++) : 0)
+
+/*! \brief Gets the element a snapshot iterator refers to.
+
+    The result is not an lvalue, since snapshots are read-only.
+*/
+#define /*void**/ list_snapshot_get_data(/*list_snapshot_iter*/ iter) \
+            ((void *)(iter).snapshot->spans[(iter).span].data[(iter).offset])
+
+/*! \brief Begins a loop iterating through a snapshot, ended by
+   LIST_SNAPSHOT_ITERATE_END().
+
+   \param snapshot Pointer to the snapshot to iterate over.
+   \param iterator The name to use for the list_snapshot_iter.
+*/
+#define LIST_SNAPSHOT_ITERATE(snapshot, iterator) \
+    { \
+        list_snapshot_iter iterator; \
+        for ((iterator) = list_snapshot_first(snapshot); \
+             !list_snapshot_at_end(iterator); \
+             list_snapshot_next(&iterator)) \
+        {
+
+/*! \brief Closes a loop opened by LIST_SNAPSHOT_ITERATE(). */
+#define LIST_SNAPSHOT_ITERATE_END() \
+        } \
+    }
+
+/*! \brief A position registered with a list, which the list keeps
+    referring to the same element as the list is modified.
+
+   Useful for editing a list at several places at once, such as the
+   cursors of a text editor. An edit through one finger, or anywhere
+   else, leaves every other finger referring to the element it
+   referred to before, where an ordinary list_iter would be left
+   invalid whenever a node is split, merged or shifted. A finger on
+   an element that is removed moves to the element after it, as the
+   iterator passed to list_remove() does.
+
+   Fingers are kept up to date by all insertions and removals,
+   including list_insert_range_after(), list_remove_range(),
+   list_remove_if() and list_batch_apply(), and by list_compact() and
+   list_compact_contiguous(). list_splice(), list_splice_range() and
+   list_chop() move the fingers on the elements they move to the other
+   list along with them. list_merge_sorted() keeps the fingers on
+   nodes it links in whole, moving those of src to dst, and moves
+   the rest, on elements it merges by copying, to the end iterator.
+   list_sort() moves every finger to the end iterator, as does
+   list_destroy(). Each edit costs O(f) more time with f fingers
+   registered, and splicing part of a list O(f) more per node moved,
+   so only a modest number should be.
+
+   The structure is intended to be stack-allocated or embedded in
+   other data structures, and must stay at the same address while
+   registered. Its fields are internal: read the position with
+   list_finger_iter() and change it with list_set_finger().
+*/
+typedef struct list_finger_t
+{
+    /*! \brief (Internal) The position the finger refers to. */
+    list_iter iter;
+    /*! \brief (Internal) The next finger registered with the list. */
+    struct list_finger_t* next;
+    /*! \brief (Internal) The previous finger registered with the list. */
+    struct list_finger_t* prev;
+} list_finger;
+
+/*! \brief Registers a finger with a list.
+
+   Requires constant time.
+
+   \param finger Pointer to the finger, which must not already be registered.
+   \param iter The position the finger should refer to, which may be
+     the end iterator. The finger is registered with iter's list.
+*/
+void list_add_finger(list_finger* finger, list_iter iter);
+
+/*! \brief Unregisters a finger from its list.
+
+   Requires constant time. Must be called before the finger's storage
+   is reused, but may be called after list_destroy().
+
+   \param finger Pointer to the registered finger.
+*/
+void list_remove_finger(list_finger* finger);
+
+/*! \brief Retrieves an iterator referring to a finger's position.
+
+   The iterator is a copy, valid until the list is next modified,
+   while the finger itself stays up to date. Edit at the finger by
+   passing a pointer to the copy to functions such as
+   list_insert_before() or list_remove().
+
+   \param finger Pointer to the registered finger.
+
+   \return An iterator referring to the finger's element, or the end
+   iterator.
+*/
+list_iter list_finger_iter(list_finger* finger);
+
+/*! \brief Moves a finger to another position in its list.
+
+   Requires constant time.
+
+   \param finger Pointer to the registered finger.
+   \param iter The new position, an iterator into the finger's list.
+*/
+void list_set_finger(list_finger* finger, list_iter iter);
+
+/*! \brief (Internal) One edit recorded in a list_batch. */
+typedef struct
+{
+    /*! \brief The node of the position edited, or NULL for the end. */
+    list_node* node;
+    /*! \brief The offset of the position edited within node. */
+    int offset;
+    /*! \brief Nonzero to remove the element at the position, zero to
+        insert value before it. */
+    int remove;
+    /*! \brief The value inserted. */
+    void* value;
+} list_batch_edit;
+
+/*! \brief A set of insertions and removals recorded against a list
+    and applied to it all at once.
+
+   Applying many edits one at a time shifts elements within their
+   nodes on every edit, and splits and rebalances the same nodes again
+   and again. A batch instead takes its edits in list order and
+   rebuilds each affected node once, in place, in one pass, spreading
+   its elements evenly over as many nodes as they need, so that its
+   cost depends on the number of edits and nodes touched rather than
+   on how the edits fall. This pays off when edits share nodes. With
+   one edit per node a batch gains little, since it reaches each node
+   twice, once to record the edit and once to apply it.
+
+   Positions are given by iterators into the list as it is when the
+   edits are recorded, which must be recorded in list order, each no
+   earlier than the one before. The list must not be modified between
+   recording the first edit and applying the batch. Fingers on
+   removed elements move to the next element kept, never to a value
+   inserted by the batch. The structure is intended to be
+   stack-allocated; the fields are internal.
+*/
+typedef struct
+{
+    /*! \brief The list the edits apply to. Read-only. */
+    list* lst;
+    /*! \brief (Internal) The edits recorded so far. */
+    list_batch_edit* edits;
+    /*! \brief The number of edits recorded so far. Read-only. */
+    int num_edits;
+    /*! \brief (Internal) The number of edits there is room for. */
+    int max_edits;
+} list_batch;
+
+/*! \brief Creates an empty batch of edits to a list.
+
+   \param lst Pointer to the list the edits will apply to.
+
+   \return The batch, which owns no memory until an edit is recorded.
+*/
+list_batch list_batch_create(list* lst);
+
+/*! \brief Destroys a batch, discarding any edits not applied.
+
+   \param batch Pointer to the batch.
+*/
+void list_batch_destroy(list_batch* batch);
+
+/*! \brief Records the insertion of a value before a position.
+
+   Values inserted before the same position appear in the order they
+   were recorded, before any element removed there, whether its
+   removal was recorded before or after them. Requires amortized
+   constant time.
+
+   \param batch Pointer to the batch.
+   \param iter The position to insert before, which may be the end
+     iterator to insert at the end of the list. Must be no earlier
+     than the position of the last edit recorded.
+   \param value The value to insert.
+
+   \return Zero if out of memory, nonzero if successful.
+*/
+int list_batch_insert(list_batch* batch, list_iter iter, void* value);
+
+/*! \brief Records the removal of an element.
+
+   Requires amortized constant time.
+
+   \param batch Pointer to the batch.
+   \param iter An iterator referring to the element, which must not
+     be the end iterator, and must not be removed twice by one batch.
+     Must be no earlier than the position of the last edit recorded.
+
+   \return Zero if out of memory, nonzero if successful.
+*/
+int list_batch_remove(list_batch* batch, list_iter iter);
+
+/*! \brief Applies every edit recorded in a batch, and empties it.
+
+   Each affected node is rebuilt once, and one that loses elements
+   is then merged with its neighbors as list_remove() would, unless
+   they are still to be rebuilt, or lazy removal is enabled, in which
+   case the list is left for list_compact(). Requires
+   O(k + t*list::node_capacity) time for k edits touching t nodes,
+   so a batch pays off when each node takes several edits. With
+   edits scattered one to a node, it costs about as much as making
+   them one at a time. Invalidates all iterators into the list, but
+   keeps fingers referring to the same elements. Nodes shared with a
+   snapshot are replaced, never copied.
+
+   \param batch Pointer to the batch.
+
+   \return Zero if out of memory, in which case the list and the
+   batch are left unchanged, nonzero if successful.
+*/
+int list_batch_apply(list_batch* batch);
+
 #endif /* #ifndef _LIST_ */
 
 /** @} */ /* end of group list */
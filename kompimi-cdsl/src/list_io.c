@@ -0,0 +1,633 @@
+/* Originally distributed as part of the Kompimi C Data Structure Library.
+   For updates, see: https://sourceforge.net/projects/kompimi-cdsl/
+
+   All content in this document is granted into the public
+   domain. Where this is not legally possible, the copyright owner
+   releases all rights. This notice may be modified or removed.
+*/
+
+/* Needed for pread() and mmap() in strict ANSI modes */
+#define _XOPEN_SOURCE 600
+
+#include <assert.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "list_io.h"
+
+/*! \brief Written as an int into each file header, to detect files
+    written on a machine with another byte order. */
+#define LIST_IO_BYTE_ORDER_MARK  0x01020304
+
+/*! \brief The number of I/O vectors passed to each system call. */
+#if defined(IOV_MAX) && IOV_MAX < LIST_IO_MAX_VECTORS
+#define LIST_IO_VECTORS  IOV_MAX
+#else
+#define LIST_IO_VECTORS  LIST_IO_MAX_VECTORS
+#endif
+
+/*! \brief (Internal) The header at the start of each list file. */
+typedef struct
+{
+    /*! \brief Identifies the format, as stream_magic or image_magic. */
+    char magic[8];
+    /*! \brief ::LIST_IO_BYTE_ORDER_MARK, in the writer's byte order. */
+    int byte_order;
+    /*! \brief sizeof(void*) on the writing machine. */
+    int pointer_size;
+    /*! \brief The size in bytes of each element's record. */
+    int element_size;
+    /*! \brief The node capacity of the list written. */
+    int node_capacity;
+    /*! \brief The number of elements in the list. */
+    int size;
+    /*! \brief In an image, the number of nodes. */
+    int num_nodes;
+    /*! \brief In an image, the address its links are laid out for. */
+    void* base_address;
+} list_file_header;
+
+/*! \brief (Internal) A buffer batching reads or writes on a file descriptor. */
+typedef struct
+{
+    /*! \brief The file descriptor read or written. */
+    int fd;
+    /*! \brief The buffer, of ::LIST_IO_BUFFER_SIZE bytes. */
+    char* data;
+    /*! \brief The number of bytes of data filled, by the caller when
+        writing, or by reads from fd when reading. */
+    size_t used;
+    /*! \brief When reading, the offset of the first unconsumed byte. */
+    size_t position;
+} list_io_buffer;
+
+static const char stream_magic[8] = "KCDSLST";
+static const char image_magic[8] = "KCDSIMG";
+
+/*! \brief Allocates the buffer of a list_io_buffer. Returns zero if
+    out of memory. */
+static int open_buffer(list_io_buffer* buffer, int fd);
+
+/*! \brief Returns a pointer to the next length bytes of a write
+    buffer for the caller to fill in, writing out what it holds first
+    if they do not fit. Returns NULL if a write fails. */
+static void* reserve_bytes(list_io_buffer* buffer, size_t length);
+
+/*! \brief Writes out the contents of a write buffer. Returns zero if
+    a write fails. */
+static int flush_buffer(list_io_buffer* buffer);
+
+/*! \brief Returns a pointer to the next length bytes read from the
+    file, valid until the next call, reading more into the buffer if
+    needed. Returns NULL on a read error or the end of the file. */
+static const void* consume_bytes(list_io_buffer* buffer, size_t length);
+
+/*! \brief Advances an array of I/O vectors past length bytes
+    transferred, dropping the vectors completed. */
+static void advance_vectors(struct iovec** vectors, int* num_vectors, size_t length);
+
+/*! \brief Reads into the elements from iter to the end of its list
+    straight from a file, with one I/O vector per node, until they
+    are full or the file ends. Returns the number of bytes read. */
+static size_t read_vectors(int fd, list_iter iter);
+
+/*! \brief Moves an iterator forward by count elements. */
+static void advance_iter(list_iter* iter, int count);
+
+/*! \brief Fills in the fields of a header common to both formats. */
+static void fill_header(list_file_header* header, const char* magic,
+                        list* lst, int element_size);
+
+/*! \brief Returns nonzero if a header has the given magic and was
+    written by a machine like this one. */
+static int check_header(const list_file_header* header, const char* magic);
+
+/*! \brief The size in bytes of the header of an image, which is
+    padded so that the nodes following it are aligned to cache lines. */
+static size_t image_header_size(void);
+
+/*! \brief The distance in bytes between consecutive nodes in an
+    image, the same as the size of a node allocated by a list. */
+static size_t image_node_size(int node_capacity);
+
+/*! \brief The address of the given node of an image mapped at base. */
+static list_node* image_node(void* base, int node_capacity, int index);
+
+int list_write(list* lst, int fd, int element_size, list_encode_function encode, void* context)
+{
+    list_io_buffer buffer;
+    list_file_header header;
+    list_node* node;
+    void* record;
+    int success;
+    assert(element_size > 0 && element_size <= LIST_IO_BUFFER_SIZE);
+    assert(encode != NULL || element_size == sizeof(void *));
+    if (!open_buffer(&buffer, fd))
+    {
+        return 0;
+    }
+    fill_header(&header, stream_magic, lst, element_size);
+    record = reserve_bytes(&buffer, sizeof(header));
+    success = (record != NULL);
+    if (success)
+    {
+        memcpy(record, &header, sizeof(header));
+    }
+
+    /* Each node's elements are written as one counted run */
+    for (node = lst->first_node; node != NULL && success; node = node->next)
+    {
+        int count = node->count;
+        int i;
+        if (count == 0)
+        {
+            continue;
+        }
+        record = reserve_bytes(&buffer, sizeof(int));
+        if (record == NULL)
+        {
+            success = 0;
+            break;
+        }
+        memcpy(record, &count, sizeof(int));
+        for (i = 0; i < count; i++)
+        {
+            record = reserve_bytes(&buffer, element_size);
+            if (record == NULL)
+            {
+                success = 0;
+                break;
+            }
+            if (encode != NULL)
+            {
+                encode(node->data[node->start + i], record, context);
+            }
+            else
+            {
+                memcpy(record, &node->data[node->start + i], sizeof(void *));
+            }
+        }
+    }
+    success = success && flush_buffer(&buffer);
+    free(buffer.data);
+    return success;
+}
+
+int list_read(list* lst, int fd, int element_size, list_decode_function decode, void* context)
+{
+    list_io_buffer buffer;
+    list_file_header header;
+    void* values[ELEMENTS_PER_LIST_NODE];
+    const void* record;
+    int remaining;
+    int success;
+    assert(element_size > 0 && element_size <= LIST_IO_BUFFER_SIZE);
+    assert(decode != NULL || element_size == sizeof(void *));
+    if (!open_buffer(&buffer, fd))
+    {
+        return 0;
+    }
+    record = consume_bytes(&buffer, sizeof(header));
+    success = (record != NULL);
+    if (success)
+    {
+        memcpy(&header, record, sizeof(header));
+        success = check_header(&header, stream_magic) &&
+                  header.element_size == element_size && header.size >= 0;
+    }
+    remaining = success ? header.size : 0;
+    while (remaining > 0 && success)
+    {
+        int count, i;
+        record = consume_bytes(&buffer, sizeof(int));
+        if (record == NULL)
+        {
+            success = 0;
+            break;
+        }
+        memcpy(&count, record, sizeof(int));
+        if (count <= 0 || count > ELEMENTS_PER_LIST_NODE || count > remaining)
+        {
+            success = 0;
+            break;
+        }
+        for (i = 0; i < count; i++)
+        {
+            record = consume_bytes(&buffer, element_size);
+            if (record == NULL)
+            {
+                success = 0;
+                break;
+            }
+            if (decode != NULL)
+            {
+                values[i] = decode(record, context);
+            }
+            else
+            {
+                memcpy(&values[i], record, sizeof(void *));
+            }
+        }
+        success = success && list_append_range(lst, values, count);
+        remaining -= count;
+    }
+
+    /* Hand back what was read past the list, where the file allows it */
+    if (buffer.used > buffer.position)
+    {
+        lseek(fd, -(off_t)(buffer.used - buffer.position), SEEK_CUR);
+    }
+    free(buffer.data);
+    return success;
+}
+
+int list_write_image(list* lst, int fd, list_encode_function encode, void* context, void* base_address)
+{
+    list_io_buffer buffer;
+    list_file_header header;
+    list_node* node;
+    list_node* out = NULL;
+    int capacity = lst->node_capacity;
+    size_t node_size = image_node_size(capacity);
+    void* record;
+    int index = -1;
+    int success;
+    if (!open_buffer(&buffer, fd))
+    {
+        return 0;
+    }
+    fill_header(&header, image_magic, lst, sizeof(void *));
+    header.num_nodes = (lst->size + capacity - 1) / capacity;
+    header.base_address = (base_address != NULL) ? base_address
+                                                 : LIST_IMAGE_DEFAULT_BASE_ADDRESS;
+    record = reserve_bytes(&buffer, image_header_size());
+    success = (record != NULL);
+    if (success)
+    {
+        memset(record, 0, image_header_size());
+        memcpy(record, &header, sizeof(header));
+    }
+
+    /* Pack the elements into full nodes, linked as they will be
+       when the file is mapped at its base address */
+    for (node = lst->first_node; node != NULL && success; node = node->next)
+    {
+        int i;
+        for (i = 0; i < node->count; i++)
+        {
+            if (out == NULL || out->count == capacity)
+            {
+                out = (list_node *)reserve_bytes(&buffer, node_size);
+                if (out == NULL)
+                {
+                    success = 0;
+                    break;
+                }
+                index++;
+                memset(out, 0, node_size);
+                out->refcount = 1;
+                if (index > 0)
+                {
+                    out->prev = image_node(header.base_address, capacity, index - 1);
+                }
+                if (index < header.num_nodes - 1)
+                {
+                    out->next = image_node(header.base_address, capacity, index + 1);
+                }
+            }
+            if (encode != NULL)
+            {
+                encode(node->data[node->start + i], &out->data[out->count], context);
+            }
+            else
+            {
+                out->data[out->count] = node->data[node->start + i];
+            }
+            out->count++;
+        }
+    }
+    success = success && flush_buffer(&buffer);
+    free(buffer.data);
+    return success;
+}
+
+int list_map_image(list_image* image, int fd)
+{
+    list_file_header header;
+    struct stat info;
+    size_t length;
+    char* address;
+    int i;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < image_header_size() ||
+        pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+    {
+        return 0;
+    }
+    length = (size_t)info.st_size;
+    if (!check_header(&header, image_magic) ||
+        header.element_size != (int)sizeof(void *) ||
+        header.node_capacity < 2 || header.node_capacity > ELEMENTS_PER_LIST_NODE ||
+        header.size < 0 ||
+        header.num_nodes != (header.size + header.node_capacity - 1) / header.node_capacity ||
+        (size_t)header.num_nodes > (length - image_header_size()) / image_node_size(header.node_capacity))
+    {
+        return 0;
+    }
+
+    address = (char *)mmap(header.base_address, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (address == (char *)MAP_FAILED)
+    {
+        return 0;
+    }
+    if (address != (char *)header.base_address)
+    {
+        /* The base address is taken, so map a private copy elsewhere
+           and relink its nodes for where it landed */
+        munmap(address, length);
+        address = (char *)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (address == (char *)MAP_FAILED)
+        {
+            return 0;
+        }
+        for (i = 0; i < header.num_nodes; i++)
+        {
+            list_node* node = image_node(address, header.node_capacity, i);
+            node->prev = (i > 0) ? image_node(address, header.node_capacity, i - 1) : NULL;
+            node->next = (i < header.num_nodes - 1)
+                ? image_node(address, header.node_capacity, i + 1) : NULL;
+        }
+        mprotect(address, length, PROT_READ);
+    }
+
+    image->lst = list_create_with_capacity(header.node_capacity);
+    image->lst.size = header.size;
+    if (header.num_nodes > 0)
+    {
+        image->lst.first_node = image_node(address, header.node_capacity, 0);
+        image->lst.last_node = image_node(address, header.node_capacity, header.num_nodes - 1);
+    }
+    image->address = address;
+    image->length = length;
+    return 1;
+}
+
+void list_unmap_image(list_image* image)
+{
+    munmap(image->address, image->length);
+    memset(image, 0, sizeof(*image));
+}
+
+int list_to_iovec(list_iter* iter, struct iovec* vectors, int max_vectors)
+{
+    int num_vectors = 0;
+    assert(max_vectors >= 0);
+    while (num_vectors < max_vectors && !list_at_end(*iter))
+    {
+        list_node* node = iter->node;
+        vectors[num_vectors].iov_base = node->data + node->start + iter->offset;
+        vectors[num_vectors].iov_len = (node->count - iter->offset) * sizeof(void *);
+        num_vectors++;
+        iter->node = node->next;
+        iter->offset = 0;
+    }
+    return num_vectors;
+}
+
+int list_writev(list* lst, int fd)
+{
+    list_io_buffer buffer;
+    list_node* node;
+    int success = 1;
+
+    /* Nodes are too small for a vector each to beat copying them */
+    if (!open_buffer(&buffer, fd))
+    {
+        return 0;
+    }
+    for (node = lst->first_node; node != NULL && success; node = node->next)
+    {
+        void* record = reserve_bytes(&buffer, node->count * sizeof(void *));
+        if (record == NULL)
+        {
+            success = 0;
+            break;
+        }
+        memcpy(record, node->data + node->start, node->count * sizeof(void *));
+    }
+    success = success && flush_buffer(&buffer);
+    free(buffer.data);
+    return success;
+}
+
+int list_readv_append(list* lst, int fd, int num_values)
+{
+    list_iter first = list_last(lst);
+    list_iter last;
+    size_t bytes_read;
+    int num_read;
+    assert(num_values >= 0);
+    if (!list_append_range(lst, NULL, num_values))
+    {
+        return 0;
+    }
+
+    /* Appending invalidates no iterators, so the new elements start
+       just after the old last one */
+    if (list_at_end(first))
+    {
+        first = list_first(lst);
+    }
+    else
+    {
+        list_next(&first);
+    }
+    bytes_read = read_vectors(fd, first);
+
+    /* Drop the elements not read, including any read only in part */
+    num_read = (int)(bytes_read / sizeof(void *));
+    if (num_read < num_values)
+    {
+        advance_iter(&first, num_read);
+        last = list_last(lst);
+        list_next(&last);
+        /* Cannot fail, since appending left every node in the range
+           unshared */
+        list_remove_range(&first, &last);
+    }
+    return num_read;
+}
+
+static size_t read_vectors(int fd, list_iter iter)
+{
+    struct iovec vectors[LIST_IO_VECTORS];
+    size_t bytes_read = 0;
+    int num_vectors;
+    while ((num_vectors = list_to_iovec(&iter, vectors, LIST_IO_VECTORS)) > 0)
+    {
+        struct iovec* next = vectors;
+        while (num_vectors > 0)
+        {
+            ssize_t result = readv(fd, next, num_vectors);
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (result <= 0)
+            {
+                return bytes_read;
+            }
+            bytes_read += result;
+            advance_vectors(&next, &num_vectors, result);
+        }
+    }
+    return bytes_read;
+}
+
+static void advance_iter(list_iter* iter, int count)
+{
+    while (count > 0)
+    {
+        int skipped = iter->node->count - iter->offset;
+        if (skipped > count)
+        {
+            skipped = count;
+        }
+        iter->offset += skipped;
+        count -= skipped;
+        if (iter->offset == iter->node->count)
+        {
+            iter->node = iter->node->next;
+            iter->offset = 0;
+        }
+    }
+}
+
+static void advance_vectors(struct iovec** vectors, int* num_vectors, size_t length)
+{
+    while (*num_vectors > 0 && length >= (*vectors)->iov_len)
+    {
+        length -= (*vectors)->iov_len;
+        (*vectors)++;
+        (*num_vectors)--;
+    }
+    if (*num_vectors > 0)
+    {
+        (*vectors)->iov_base = (char *)(*vectors)->iov_base + length;
+        (*vectors)->iov_len -= length;
+    }
+}
+
+static int open_buffer(list_io_buffer* buffer, int fd)
+{
+    buffer->fd = fd;
+    buffer->used = 0;
+    buffer->position = 0;
+    buffer->data = (char *)malloc(LIST_IO_BUFFER_SIZE);
+    return buffer->data != NULL;
+}
+
+static void* reserve_bytes(list_io_buffer* buffer, size_t length)
+{
+    void* result;
+    assert(length <= LIST_IO_BUFFER_SIZE);
+    if (buffer->used + length > LIST_IO_BUFFER_SIZE && !flush_buffer(buffer))
+    {
+        return NULL;
+    }
+    result = buffer->data + buffer->used;
+    buffer->used += length;
+    return result;
+}
+
+static int flush_buffer(list_io_buffer* buffer)
+{
+    size_t written = 0;
+    while (written < buffer->used)
+    {
+        ssize_t result = write(buffer->fd, buffer->data + written, buffer->used - written);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return 0;
+        }
+        written += result;
+    }
+    buffer->used = 0;
+    return 1;
+}
+
+static const void* consume_bytes(list_io_buffer* buffer, size_t length)
+{
+    const void* result;
+    assert(length <= LIST_IO_BUFFER_SIZE);
+    if (buffer->used - buffer->position < length)
+    {
+        memmove(buffer->data, buffer->data + buffer->position,
+                buffer->used - buffer->position);
+        buffer->used -= buffer->position;
+        buffer->position = 0;
+        while (buffer->used < length)
+        {
+            ssize_t result = read(buffer->fd, buffer->data + buffer->used,
+                                  LIST_IO_BUFFER_SIZE - buffer->used);
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (result <= 0)
+            {
+                return NULL;
+            }
+            buffer->used += result;
+        }
+    }
+    result = buffer->data + buffer->position;
+    buffer->position += length;
+    return result;
+}
+
+static void fill_header(list_file_header* header, const char* magic,
+                        list* lst, int element_size)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, magic, sizeof(header->magic));
+    header->byte_order = LIST_IO_BYTE_ORDER_MARK;
+    header->pointer_size = sizeof(void *);
+    header->element_size = element_size;
+    header->node_capacity = lst->node_capacity;
+    header->size = lst->size;
+}
+
+static int check_header(const list_file_header* header, const char* magic)
+{
+    return memcmp(header->magic, magic, sizeof(header->magic)) == 0 &&
+           header->byte_order == LIST_IO_BYTE_ORDER_MARK &&
+           header->pointer_size == (int)sizeof(void *);
+}
+
+static size_t image_header_size(void)
+{
+    return (sizeof(list_file_header) + LIST_CACHE_LINE_SIZE - 1) &
+           ~(size_t)(LIST_CACHE_LINE_SIZE - 1);
+}
+
+static size_t image_node_size(int node_capacity)
+{
+    size_t size = offsetof(list_node, data) + node_capacity * sizeof(void *);
+    return (size + LIST_CACHE_LINE_SIZE - 1) & ~(size_t)(LIST_CACHE_LINE_SIZE - 1);
+}
+
+static list_node* image_node(void* base, int node_capacity, int index)
+{
+    return (list_node *)((size_t)base + image_header_size() +
+                         (size_t)index * image_node_size(node_capacity));
+}
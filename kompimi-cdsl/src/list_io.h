@@ -0,0 +1,229 @@
+/* Originally distributed as part of the Kompimi C Data Structure Library.
+   For updates, see: https://sourceforge.net/projects/kompimi-cdsl/
+
+   All content in this document is granted into the public
+   domain. Where this is not legally possible, the copyright owner
+   releases all rights. This notice may be modified or removed.
+*/
+
+/** @defgroup list_io list_io module
+    Methods for saving lists to files and loading them back.
+
+   Two formats are supported. The streaming format, written by
+   list_write() and read by list_read(), is a short header followed
+   by each node's element count and its elements packed together.
+   Elements are converted to and from fixed-size records by caller
+   supplied functions, so any pointed-to data can be saved with them.
+   It can be written to and read from pipes and sockets.
+
+   The image format, written by list_write_image(), holds the list's
+   nodes themselves, laid out as they would be in memory at a chosen
+   base address. list_map_image() maps an image file read-only and
+   returns a list that can be iterated in place, without reading or
+   converting anything up front, so that even very large lists are
+   available immediately and are paged in as they are used. If the
+   file cannot be mapped at its base address, the links between its
+   nodes are relocated instead, which touches every node once.
+
+   Finally, list_writev() and list_readv_append() transfer the raw
+   element pointers with no header. Reading passes one I/O vector per
+   node, as built by list_to_iovec(), so that the elements are not
+   copied in memory. Writing gathers them into a buffer, which costs
+   less than a vector per node at every node capacity.
+
+   All of these are native to the machine that wrote them. A
+   streaming or image file written on a machine with another byte
+   order or pointer size is rejected. Only load files from trusted sources; they are checked
+   for consistency but not for deliberate corruption. Requires POSIX
+   file descriptors and mmap().
+
+   See tests/list_test.c for example code.
+
+    @{
+*/
+
+#ifndef _LIST_IO_
+#define _LIST_IO_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "list.h"
+
+/*! \brief A function that converts a list element into a record.
+
+   \param value The element value.
+   \param record Pointer to the record to fill in, of the element
+     size given to the writing function.
+   \param context The context pointer supplied by the caller.
+*/
+typedef void (*list_encode_function)(void* value, void* record, void* context);
+
+/*! \brief A function that converts a record back into a list element.
+
+   \param record Pointer to the record, of the element size given
+     to the reading function. It is not suitably aligned for any
+     particular type, so copy fields out with memcpy().
+   \param context The context pointer supplied by the caller.
+
+   \return The element value.
+*/
+typedef void* (*list_decode_function)(const void* record, void* context);
+
+/*! \brief A list loaded from an image file by list_map_image().
+
+   The list may be iterated, and searched by functions such as
+   list_find() and list_iter_at(), but must not be modified or
+   snapshotted, or be passed to list_destroy(). The fields are
+   internal, except for lst.
+*/
+typedef struct
+{
+    /*! \brief The list, whose nodes lie in the mapped file. Read-only. */
+    list lst;
+    /*! \brief The address the file is mapped at. */
+    void* address;
+    /*! \brief The length in bytes of the mapping. */
+    size_t length;
+} list_image;
+
+/*! \brief Writes a list to a file in the streaming format.
+
+   Requires O(n) time. Writes are buffered, so only a few system
+   calls are made per thousand elements.
+
+   \param lst Pointer to the list to write.
+   \param fd The file descriptor to write to, at its current position.
+   \param element_size The size in bytes of each element's record.
+   \param encode The function filling in each element's record, or
+     NULL to store the element pointers themselves, in which case
+     element_size must be sizeof(void*).
+   \param context A pointer passed through to each call of encode.
+
+   \return Zero if out of memory or a write failed, with errno set
+   by the failing write, nonzero if successful.
+*/
+int list_write(list* lst, int fd, int element_size, list_encode_function encode, void* context);
+
+/*! \brief Reads a list written by list_write(), appending its
+    elements to the end of a list.
+
+   Requires O(n) time. Invalidates all iterators into the list.
+
+   \param lst Pointer to the list to append to.
+   \param fd The file descriptor to read from, at its current position.
+   \param element_size The size in bytes of each element's record,
+     which must match the size the list was written with.
+   \param decode The function converting each record into an element,
+     or NULL if the element pointers themselves were stored.
+   \param context A pointer passed through to each call of decode.
+
+   \return Zero if out of memory, a read failed, or the data is not a
+   list written with this element size, nonzero if successful. On
+   failure, the elements read so far are left appended to the list.
+*/
+int list_read(list* lst, int fd, int element_size, list_decode_function decode, void* context);
+
+/*! \brief Writes a list to a file in the image format.
+
+   The image holds full nodes of the list's node capacity, linked as
+   if the file were mapped at base_address. Each element is stored as
+   a pointer-sized word, which is what list_get_data() returns when
+   the image is mapped, so encode must produce values meaningful
+   without the original process, such as integers or offsets into
+   some other file. Requires O(n) time.
+
+   \param lst Pointer to the list to write.
+   \param fd The file descriptor to write to, at its beginning.
+   \param encode The function filling in each element's word, or
+     NULL to store the element values unchanged.
+   \param context A pointer passed through to each call of encode.
+   \param base_address The address the image should be mapped at,
+     which must be a multiple of the page size, or NULL to use
+     ::LIST_IMAGE_DEFAULT_BASE_ADDRESS. Give images that will be
+     loaded into the same process ranges that do not overlap.
+
+   \return Zero if out of memory or a write failed, nonzero if successful.
+*/
+int list_write_image(list* lst, int fd, list_encode_function encode, void* context, void* base_address);
+
+/*! \brief Maps a file written by list_write_image() into memory.
+
+   Requires constant time if the file can be mapped at the base
+   address it was written for, in which case its pages are mapped
+   shared and read-only, and loaded only as they are touched.
+   Otherwise the file is mapped privately elsewhere and its node
+   links relocated, which requires O(n/list::node_capacity) time.
+   The file descriptor may be closed afterwards.
+
+   \param image Pointer to the image to initialize.
+   \param fd The file descriptor of the image file.
+
+   \return Zero if out of memory, the file could not be mapped, or
+   it is not a valid image, nonzero if successful.
+*/
+int list_map_image(list_image* image, int fd);
+
+/*! \brief Unmaps an image mapped by list_map_image().
+
+   Invalidates all iterators into the image's list.
+
+   \param image Pointer to the image to unmap.
+*/
+void list_unmap_image(list_image* image);
+
+/*! \brief Describes the elements of a list as I/O vectors, one per node.
+
+   Each vector covers the elements of one node, which lie together
+   in memory, starting with the element iter refers to. Requires
+   O(max_vectors) time.
+
+   \param iter Pointer to an iterator referring to the first element
+     to describe, which is advanced to the first element not described,
+     or to the end iterator, so that the next call continues from there.
+   \param vectors Receives the vectors, which point into the list's
+     nodes and stay valid until the list is next modified.
+   \param max_vectors The largest number of vectors to fill in.
+
+   \return The number of vectors filled in, zero only at the end of the list.
+*/
+int list_to_iovec(list_iter* iter, struct iovec* vectors, int max_vectors);
+
+/*! \brief Writes the element pointers of a list to a file.
+
+   Gathers the pointers into a buffer of ::LIST_IO_BUFFER_SIZE bytes
+   and writes it out whenever it fills. Even nodes of four cache lines
+   cost less to copy than to pass to writev() as a vector each, so
+   this is a copying writer; use list_to_iovec() to write straight
+   from the nodes instead. Requires O(n) time.
+
+   \param lst Pointer to the list to write.
+   \param fd The file descriptor to write to.
+
+   \return Zero if a write failed, with errno set by the failing
+   write, nonzero if successful.
+*/
+int list_writev(list* lst, int fd);
+
+/*! \brief Reads element pointers written by list_writev(), appending
+    them to the end of a list.
+
+   Allocates full nodes for the elements first, then reads straight
+   into them with readv(), a batch of up to ::LIST_IO_MAX_VECTORS
+   nodes per call. Never reads past the last element requested, so it
+   can be used on pipes and sockets. Requires O(n) time. Invalidates
+   no iterators, though elements not read are removed again.
+
+   \param lst Pointer to the list to append to.
+   \param fd The file descriptor to read from.
+   \param num_values The number of elements to read.
+
+   \return The number of elements appended, which is less than
+   num_values only at the end of the file, if a read failed, or if
+   out of memory.
+*/
+int list_readv_append(list* lst, int fd, int num_values);
+
+#endif /* #ifndef _LIST_IO_ */
+
+/** @} */ /* end of group list_io */
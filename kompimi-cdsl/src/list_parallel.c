@@ -0,0 +1,358 @@
+/* Originally distributed as part of the Kompimi C Data Structure Library.
+   For updates, see: https://sourceforge.net/projects/kompimi-cdsl/
+
+   All content in this document is granted into the public
+   domain. Where this is not legally possible, the copyright owner
+   releases all rights. This notice may be modified or removed.
+*/
+
+/* Needed for sysconf() in strict ANSI modes */
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+
+#include <malloc.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "list_parallel.h"
+
+/*! \brief (Internal) A range of consecutive list nodes processed by
+    one thread, along with what to do with them. */
+typedef struct
+{
+    /*! \brief The first node of the range. */
+    list_node* first;
+    /*! \brief The node after the last node of the range, or NULL. */
+    list_node* end;
+    /*! \brief The position in the list of the range's first element. */
+    int first_index;
+    /*! \brief Function applied to each span by list_parallel_for_each(),
+        or NULL when reducing. */
+    list_span_function for_each_fn;
+    /*! \brief Function folding each span by list_parallel_reduce(),
+        or NULL when not reducing. */
+    list_reduce_function reduce_fn;
+    /*! \brief This range's private accumulator, when reducing. */
+    void* accumulator;
+    /*! \brief Context pointer passed through to the functions. */
+    void* context;
+} list_parallel_range;
+
+/*! \brief (Internal) One list sorted, or one pair of sorted lists
+    merged, by one thread of list_parallel_sort(). */
+typedef struct
+{
+    /*! \brief The list to sort, or to merge into. */
+    list* dst;
+    /*! \brief The list to merge from, or NULL when sorting. */
+    list* src;
+    /*! \brief The comparison function. */
+    list_comparator cmp;
+    /*! \brief Context pointer passed through to cmp. */
+    void* context;
+    /*! \brief Set to the result of list_sort() or list_merge_sorted(). */
+    int success;
+} list_parallel_sort_task;
+
+/*! \brief Chooses the number of threads to use for a request of num_threads. */
+static int choose_num_threads(int num_threads);
+
+/*! \brief Cuts the node chain of a list into at most num_ranges
+    ranges of consecutive nodes with roughly equal element counts.
+    Returns the number of ranges actually produced, which is smaller
+    if the list has fewer nodes. */
+static int split_ranges(list* lst, list_parallel_range* ranges, int num_ranges);
+
+/*! \brief Runs a function on each of an array of task structures,
+    on new threads except for the first task, which runs on the
+    calling thread. Returns once all are done. */
+static void run_tasks(void* (*fn)(void*), void* tasks, size_t task_size, int num_tasks);
+
+/*! \brief Thread entry point processing one list_parallel_range. */
+static void* run_range(void* range);
+
+/*! \brief Thread entry point processing one list_parallel_sort_task. */
+static void* run_sort_task(void* task);
+
+int list_parallel_for_each(list* lst, list_span_function fn, void* context, int num_threads)
+{
+    list_parallel_range ranges[LIST_PARALLEL_MAX_THREADS];
+    int num_ranges, i;
+    /* fn may overwrite elements, which snapshots must not see */
+    if (!list_unshare(lst))
+    {
+        return 0;
+    }
+    num_ranges = split_ranges(lst, ranges, choose_num_threads(num_threads));
+    for (i = 0; i < num_ranges; i++)
+    {
+        ranges[i].for_each_fn = fn;
+        ranges[i].reduce_fn = NULL;
+        ranges[i].accumulator = NULL;
+        ranges[i].context = context;
+    }
+    run_tasks(run_range, ranges, sizeof(list_parallel_range), num_ranges);
+    return 1;
+}
+
+int list_parallel_reduce(list* lst, list_reduce_function fn,
+                         list_combine_function combine,
+                         void* result, size_t result_size,
+                         void* context, int num_threads)
+{
+    list_parallel_range ranges[LIST_PARALLEL_MAX_THREADS];
+    char* accumulators;
+    int num_ranges, i;
+    num_ranges = split_ranges(lst, ranges, choose_num_threads(num_threads));
+    if (num_ranges == 0)
+    {
+        return 1;
+    }
+    accumulators = (char *)malloc(num_ranges * result_size);
+    if (accumulators == NULL)
+    {
+        return 0;
+    }
+    for (i = 0; i < num_ranges; i++)
+    {
+        ranges[i].for_each_fn = NULL;
+        ranges[i].reduce_fn = fn;
+        ranges[i].accumulator = accumulators + i * result_size;
+        ranges[i].context = context;
+        memcpy(ranges[i].accumulator, result, result_size);
+    }
+    run_tasks(run_range, ranges, sizeof(list_parallel_range), num_ranges);
+
+    /* Combine in list order, so combine need not be commutative */
+    memcpy(result, ranges[0].accumulator, result_size);
+    for (i = 1; i < num_ranges; i++)
+    {
+        combine(result, ranges[i].accumulator, context);
+    }
+    free(accumulators);
+    return 1;
+}
+
+int list_parallel_sort(list* lst, list_comparator cmp, void* context, int num_threads)
+{
+    list sublists[LIST_PARALLEL_MAX_THREADS];
+    list_parallel_range ranges[LIST_PARALLEL_MAX_THREADS];
+    list_parallel_sort_task tasks[LIST_PARALLEL_MAX_THREADS];
+    int num_ranges, num_lists, step, i;
+    int success = 1;
+    if (lst->pool != NULL || lst->indexed)
+    {
+        return list_sort(lst, cmp, context);
+    }
+    num_ranges = split_ranges(lst, ranges, choose_num_threads(num_threads));
+    if (num_ranges <= 1)
+    {
+        return list_sort(lst, cmp, context);
+    }
+
+    /* Cut the list into sublists from the back, the first staying in
+       lst. Cuts are found by position rather than by node, since
+       moving nodes out can merge the nodes left near the cut. */
+    for (num_lists = num_ranges; num_lists > 1; num_lists--)
+    {
+        list_iter iter;
+        sublists[num_lists - 1] = list_create_with_capacity(lst->node_capacity);
+        iter = list_iter_at(lst, ranges[num_lists - 1].first_index);
+        if (!list_chop(&iter, &sublists[num_lists - 1]))
+        {
+            break;
+        }
+    }
+    if (num_lists > 1)
+    {
+        /* Out of memory, so splice the sublists already cut back on.
+           This cannot fail, since whole nodes go to the end of an
+           unindexed list. */
+        for (i = num_lists - 1; i < num_ranges; i++)
+        {
+            list_iter end = list_last(lst);
+            list_next(&end);
+            list_splice(&end, &sublists[i]);
+            list_destroy(&sublists[i]);
+        }
+        return 0;
+    }
+
+    /* Sort the sublists in parallel, then merge pairs of neighbors in
+       parallel until one is left, keeping equal elements in order */
+    sublists[0] = *lst;
+    for (i = 0; i < num_ranges; i++)
+    {
+        tasks[i].dst = &sublists[i];
+        tasks[i].src = NULL;
+        tasks[i].cmp = cmp;
+        tasks[i].context = context;
+    }
+    run_tasks(run_sort_task, tasks, sizeof(list_parallel_sort_task), num_ranges);
+    for (i = 0; i < num_ranges; i++)
+    {
+        success = success && tasks[i].success;
+    }
+    for (step = 1; step < num_ranges; step *= 2)
+    {
+        int num_tasks = 0;
+        for (i = 0; i + step < num_ranges; i += 2*step)
+        {
+            tasks[num_tasks].dst = &sublists[i];
+            tasks[num_tasks].src = &sublists[i + step];
+            num_tasks++;
+        }
+        run_tasks(run_sort_task, tasks, sizeof(list_parallel_sort_task), num_tasks);
+        for (i = 0; i < num_tasks; i++)
+        {
+            if (!tasks[i].success)
+            {
+                /* Keep the elements, if not their order */
+                list_iter end = list_last(tasks[i].dst);
+                list_next(&end);
+                list_splice(&end, tasks[i].src);
+                success = 0;
+            }
+        }
+    }
+    for (i = 1; i < num_ranges; i++)
+    {
+        list_destroy(&sublists[i]);
+    }
+    *lst = sublists[0];
+    return success;
+}
+
+static int choose_num_threads(int num_threads)
+{
+    assert(num_threads >= 0);
+    if (num_threads == 0)
+    {
+        long num_processors = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = (num_processors > 0) ? (int)num_processors : 1;
+    }
+    if (num_threads > LIST_PARALLEL_MAX_THREADS)
+    {
+        num_threads = LIST_PARALLEL_MAX_THREADS;
+    }
+    return num_threads;
+}
+
+static int split_ranges(list* lst, list_parallel_range* ranges, int num_ranges)
+{
+    list_node* node;
+    int num_made = 0;
+    int elements_before = 0;
+    assert(num_ranges >= 1);
+    if (lst->indexed)
+    {
+        /* Seek directly to each boundary instead of walking the chain */
+        int i;
+        for (i = 0; i < num_ranges; i++)
+        {
+            int index = (int)((double)lst->size * i / num_ranges);
+            list_iter iter = list_iter_at(lst, index);
+            if (iter.node != NULL &&
+                (num_made == 0 || iter.node != ranges[num_made - 1].first))
+            {
+                ranges[num_made].first = iter.node;
+                ranges[num_made].first_index = index - iter.offset;
+                num_made++;
+            }
+        }
+    }
+    else
+    {
+        /* A range starts at the first node beginning at or after its
+           share of the elements */
+        for (node = lst->first_node; node != NULL; node = node->next)
+        {
+            if ((double)elements_before * num_ranges >= (double)lst->size * num_made)
+            {
+                ranges[num_made].first = node;
+                ranges[num_made].first_index = elements_before;
+                num_made++;
+                if (num_made == num_ranges)
+                {
+                    break;
+                }
+            }
+            elements_before += node->count;
+        }
+    }
+    if (num_made > 0)
+    {
+        int i;
+        for (i = 0; i < num_made - 1; i++)
+        {
+            ranges[i].end = ranges[i + 1].first;
+        }
+        ranges[num_made - 1].end = NULL;
+    }
+    return num_made;
+}
+
+static void run_tasks(void* (*fn)(void*), void* tasks, size_t task_size, int num_tasks)
+{
+    pthread_t threads[LIST_PARALLEL_MAX_THREADS];
+    int started[LIST_PARALLEL_MAX_THREADS];
+    char* task = (char *)tasks;
+    int i;
+    for (i = 1; i < num_tasks; i++)
+    {
+        started[i] = (pthread_create(&threads[i], NULL, fn, task + i * task_size) == 0);
+    }
+    if (num_tasks > 0)
+    {
+        fn(task);
+    }
+    for (i = 1; i < num_tasks; i++)
+    {
+        if (started[i])
+        {
+            pthread_join(threads[i], NULL);
+        }
+        else
+        {
+            /* Could not start a thread, so do its share here */
+            fn(task + i * task_size);
+        }
+    }
+}
+
+static void* run_range(void* range_ptr)
+{
+    list_parallel_range* range = (list_parallel_range *)range_ptr;
+    list_node* node;
+    for (node = range->first; node != range->end; node = node->next)
+    {
+        list_prefetch(node->next);
+        if (range->reduce_fn != NULL)
+        {
+            range->reduce_fn(node->data + node->start, node->count,
+                             range->accumulator, range->context);
+        }
+        else
+        {
+            range->for_each_fn(node->data + node->start, node->count,
+                               range->context);
+        }
+    }
+    return NULL;
+}
+
+static void* run_sort_task(void* task_ptr)
+{
+    list_parallel_sort_task* task = (list_parallel_sort_task *)task_ptr;
+    if (task->src == NULL)
+    {
+        task->success = list_sort(task->dst, task->cmp, task->context);
+    }
+    else
+    {
+        task->success = list_merge_sorted(task->dst, task->src, task->cmp, task->context);
+    }
+    return NULL;
+}
@@ -0,0 +1,119 @@
+/* Originally distributed as part of the Kompimi C Data Structure Library.
+   For updates, see: https://sourceforge.net/projects/kompimi-cdsl/
+
+   All content in this document is granted into the public
+   domain. Where this is not legally possible, the copyright owner
+   releases all rights. This notice may be modified or removed.
+*/
+
+/** @defgroup list_parallel list_parallel module
+    Methods for processing the elements of a list on several threads.
+
+   The node chain of a list is cut into one range of consecutive
+   nodes per thread, balanced by element count, and each range is
+   processed on its own POSIX thread. The calling thread processes
+   the first range itself. Functions are applied to one node's
+   elements at a time, as in list_for_each_span().
+
+   The list must not be modified while these functions run, except
+   that the supplied functions may overwrite the elements they are
+   given. Requires linking with the pthread library.
+
+   See tests/list_test.c for example code.
+
+    @{
+*/
+
+#ifndef _LIST_PARALLEL_
+#define _LIST_PARALLEL_
+
+#include <stddef.h>
+
+#include "list.h"
+
+/*! \brief A function that folds a span of list elements into an accumulator.
+
+   \param data Pointer to the first element of the span.
+   \param count The number of elements in the span, at least one.
+   \param accumulator Pointer to the calling thread's private accumulator.
+   \param context The context pointer supplied by the caller.
+*/
+typedef void (*list_reduce_function)(void** data, int count, void* accumulator, void* context);
+
+/*! \brief A function that merges one accumulator into another.
+
+   \param accumulator Pointer to the accumulator to update.
+   \param partial Pointer to an accumulator for elements following
+     all those folded into accumulator.
+   \param context The context pointer supplied by the caller.
+*/
+typedef void (*list_combine_function)(void* accumulator, void* partial, void* context);
+
+/*! \brief Applies a function to each node's elements, on several threads.
+
+   Spans in different ranges are processed concurrently, so fn must
+   be safe to call from several threads at once. Spans within one
+   range are processed in list order.
+
+   \param lst Pointer to the list. Its structure is not modified.
+   \param fn The function to call on each span. It may overwrite the
+     elements of the span it is given.
+   \param context A pointer passed through to each call of fn.
+   \param num_threads The number of threads to use, including the
+     calling one, or zero to use one per online processor.
+
+   \return Zero if out of memory, nonzero if successful.
+*/
+int list_parallel_for_each(list* lst, list_span_function fn, void* context, int num_threads);
+
+/*! \brief Reduces the elements of a list to a single value, on several threads.
+
+   Each thread starts with its own copy of the initial value of
+   *result, folds its range into that copy with fn, and the copies
+   are then combined into *result in list order with combine. The
+   initial value must therefore be an identity for combine.
+
+   \param lst Pointer to the list. Its structure is not modified.
+   \param fn The function that folds each span into an accumulator.
+   \param combine The function that merges accumulators, which must
+     be associative.
+   \param result Pointer to the accumulator holding the initial value,
+     which receives the result.
+   \param result_size The size in bytes of the accumulator.
+   \param context A pointer passed through to each call of fn and combine.
+   \param num_threads The number of threads to use, including the
+     calling one, or zero to use one per online processor.
+
+   \return Zero if out of memory, nonzero if successful.
+*/
+int list_parallel_reduce(list* lst, list_reduce_function fn,
+                         list_combine_function combine,
+                         void* result, size_t result_size,
+                         void* context, int num_threads);
+
+/*! \brief Sorts a list, on several threads.
+
+   Cuts the list into one sublist per thread, sorts each with
+   list_sort() on its own thread, then merges neighboring sublists
+   with list_merge_sorted(), in parallel pairs, until one remains.
+   The sort is stable. Lists that are indexed or use a node pool are
+   sorted by list_sort() on the calling thread alone, since index and
+   pool updates are not thread-safe. Invalidates all iterators into
+   the list.
+
+   \param lst Pointer to the list to sort.
+   \param cmp The comparison function, which must be safe to call
+     from several threads at once.
+   \param context A pointer passed through to each call of cmp.
+   \param num_threads The number of threads to use, including the
+     calling one, or zero to use one per online processor.
+
+   \return Zero if out of memory, nonzero if successful. If out of
+   memory the list still holds the same elements, but they may be
+   only partly sorted.
+*/
+int list_parallel_sort(list* lst, list_comparator cmp, void* context, int num_threads);
+
+#endif /* #ifndef _LIST_PARALLEL_ */
+
+/** @} */ /* end of group list_parallel */
@@ -0,0 +1,381 @@
+/* Originally distributed as part of the Kompimi C Data Structure Library.
+   For updates, see: https://sourceforge.net/projects/kompimi-cdsl/
+
+   All content in this document is granted into the public
+   domain. Where this is not legally possible, the copyright owner
+   releases all rights. This notice may be modified or removed.
+*/
+
+#include <malloc.h>
+#include <string.h>
+
+#include "list_queue.h"
+
+#if !defined(__GNUC__)
+#error "list_queue.c requires the GCC or Clang __atomic builtins"
+#endif
+
+/* Shorthands for the atomic operations used. Loads that see a count
+   or link published by another thread acquire, so that the elements
+   or node initialization written before it are visible. Links read
+   atomically elsewhere are stored atomically, if relaxed. */
+#define atomic_load_relaxed(ptr)   __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define atomic_load(ptr)           __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define atomic_load_acquire(ptr)   __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define atomic_store_relaxed(ptr, value) \
+    __atomic_store_n((ptr), (value), __ATOMIC_RELAXED)
+#define atomic_store_release(ptr, value) \
+    __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#define atomic_fetch_add(ptr, value) \
+    __atomic_fetch_add((ptr), (value), __ATOMIC_SEQ_CST)
+#define atomic_exchange(ptr, value) \
+    __atomic_exchange_n((ptr), (value), __ATOMIC_SEQ_CST)
+#define atomic_compare_exchange(ptr, expected_ptr, desired) \
+    __atomic_compare_exchange_n((ptr), (expected_ptr), (desired), 0, \
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+/*! \brief Marks a producer as inside a push on a multi-producer
+    queue, and returns the epoch it entered in. */
+static int enter_producer(list_queue* queue);
+
+/*! \brief Marks a producer as done with the push it began in an epoch. */
+static void exit_producer(list_queue* queue, int epoch);
+
+/*! \brief Returns the node after node in the queue, or the first node
+    if node is NULL, appending a new one if there is none yet, and
+    advances the queue's tail past node. Returns NULL if out of memory. */
+static list_queue_node* append_node(list_queue* queue, list_queue_node* node);
+
+/*! \brief Takes a recycled node, or allocates a new one, and resets
+    it to empty. Returns NULL if out of memory. */
+static list_queue_node* take_free_node(list_queue* queue);
+
+/*! \brief Pushes a chain of nodes linked through free_next, ending
+    at last, onto the queue's stack of recycled nodes. */
+static void push_free_nodes(list_queue* queue, list_queue_node* first, list_queue_node* last);
+
+/*! \brief Called by the consumer when it has drained a node. */
+static void retire_node(list_queue* queue, list_queue_node* node);
+
+/*! \brief Recycles drained nodes that no producer can still be using,
+    and starts a new epoch for those drained since. */
+static void reclaim_nodes(list_queue* queue);
+
+/*! \brief Frees a chain of nodes linked through free_next. */
+static void free_node_chain(list_queue_node* node);
+
+list_queue list_queue_create(int multi_producer)
+{
+    list_queue result;
+    memset(&result, 0, sizeof(result));
+    result.multi_producer = multi_producer;
+    return result;
+}
+
+void list_queue_destroy(list_queue* queue)
+{
+    list_queue_node* node = (queue->head != NULL) ? queue->head : queue->first;
+    while (node != NULL)
+    {
+        list_queue_node* next = node->next;
+        free(node);
+        node = next;
+    }
+    free_node_chain(queue->retired);
+    free_node_chain(queue->grace);
+    free_node_chain(queue->free_nodes);
+    free(queue->spare);
+    memset(queue, 0, sizeof(*queue));
+}
+
+int list_queue_push_batch(list_queue* queue, void** values, int count)
+{
+    int pushed = 0;
+    int epoch = 0;
+    if (queue->multi_producer)
+    {
+        epoch = enter_producer(queue);
+    }
+    while (pushed < count)
+    {
+        list_queue_node* node = atomic_load_acquire(&queue->tail);
+        int offset;
+        if (node != NULL)
+        {
+            /* Claim space for the rest of the batch; whatever falls
+               past the end of the node goes in the next one */
+            if (queue->multi_producer)
+            {
+                offset = atomic_fetch_add(&node->reserved, count - pushed);
+            }
+            else
+            {
+                offset = node->committed;
+            }
+            if (offset < LIST_QUEUE_NODE_ELEMENTS)
+            {
+                int num_copied = count - pushed;
+                if (num_copied > LIST_QUEUE_NODE_ELEMENTS - offset)
+                {
+                    num_copied = LIST_QUEUE_NODE_ELEMENTS - offset;
+                }
+                memcpy(node->data + offset, values + pushed, num_copied * sizeof(void *));
+                if (queue->multi_producer)
+                {
+                    __atomic_fetch_add(&node->committed, num_copied, __ATOMIC_RELEASE);
+                }
+                else
+                {
+                    atomic_store_release(&node->committed, offset + num_copied);
+                }
+                pushed += num_copied;
+                continue;
+            }
+        }
+        if (append_node(queue, node) == NULL)
+        {
+            break;
+        }
+    }
+    if (queue->multi_producer)
+    {
+        exit_producer(queue, epoch);
+    }
+    return pushed;
+}
+
+int list_queue_pop_batch(list_queue* queue, void** values, int max_count)
+{
+    list_queue_node* node = queue->head;
+    int popped = 0;
+    if (node == NULL)
+    {
+        node = queue->head = atomic_load_acquire(&queue->first);
+        if (node == NULL)
+        {
+            return 0;
+        }
+    }
+    while (popped < max_count)
+    {
+        int available;
+        if (queue->multi_producer)
+        {
+            /* Producers fill their claimed slots in any order, so the
+               node can be read only once every claim is written. Read
+               the written count first: when it equals the claimed
+               count read after it, every claim counted is written. */
+            int committed = atomic_load_acquire(&node->committed);
+            int reserved = atomic_load_relaxed(&node->reserved);
+            if (reserved > LIST_QUEUE_NODE_ELEMENTS)
+            {
+                reserved = LIST_QUEUE_NODE_ELEMENTS;
+            }
+            if (committed != reserved)
+            {
+                break;
+            }
+            available = committed - queue->head_offset;
+        }
+        else
+        {
+            available = atomic_load_acquire(&node->committed) - queue->head_offset;
+        }
+
+        if (available > 0)
+        {
+            int num_copied = max_count - popped;
+            if (num_copied > available)
+            {
+                num_copied = available;
+            }
+            memcpy(values + popped, node->data + queue->head_offset, num_copied * sizeof(void *));
+            queue->head_offset += num_copied;
+            popped += num_copied;
+        }
+        else
+        {
+            /* Move to the next node once this one is drained and
+               producers have moved on from it */
+            list_queue_node* next;
+            if (queue->head_offset < LIST_QUEUE_NODE_ELEMENTS)
+            {
+                break;
+            }
+            next = atomic_load_acquire(&node->next);
+            if (next == NULL)
+            {
+                break;
+            }
+            {
+                list_queue_node* expected = node;
+                atomic_compare_exchange(&queue->tail, &expected, next);
+            }
+            retire_node(queue, node);
+            node = queue->head = next;
+            queue->head_offset = 0;
+        }
+    }
+    if (queue->multi_producer)
+    {
+        reclaim_nodes(queue);
+    }
+    return popped;
+}
+
+int list_queue_push(list_queue* queue, void* value)
+{
+    return list_queue_push_batch(queue, &value, 1);
+}
+
+int list_queue_pop(list_queue* queue, void** value_ptr)
+{
+    return list_queue_pop_batch(queue, value_ptr, 1);
+}
+
+static int enter_producer(list_queue* queue)
+{
+    /* Count ourselves in the current epoch, retrying if it changed
+       meanwhile, so the consumer cannot miss us when it waits for
+       the producers of an earlier epoch */
+    for (;;)
+    {
+        int epoch = atomic_load(&queue->epoch);
+        atomic_fetch_add(&queue->active_producers[epoch & 1], 1);
+        if (atomic_load(&queue->epoch) == epoch)
+        {
+            return epoch;
+        }
+        atomic_fetch_add(&queue->active_producers[epoch & 1], -1);
+    }
+}
+
+static void exit_producer(list_queue* queue, int epoch)
+{
+    atomic_fetch_add(&queue->active_producers[epoch & 1], -1);
+}
+
+static list_queue_node* append_node(list_queue* queue, list_queue_node* node)
+{
+    list_queue_node** link = (node != NULL) ? &node->next : &queue->first;
+    list_queue_node* next = atomic_load_acquire(link);
+    if (next == NULL)
+    {
+        list_queue_node* new_node = take_free_node(queue);
+        if (new_node == NULL)
+        {
+            return NULL;
+        }
+        next = NULL;
+        if (!atomic_compare_exchange(link, &next, new_node))
+        {
+            /* Another producer appended first. The node cannot go back
+               on the free stack, where a producer popping it could be
+               fooled by its return, so keep it aside for the next append. */
+            new_node = atomic_exchange(&queue->spare, new_node);
+            free(new_node);
+        }
+        else
+        {
+            next = new_node;
+        }
+    }
+    {
+        list_queue_node* expected = node;
+        atomic_compare_exchange(&queue->tail, &expected, next);
+    }
+    return next;
+}
+
+static list_queue_node* take_free_node(list_queue* queue)
+{
+    list_queue_node* node = NULL;
+    if (atomic_load_relaxed(&queue->spare) != NULL)
+    {
+        node = atomic_exchange(&queue->spare, node);
+    }
+    if (node == NULL)
+    {
+        /* A node popped here cannot be recycled and pushed back while
+           we are between reading it and swapping it out, since it is
+           recycled only after every producer inside a push has left */
+        node = atomic_load_acquire(&queue->free_nodes);
+        while (node != NULL &&
+               !atomic_compare_exchange(&queue->free_nodes, &node,
+                                        atomic_load_relaxed(&node->free_next)))
+        {
+        }
+    }
+    if (node == NULL)
+    {
+        node = (list_queue_node *)malloc(sizeof(list_queue_node));
+        if (node == NULL)
+        {
+            return NULL;
+        }
+    }
+    node->reserved = 0;
+    node->committed = 0;
+    node->next = NULL;
+    atomic_store_relaxed(&node->free_next, NULL);
+    return node;
+}
+
+static void push_free_nodes(list_queue* queue, list_queue_node* first, list_queue_node* last)
+{
+    list_queue_node* top = atomic_load_relaxed(&queue->free_nodes);
+    do
+    {
+        atomic_store_relaxed(&last->free_next, top);
+    } while (!atomic_compare_exchange(&queue->free_nodes, &top, first));
+}
+
+static void retire_node(list_queue* queue, list_queue_node* node)
+{
+    if (queue->multi_producer)
+    {
+        /* A producer that read the tail before it moved on may still
+           be looking at the node */
+        atomic_store_relaxed(&node->free_next, queue->retired);
+        queue->retired = node;
+    }
+    else
+    {
+        /* The only producer moved on before linking in the next node */
+        push_free_nodes(queue, node, node);
+    }
+}
+
+static void reclaim_nodes(list_queue* queue)
+{
+    if (queue->grace != NULL &&
+        atomic_load(&queue->active_producers[queue->grace_epoch & 1]) == 0)
+    {
+        /* Every producer that could have seen these nodes has left */
+        list_queue_node* last = queue->grace;
+        while (last->free_next != NULL)
+        {
+            last = last->free_next;
+        }
+        push_free_nodes(queue, queue->grace, last);
+        queue->grace = NULL;
+    }
+    if (queue->grace == NULL && queue->retired != NULL)
+    {
+        /* No producer entering after the epoch changes can reach the
+           retired nodes, so wait only for those already inside */
+        queue->grace = queue->retired;
+        queue->retired = NULL;
+        queue->grace_epoch = atomic_fetch_add(&queue->epoch, 1);
+    }
+}
+
+static void free_node_chain(list_queue_node* node)
+{
+    while (node != NULL)
+    {
+        list_queue_node* next = node->free_next;
+        free(node);
+        node = next;
+    }
+}
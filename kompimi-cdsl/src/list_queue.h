@@ -0,0 +1,164 @@
+/* Originally distributed as part of the Kompimi C Data Structure Library.
+   For updates, see: https://sourceforge.net/projects/kompimi-cdsl/
+
+   All content in this document is granted into the public
+   domain. Where this is not legally possible, the copyright owner
+   releases all rights. This notice may be modified or removed.
+*/
+
+/** @defgroup list_queue list_queue module
+    A lock-free FIFO queue of pointers for passing work between threads.
+
+   Like a list, the queue is a chain of nodes each holding many
+   elements, so pushing and popping in batches moves whole runs of
+   pointers with a single atomic update per node. Each node has an
+   atomic count of the elements written into it, which producers
+   advance and the consumer reads; the consumer's read position is
+   private to it. Nodes the consumer has drained are recycled for
+   later pushes rather than freed.
+
+   A queue has exactly one consumer thread. It is created either for
+   a single producer thread, which needs no atomic read-modify-write
+   operations, or for any number of producer threads, which claim
+   space in the last node with an atomic counter. With several
+   producers, the elements pushed by each one are popped in the
+   order it pushed them, but a batch may be interleaved with
+   elements from other producers.
+
+   No function blocks: list_queue_pop_batch() returns zero if nothing
+   is ready. Requires the GCC or Clang __atomic builtins.
+
+   See tests/list_test.c for example code.
+
+    @{
+*/
+
+#ifndef _LIST_QUEUE_
+#define _LIST_QUEUE_
+
+#include "config.h"
+
+/*! \brief (Internal) A node of a list_queue. */
+typedef struct list_queue_node_t
+{
+    /*! \brief The number of element slots claimed by producers,
+        which may exceed the node's capacity. Used only with
+        multiple producers. */
+    int reserved;
+    /*! \brief The number of elements written into the node. */
+    int committed;
+    /*! \brief The next node in the queue, or NULL. */
+    struct list_queue_node_t* next;
+    /*! \brief The next node in a chain of drained or free nodes. */
+    struct list_queue_node_t* free_next;
+    /*! \brief The elements, stored from the start of the array. */
+    void* data[LIST_QUEUE_NODE_ELEMENTS];
+} list_queue_node;
+
+/*! \brief A lock-free queue of pointers with one consumer.
+
+    The fields are internal. The consumer's fields are kept on
+    different cache lines from the producers' ones.
+*/
+typedef struct
+{
+    /*! \brief (Consumer) The node holding the next element to pop,
+        or NULL before the first element is pushed. */
+    list_queue_node* head;
+    /*! \brief (Consumer) The offset of the next element to pop in head. */
+    int head_offset;
+    /*! \brief (Consumer) Drained nodes that producers may still be
+        using, linked through free_next. Used only with multiple producers. */
+    list_queue_node* retired;
+    /*! \brief (Consumer) Drained nodes waiting for the producers of
+        the epoch grace_epoch to finish, linked through free_next. */
+    list_queue_node* grace;
+    /*! \brief (Consumer) The epoch grace is waiting on. */
+    int grace_epoch;
+    /*! \brief Nonzero if the queue allows multiple producers. */
+    int multi_producer;
+    /*! \brief Keeps the producers' fields off the consumer's cache line. */
+    char padding[LIST_CACHE_LINE_SIZE];
+    /*! \brief The first node ever added to the queue, or NULL. */
+    list_queue_node* first;
+    /*! \brief The last node of the queue, or one just before it, or NULL. */
+    list_queue_node* tail;
+    /*! \brief A stack of recycled nodes, linked through free_next. */
+    list_queue_node* free_nodes;
+    /*! \brief A single node left over from a lost race to append a
+        node, or NULL. */
+    list_queue_node* spare;
+    /*! \brief The current epoch, advanced by the consumer. Used only
+        with multiple producers. */
+    int epoch;
+    /*! \brief The number of producers inside a push in each parity of epoch. */
+    int active_producers[2];
+} list_queue;
+
+/*! \brief Creates a new, empty queue.
+
+    No memory is allocated until the first element is pushed.
+
+    \param multi_producer Nonzero to allow several threads to push
+      concurrently, zero if only one thread will ever push.
+*/
+list_queue list_queue_create(int multi_producer);
+
+/*! \brief Destroys a queue, freeing all its nodes.
+
+    No other thread may be using the queue. Elements still in the
+    queue are discarded.
+
+    \param queue Pointer to the queue to destroy.
+*/
+void list_queue_destroy(list_queue* queue);
+
+/*! \brief Pushes a batch of values onto the back of a queue.
+
+    The values are copied into the queue a node at a time, with one
+    atomic update per node filled. May be called only from a producer
+    thread; with a single-producer queue, only from one thread.
+
+    \param queue Pointer to the queue.
+    \param values The values to push, in order.
+    \param count The number of values to push.
+
+    \return The number of values pushed, which is less than count
+    only if out of memory.
+*/
+int list_queue_push_batch(list_queue* queue, void** values, int count);
+
+/*! \brief Pops up to a batch of values from the front of a queue.
+
+    Only values whose pushes have completed are popped. May be called
+    only from the consumer thread.
+
+    \param queue Pointer to the queue.
+    \param values Receives the values popped, in order.
+    \param max_count The largest number of values to pop.
+
+    \return The number of values popped, zero if none are ready.
+*/
+int list_queue_pop_batch(list_queue* queue, void** values, int max_count);
+
+/*! \brief Pushes one value onto the back of a queue.
+
+    \param queue Pointer to the queue.
+    \param value The value to push.
+
+    \return Zero if out of memory, nonzero if successful.
+*/
+int list_queue_push(list_queue* queue, void* value);
+
+/*! \brief Pops one value from the front of a queue.
+
+    \param queue Pointer to the queue.
+    \param value_ptr Pointer to a void* that receives the value.
+
+    \return Zero if no value is ready, nonzero if one was popped.
+*/
+int list_queue_pop(list_queue* queue, void** value_ptr);
+
+#endif /* #ifndef _LIST_QUEUE_ */
+
+/** @} */ /* end of group list_queue */
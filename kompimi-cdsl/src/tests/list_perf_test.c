@@ -6,14 +6,184 @@
    releases all rights. This notice may be modified or removed.
 */
 
+/* Needed for fileno() in strict ANSI modes */
+#define _XOPEN_SOURCE 600
+
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <malloc.h>
 
 #include "../list.h"
+#include "../typed_list.h"
+#if LIST_HAVE_POSIX
+#include <pthread.h>
+#include <unistd.h>
+#include "../list_io.h"
+#include "../list_parallel.h"
+#include "../list_queue.h"
+#endif
 #include "dllist.h"
 #include "perf_test.h"
 
+DECLARE_LIST(int_list, int);
+DEFINE_LIST(int_list, int)
+
+int is_odd(void* value, void* context)
+{
+    return (int)value & 1;
+}
+
+#if LIST_HAVE_POSIX
+void sum_span(void** data, int count, void* accumulator, void* context)
+{
+    long sum = 0;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        sum += (int)data[i];
+    }
+    *(long *)accumulator += sum;
+}
+
+void add_sums(void* accumulator, void* partial, void* context)
+{
+    *(long *)accumulator += *(long *)partial;
+}
+#endif
+
+int compare_values(void* left, void* right, void* context)
+{
+    return ((int)left > (int)right) - ((int)left < (int)right);
+}
+
+long piece_length(void* value, void* context)
+{
+    return 1 + (int)value % 16;
+}
+
+int compare_array_values(const void* left, const void* right)
+{
+    return compare_values(*(void **)left, *(void **)right, NULL);
+}
+
+#if LIST_HAVE_POSIX
+/* Values are moved through the queues in batches of this size */
+#define QUEUE_BATCH_SIZE 32
+
+typedef struct
+{
+    list_queue* queue;
+    list* lst;
+    pthread_mutex_t* mutex;
+    int num_values;
+} queue_producer_args;
+
+void* push_to_queue(void* args_ptr)
+{
+    queue_producer_args* args = (queue_producer_args *)args_ptr;
+    void* values[QUEUE_BATCH_SIZE];
+    int i, j;
+    for (i = 0; i < args->num_values; i += QUEUE_BATCH_SIZE)
+    {
+        for (j = 0; j < QUEUE_BATCH_SIZE; j++)
+        {
+            values[j] = (void *)(i + j);
+        }
+        list_queue_push_batch(args->queue, values, QUEUE_BATCH_SIZE);
+    }
+    return NULL;
+}
+
+void* push_to_locked_list(void* args_ptr)
+{
+    queue_producer_args* args = (queue_producer_args *)args_ptr;
+    int i, j;
+    for (i = 0; i < args->num_values; i += QUEUE_BATCH_SIZE)
+    {
+        pthread_mutex_lock(args->mutex);
+        for (j = 0; j < QUEUE_BATCH_SIZE; j++)
+        {
+            list_insert_end(args->lst, (void *)(i + j));
+        }
+        pthread_mutex_unlock(args->mutex);
+    }
+    return NULL;
+}
+
+/* Moves num_values values from each of num_producers threads to the
+   calling thread, through a list_queue or a mutex-protected list */
+void run_queue_benchmark(int num_producers, int num_values, int use_queue)
+{
+    list_queue queue = list_queue_create(num_producers > 1);
+    list lst = list_create();
+    pthread_mutex_t mutex;
+    queue_producer_args args;
+    pthread_t threads[8];
+    void* values[QUEUE_BATCH_SIZE];
+    int total = num_producers * num_values;
+    int popped = 0;
+    int i;
+    pthread_mutex_init(&mutex, NULL);
+    args.queue = &queue;
+    args.lst = &lst;
+    args.mutex = &mutex;
+    args.num_values = num_values;
+    for (i = 0; i < num_producers; i++)
+    {
+        pthread_create(&threads[i], NULL,
+                       use_queue ? push_to_queue : push_to_locked_list, &args);
+    }
+    while (popped < total)
+    {
+        if (use_queue)
+        {
+            popped += list_queue_pop_batch(&queue, values, QUEUE_BATCH_SIZE);
+        }
+        else
+        {
+            pthread_mutex_lock(&mutex);
+            for (i = 0; i < QUEUE_BATCH_SIZE && lst.size > 0; i++)
+            {
+                values[i] = list_get_data(list_first(&lst));
+                list_remove_beginning(&lst);
+                popped++;
+            }
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+    for (i = 0; i < num_producers; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&mutex);
+    list_destroy(&lst);
+    list_queue_destroy(&queue);
+}
+#endif
+
+void report_footprint(char* name, list* lst)
+{
+    /* Nodes are allocated in whole cache lines */
+    size_t node_size = offsetof(list_node, data) + lst->node_capacity * sizeof(void *);
+    size_t num_nodes = 0;
+    list_node* node;
+    node_size = (node_size + LIST_CACHE_LINE_SIZE - 1) & ~(size_t)(LIST_CACHE_LINE_SIZE - 1);
+    for (node = lst->first_node; node != NULL; node = node->next)
+    {
+        num_nodes++;
+    }
+    printf("%s: %f bytes per element\n", name, (double)(num_nodes * node_size) / lst->size);
+}
+
+/* Prints a sum of benchmark results, so the compiler can't drop the
+   work that computes them when asserts are compiled out. */
+void report_checksum(char* name, long checksum)
+{
+    printf("%s: checksum %ld\n", name, checksum);
+}
+
 int main()
 {
     int iteration_list_size = 1000000;
@@ -26,6 +196,16 @@ int main()
         list_destroy(&lst);
     }
 
+    {
+        list_node_pool pool = list_node_pool_create(0);
+        list lst = list_create_pooled(&pool);
+        time_elapsed("insert_end_cdsl_list_pooled", 20000000,
+            list_insert_end(&lst, (void *)0);
+        );
+        list_destroy(&lst);
+        list_node_pool_destroy(&pool);
+    }
+
     {
         dllist dllst = dllist_create();
         time_elapsed("insert_end_dllist", 20000000,
@@ -63,6 +243,21 @@ int main()
         list_destroy(&lst);
     }
 
+    {
+        list_node_pool pool = list_node_pool_create(0);
+        list lst = list_create_pooled(&pool);
+	int i;
+	for (i=0; i < 20000000; i++)
+	{
+	    list_insert_end(&lst, (void *)0);
+	}
+        time_elapsed("remove_end_cdsl_list_pooled", 20000000,
+            list_remove_end(&lst);
+        );
+        list_destroy(&lst);
+        list_node_pool_destroy(&pool);
+    }
+
     {
         dllist dllst = dllist_create();
 	int i;
@@ -102,6 +297,40 @@ int main()
         dllist_destroy(&dllst);
     }
     
+    {
+        list lst = list_create();
+        time_elapsed("append_drain_cdsl_list", 200,
+            int i;
+            for (i=0; i < 100000; i++)
+            {
+                list_insert_end(&lst, (void *)0);
+            }
+            for (i=0; i < 100000; i++)
+            {
+                list_remove_end(&lst);
+            }
+        );
+        list_destroy(&lst);
+    }
+
+    {
+        list_node_pool pool = list_node_pool_create(0);
+        list lst = list_create_pooled(&pool);
+        time_elapsed("append_drain_cdsl_list_pooled", 200,
+            int i;
+            for (i=0; i < 100000; i++)
+            {
+                list_insert_end(&lst, (void *)0);
+            }
+            for (i=0; i < 100000; i++)
+            {
+                list_remove_end(&lst);
+            }
+        );
+        list_destroy(&lst);
+        list_node_pool_destroy(&pool);
+    }
+
     {
 	list_iter iter;
         list lst = list_create();
@@ -125,9 +354,105 @@ int main()
         );
         dllist_destroy(&dllst);
     }
-    
+
+    {
+	list_iter iter;
+        list lst = list_create();
+        list_insert_end(&lst, (void*)0);
+        list_insert_end(&lst, (void*)0);
+        iter = list_first(&lst);
+        time_elapsed("insert_typing_cdsl_list", 20000000,
+            list_insert_after(&iter, (void *)0);
+            list_next(&iter);
+        );
+        list_destroy(&lst);
+    }
+
+    {
+	dllist_node* iter;
+        dllist dllst = dllist_create();
+        dllist_insert_end(&dllst, (void*)0);
+        dllist_insert_end(&dllst, (void*)0);
+        iter = dllst.first_node;
+        time_elapsed("insert_typing_dllist", 20000000,
+            dllist_insert_after(&dllst, iter, (void *)0);
+            iter = iter->next;
+        );
+        dllist_destroy(&dllst);
+    }
+
+    {
+        /* Typing at several cursors in turn, keeping them as fingers
+           versus re-seeking each one by position */
+        int i, j;
+        int positions[16];
+        list_finger fingers[16];
+        list lst = list_create();
+        for (i = 0; i < 100000; i++)
+        {
+            list_insert_end(&lst, (void *)i);
+        }
+        for (i = 0; i < 16; i++)
+        {
+            positions[i] = i * (100000/16);
+            list_add_finger(&fingers[i], list_iter_at(&lst, positions[i]));
+        }
+        i = 0;
+        time_elapsed("insert_cursors_cdsl_list_fingers", 10000000,
+            list_iter iter = list_finger_iter(&fingers[i]);
+            list_insert_before(&iter, (void *)0);
+            i = (i + 1) % 16;
+        );
+        for (i = 0; i < 16; i++)
+        {
+            list_remove_finger(&fingers[i]);
+        }
+        i = 0;
+        time_elapsed("insert_cursors_cdsl_list_reseek", 10000,
+            list_iter iter = list_iter_at(&lst, positions[i]);
+            list_insert_before(&iter, (void *)0);
+            for (j = i; j < 16; j++)
+            {
+                positions[j]++;
+            }
+            i = (i + 1) % 16;
+        );
+        list_destroy(&lst);
+    }
+
+    {
+        /* A stack whose top crosses a node boundary on every push, and
+           a queue that frees and allocates a node every node_capacity
+           operations, without and with the spare node cache */
+        char* stack_names[] = {"boundary_oscillation_stack_cdsl_list_no_cache",
+                               "boundary_oscillation_stack_cdsl_list"};
+        char* queue_names[] = {"boundary_oscillation_queue_cdsl_list_no_cache",
+                               "boundary_oscillation_queue_cdsl_list"};
+        int j;
+        for (j = 0; j < 2; j++)
+        {
+            int i;
+            list lst = list_create();
+            list_set_max_spare_nodes(&lst, j == 0 ? 0 : LIST_DEFAULT_MAX_SPARE_NODES);
+            for (i = 0; i < 10*lst.node_capacity; i++)
+            {
+                list_insert_end(&lst, (void *)i);
+            }
+            time_elapsed(stack_names[j], 20000000,
+                list_insert_end(&lst, (void *)0);
+                list_remove_end(&lst);
+            );
+            time_elapsed(queue_names[j], 20000000,
+                list_insert_end(&lst, (void *)0);
+                list_remove_beginning(&lst);
+            );
+            list_destroy(&lst);
+        }
+    }
+
     {
         int i;
+        long checksum = 0;
         list lst = list_create();
         for (i = 0; i < iteration_list_size; i++)
         {
@@ -139,8 +464,127 @@ int main()
                 sum += (int)list_get_data(iter);
             LIST_ITERATE_END()
         );
+        time_elapsed("iterate_cdsl_list_spans", 250,
+            int sum = 0;
+            LIST_ITERATE_SPANS(&lst, data, count)
+                int j;
+                for (j = 0; j < count; j++)
+                {
+                    sum += (int)data[j];
+                }
+            LIST_ITERATE_SPANS_END()
+        );
+        time_elapsed("find_missing_cdsl_list_iterate", 250,
+            LIST_ITERATE(&lst, iter)
+                if (list_get_data(iter) == (void *)-1)
+                {
+                    break;
+                }
+            LIST_ITERATE_END()
+        );
+        time_elapsed("find_missing_cdsl_list_find", 250,
+            list_iter iter = list_find(&lst, (void *)-1);
+            assert(list_at_end(iter));
+            checksum += list_at_end(iter);
+        );
+        time_elapsed("count_cdsl_list_count", 250,
+            int count = list_count(&lst, (void *)7);
+            assert(count == 1);
+            checksum += count;
+        );
+        report_checksum("find_count_cdsl_list", checksum);
+        list_destroy(&lst);
+    }
+
+    {
+        /* Searches of a list small enough to stay in cache, where the
+           compares rather than the memory bound the time */
+        int i;
+        long checksum = 0;
+        list lst = list_create();
+        for (i = 0; i < 10000; i++)
+        {
+            list_insert_end(&lst, (void *)i);
+        }
+        time_elapsed("find_missing_cached_cdsl_list_iterate", 50000,
+            LIST_ITERATE(&lst, iter)
+                if (list_get_data(iter) == (void *)-1)
+                {
+                    break;
+                }
+            LIST_ITERATE_END()
+        );
+        time_elapsed("find_missing_cached_cdsl_list_find", 50000,
+            list_iter iter = list_find(&lst, (void *)-1);
+            assert(list_at_end(iter));
+            checksum += list_at_end(iter);
+        );
+        time_elapsed("count_cached_cdsl_list_count", 50000,
+            int count = list_count(&lst, (void *)7);
+            assert(count == 1);
+            checksum += count;
+        );
+        report_checksum("find_count_cached_cdsl_list", checksum);
+        list_destroy(&lst);
+    }
+
+#if LIST_HAVE_POSIX
+    {
+        /* Scaling of a parallel reduction from 1 to 8 threads */
+        char* names[] = {"parallel_reduce_cdsl_list_1_thread",
+                         "parallel_reduce_cdsl_list_2_threads",
+                         "parallel_reduce_cdsl_list_4_threads",
+                         "parallel_reduce_cdsl_list_8_threads"};
+        int j;
+        list lst = list_create();
+        for (j = 0; j < 10*iteration_list_size; j++)
+        {
+            list_insert_end(&lst, (void *)j);
+        }
+        for (j = 0; j < 4; j++)
+        {
+            wall_time_elapsed(names[j], 25,
+                long sum = 0;
+                list_parallel_reduce(&lst, sum_span, add_sums, &sum, sizeof(sum),
+                                     NULL, 1 << j);
+            );
+        }
         list_destroy(&lst);
     }
+#endif
+
+    {
+        /* Node capacities filling 1, 2, and 4 cache lines */
+        char* iterate_names[] = {"iterate_cdsl_list_1_line",
+                                 "iterate_cdsl_list_2_lines",
+                                 "iterate_cdsl_list_4_lines"};
+        char* insert_names[] = {"insert_middle_cdsl_list_1_line",
+                                "insert_middle_cdsl_list_2_lines",
+                                "insert_middle_cdsl_list_4_lines"};
+        int j;
+        for (j = 0; j < 3; j++)
+        {
+            int i;
+            list_iter iter;
+            list lst = list_create_with_capacity(list_node_capacity_for_cache_lines(1 << j));
+            for (i = 0; i < iteration_list_size; i++)
+            {
+                list_insert_end(&lst, (void *)i);
+            }
+            time_elapsed(iterate_names[j], 250,
+                int sum = 0;
+                LIST_ITERATE(&lst, iter2)
+                    sum += (int)list_get_data(iter2);
+                LIST_ITERATE_END()
+            );
+            iter = list_iter_at(&lst, iteration_list_size/2);
+            time_elapsed(insert_names[j], 10000000,
+                list_insert_after(&iter, (void *)0);
+                list_insert_before(&iter, (void *)0);
+            );
+            list_destroy(&lst);
+        }
+    }
 
     {
         int i;
@@ -160,5 +604,576 @@ int main()
         dllist_destroy(&dllst);
     }
 
+    {
+        int i;
+        void** values = (void **)malloc(iteration_list_size * sizeof(void *));
+        for (i = 0; i < iteration_list_size; i++)
+        {
+            values[i] = (void *)i;
+        }
+        time_elapsed("bulk_load_cdsl_list", 50,
+            int j;
+            list lst = list_create();
+            for (j = 0; j < iteration_list_size; j++)
+            {
+                list_insert_end(&lst, values[j]);
+            }
+            list_destroy(&lst);
+        );
+        time_elapsed("bulk_load_cdsl_list_range", 50,
+            list lst = list_create();
+            list_append_range(&lst, values, iteration_list_size);
+            list_destroy(&lst);
+        );
+        free(values);
+    }
+
+    {
+        /* Sorting in place against copying out to an array, sorting it
+           with qsort and copying back in. Each iteration reloads the
+           same shuffled values. */
+        int i;
+        void** values = (void **)malloc(iteration_list_size * sizeof(void *));
+        srand(0);
+        for (i = 0; i < iteration_list_size; i++)
+        {
+            values[i] = (void *)rand();
+        }
+        time_elapsed("sort_cdsl_list", 10,
+            list lst = list_create();
+            list_append_range(&lst, values, iteration_list_size);
+            list_sort(&lst, compare_values, NULL);
+            list_destroy(&lst);
+        );
+        time_elapsed("sort_cdsl_list_copy_qsort", 10,
+            int j = 0;
+            void** sorted = (void **)malloc(iteration_list_size * sizeof(void *));
+            list lst = list_create();
+            list_append_range(&lst, values, iteration_list_size);
+            LIST_ITERATE(&lst, iter)
+                sorted[j++] = list_get_data(iter);
+            LIST_ITERATE_END()
+            qsort(sorted, iteration_list_size, sizeof(void *), compare_array_values);
+            list_destroy(&lst);
+            lst = list_create();
+            list_append_range(&lst, sorted, iteration_list_size);
+            free(sorted);
+            list_destroy(&lst);
+        );
+#if LIST_HAVE_POSIX
+        wall_time_elapsed("parallel_sort_cdsl_list", 10,
+            list lst = list_create();
+            list_append_range(&lst, values, iteration_list_size);
+            list_parallel_sort(&lst, compare_values, NULL, 0);
+            list_destroy(&lst);
+        );
+#endif
+        free(values);
+    }
+
+#if LIST_HAVE_POSIX
+    {
+        /* Passing values between threads, one producer and then four */
+        wall_time_elapsed("queue_spsc_cdsl_list_queue", 10,
+            run_queue_benchmark(1, 10*iteration_list_size, 1);
+        );
+        wall_time_elapsed("queue_spsc_mutex_cdsl_list", 10,
+            run_queue_benchmark(1, 10*iteration_list_size, 0);
+        );
+        wall_time_elapsed("queue_mpsc_4_producers_cdsl_list_queue", 10,
+            run_queue_benchmark(4, 10*iteration_list_size/4, 1);
+        );
+        wall_time_elapsed("queue_mpsc_4_producers_mutex_cdsl_list", 10,
+            run_queue_benchmark(4, 10*iteration_list_size/4, 0);
+        );
+    }
+#endif
+
+    {
+        int i;
+        list lst1 = list_create();
+        list lst2 = list_create();
+        for (i = 0; i < iteration_list_size; i++)
+        {
+            list_insert_end(&lst1, (void *)i);
+        }
+        time_elapsed("move_half_cdsl_list_elementwise", 50,
+            int j;
+            for (j = 0; j < iteration_list_size/2; j++)
+            {
+                list_insert_beginning(&lst2, list_get_data(list_last(&lst1)));
+                list_remove_end(&lst1);
+            }
+            for (j = 0; j < iteration_list_size/2; j++)
+            {
+                list_insert_end(&lst1, list_get_data(list_first(&lst2)));
+                list_remove_beginning(&lst2);
+            }
+        );
+        time_elapsed("move_half_cdsl_list_chop_splice", 50,
+            list_iter iter = list_iter_at(&lst1, iteration_list_size/2 + 1);
+            list_chop(&iter, &lst2);
+            iter = list_iter_at(&lst1, lst1.size);
+            list_splice(&iter, &lst2);
+        );
+        list_destroy(&lst1);
+        list_destroy(&lst2);
+    }
+
+    {
+        int i;
+        list lst = list_create();
+        for (i = 0; i < iteration_list_size; i++)
+        {
+            list_insert_end(&lst, (void *)i);
+        }
+        time_elapsed("remove_middle_half_cdsl_list_elementwise", 1,
+            list_iter iter = list_iter_at(&lst, iteration_list_size/4);
+            int j;
+            for (j = 0; j < iteration_list_size/2; j++)
+            {
+                list_remove(&iter);
+            }
+        );
+        list_destroy(&lst);
+        lst = list_create();
+        for (i = 0; i < iteration_list_size; i++)
+        {
+            list_insert_end(&lst, (void *)i);
+        }
+        time_elapsed("remove_middle_half_cdsl_list_range", 1,
+            list_iter first = list_iter_at(&lst, iteration_list_size/4);
+            list_iter last = list_iter_at(&lst, 3*iteration_list_size/4);
+            list_remove_range(&first, &last);
+        );
+        list_destroy(&lst);
+    }
+
+    {
+        int i;
+        list lst = list_create();
+        for (i = 0; i < iteration_list_size; i++)
+        {
+            list_insert_end(&lst, (void *)i);
+        }
+        time_elapsed("remove_odd_cdsl_list_elementwise", 1,
+            list_iter iter = list_first(&lst);
+            while (!list_at_end(iter))
+            {
+                if (is_odd(list_get_data(iter), NULL))
+                {
+                    list_remove(&iter);
+                }
+                else
+                {
+                    list_next(&iter);
+                }
+            }
+        );
+        list_destroy(&lst);
+        lst = list_create();
+        for (i = 0; i < iteration_list_size; i++)
+        {
+            list_insert_end(&lst, (void *)i);
+        }
+        time_elapsed("remove_odd_cdsl_list_remove_if", 1,
+            list_remove_if(&lst, is_odd, NULL);
+        );
+        list_destroy(&lst);
+    }
+
+    {
+        /* Ten thousand edits, alternately inserting and removing,
+           spread over the whole list or clustered in one stretch.
+           Each way starts from a fresh list of full nodes. */
+        int strides[] = {100, 2};
+        char* names[][2] = {{"edit_scattered_cdsl_list_elementwise", "edit_scattered_cdsl_list_batch"},
+                            {"edit_clustered_cdsl_list_elementwise", "edit_clustered_cdsl_list_batch"}};
+        int i, j, k, m;
+        for (j = 0; j < 2; j++)
+        {
+            for (m = 0; m < 2; m++)
+            {
+                list lst = list_create();
+                list_batch batch = list_batch_create(&lst);
+                for (i = 0; i < iteration_list_size; i++)
+                {
+                    list_insert_end(&lst, (void *)i);
+                }
+                list_build_index(&lst);
+                if (m == 0)
+                {
+                    time_elapsed(names[j][0], 20,
+                        /* From the back, so that earlier positions stay put */
+                        for (k = 9999; k >= 0; k--)
+                        {
+                            list_iter iter = list_iter_at(&lst, k*strides[j] + rand() % strides[j]);
+                            if (k & 1)
+                            {
+                                list_insert_before(&iter, (void *)k);
+                            }
+                            else
+                            {
+                                list_remove(&iter);
+                            }
+                        }
+                    );
+                }
+                else
+                {
+                    time_elapsed(names[j][1], 20,
+                        for (k = 0; k < 10000; k++)
+                        {
+                            list_iter iter = list_iter_at(&lst, k*strides[j] + rand() % strides[j]);
+                            if (k & 1)
+                            {
+                                list_batch_insert(&batch, iter, (void *)k);
+                            }
+                            else
+                            {
+                                list_batch_remove(&batch, iter);
+                            }
+                        }
+                        list_batch_apply(&batch);
+                    );
+                }
+                list_batch_destroy(&batch);
+                list_destroy(&lst);
+            }
+        }
+    }
+
+    {
+        /* The same burst of removals, rebalancing lazily and compacting
+           once at the end, or whenever a quarter of the list is removed */
+        char* names[] = {"remove_odd_cdsl_list_elementwise_lazy",
+                         "remove_odd_cdsl_list_elementwise_lazy_threshold"};
+        int j;
+        for (j = 0; j < 2; j++)
+        {
+            int i;
+            list lst = list_create();
+            for (i = 0; i < iteration_list_size; i++)
+            {
+                list_insert_end(&lst, (void *)i);
+            }
+            list_set_lazy_rebalancing(&lst, j == 0 ? INT_MAX : iteration_list_size/4);
+            time_elapsed(names[j], 1,
+                list_iter iter = list_first(&lst);
+                while (!list_at_end(iter))
+                {
+                    if (is_odd(list_get_data(iter), NULL))
+                    {
+                        list_remove(&iter);
+                    }
+                    else
+                    {
+                        list_next(&iter);
+                    }
+                }
+                list_compact(&lst);
+            );
+            list_destroy(&lst);
+        }
+    }
+
+    {
+        /* Iterating a list whose nodes are interleaved in memory with
+           another list's, before and after moving it into one slab */
+        int i;
+        list_node_pool pool = list_node_pool_create(0);
+        list lst = list_create_pooled(&pool);
+        list other = list_create_pooled(&pool);
+        for (i = 0; i < iteration_list_size; i++)
+        {
+            list_insert_end(&lst, (void *)i);
+            list_insert_end(&other, (void *)i);
+        }
+        list_destroy(&other);
+        time_elapsed("iterate_cdsl_list_interleaved", 250,
+            int sum = 0;
+            LIST_ITERATE(&lst, iter)
+                sum += (int)list_get_data(iter);
+            LIST_ITERATE_END()
+        );
+        list_compact_contiguous(&lst);
+        time_elapsed("iterate_cdsl_list_compacted_contiguous", 250,
+            int sum = 0;
+            LIST_ITERATE(&lst, iter)
+                sum += (int)list_get_data(iter);
+            LIST_ITERATE_END()
+        );
+        list_destroy(&lst);
+        list_node_pool_destroy(&pool);
+    }
+
+    {
+        int i;
+        int position;
+        long checksum = 0;
+        list lst = list_create();
+        for (i = 0; i < iteration_list_size; i++)
+        {
+            list_insert_end(&lst, (void *)i);
+        }
+        position = 0;
+        time_elapsed("seek_cdsl_list", 1000,
+            list_iter iter;
+            position = (position + 7919) % iteration_list_size;
+            iter = list_iter_at(&lst, position);
+            assert(list_iter_index(iter) == position);
+            checksum += (int)list_get_data(iter);
+        );
+        list_build_index(&lst);
+        time_elapsed("seek_cdsl_list_indexed", 1000000,
+            list_iter iter;
+            position = (position + 7919) % iteration_list_size;
+            iter = list_iter_at(&lst, position);
+            assert(list_iter_index(iter) == position);
+            checksum += (int)list_get_data(iter);
+        );
+        report_checksum("seek_cdsl_list", checksum);
+        list_destroy(&lst);
+    }
+
+    {
+        /* Seeking by byte offset, as in a list of text pieces of
+           varying lengths */
+        int i;
+        long offset;
+        long total_weight = 0;
+        long checksum = 0;
+        list lst = list_create();
+        for (i = 0; i < iteration_list_size; i++)
+        {
+            list_insert_end(&lst, (void *)i);
+            total_weight += piece_length((void *)i, NULL);
+        }
+        offset = 0;
+        time_elapsed("seek_weight_cdsl_list_linear", 1000,
+            long prefix = 0;
+            list_iter iter = list_first(&lst);
+            offset = (offset + 7919) % total_weight;
+            while (prefix + piece_length(list_get_data(iter), NULL) <= offset)
+            {
+                prefix += piece_length(list_get_data(iter), NULL);
+                list_next(&iter);
+            }
+        );
+        list_build_weighted_index(&lst, piece_length, NULL);
+        time_elapsed("seek_weight_cdsl_list_indexed", 1000000,
+            list_iter iter;
+            offset = (offset + 7919) % total_weight;
+            iter = list_seek_weight(&lst, offset);
+            assert(list_prefix_weight(iter) <= offset);
+            checksum += (int)list_get_data(iter);
+        );
+        report_checksum("seek_weight_cdsl_list", checksum);
+        time_elapsed("insert_middle_cdsl_list_weighted", 1000000,
+            list_iter iter = list_seek_weight(&lst, offset);
+            offset = (offset + 7919) % total_weight;
+            list_insert_before(&iter, (void *)offset);
+            total_weight += piece_length((void *)offset, NULL);
+        );
+        list_drop_index(&lst);
+        list_build_index(&lst);
+        time_elapsed("insert_middle_cdsl_list_indexed", 1000000,
+            list_iter iter = list_iter_at(&lst, (int)(offset % lst.size));
+            offset = (offset + 7919) % total_weight;
+            list_insert_before(&iter, (void *)offset);
+        );
+        list_destroy(&lst);
+    }
+
+    {
+        /* The same workloads on a list storing ints inline */
+        int i;
+        int_list_iter iter;
+        int_list lst = int_list_create();
+        time_elapsed("insert_end_typed_int_list", 20000000,
+            int_list_insert_end(&lst, 0);
+        );
+        int_list_destroy(&lst);
+        for (i = 0; i < iteration_list_size; i++)
+        {
+            int_list_insert_end(&lst, i);
+        }
+        time_elapsed("iterate_typed_int_list", 250,
+            int sum = 0;
+            TYPED_LIST_ITERATE(int_list, &lst, iter)
+                sum += list_get_data(iter);
+            TYPED_LIST_ITERATE_END()
+        );
+        int_list_destroy(&lst);
+        int_list_insert_end(&lst, 0);
+        iter = int_list_first(&lst);
+        time_elapsed("insert_middle_typed_int_list", 10000000,
+            int_list_insert_after(&iter, 0);
+            int_list_insert_before(&iter, 0);
+        );
+        int_list_destroy(&lst);
+    }
+
+    {
+        /* Taking a snapshot, against copying the elements out, and
+           editing nodes while they are still shared with a snapshot */
+        int i;
+        list lst = list_create();
+        list_snapshot snapshot;
+        list_iter iter;
+        for (i = 0; i < iteration_list_size; i++)
+        {
+            list_insert_end(&lst, (void *)i);
+        }
+        time_elapsed("snapshot_cdsl_list", 1000,
+            list_take_snapshot(&lst, &snapshot);
+            list_snapshot_destroy(&snapshot);
+        );
+        time_elapsed("copy_cdsl_list", 100,
+            list copy = list_create();
+            LIST_ITERATE(&lst, iter)
+                list_insert_end(&copy, list_get_data(iter));
+            LIST_ITERATE_END()
+            list_destroy(&copy);
+        );
+        time_elapsed("overwrite_cdsl_list", 100,
+            iter = list_first(&lst);
+            while (!list_at_end(iter))
+            {
+                list_remove(&iter);
+                list_insert_before(&iter, (void *)0);
+            }
+        );
+        time_elapsed("overwrite_cdsl_list_after_snapshot", 100,
+            list_take_snapshot(&lst, &snapshot);
+            iter = list_first(&lst);
+            while (!list_at_end(iter))
+            {
+                list_remove(&iter);
+                list_insert_before(&iter, (void *)0);
+            }
+            list_snapshot_destroy(&snapshot);
+        );
+        list_destroy(&lst);
+    }
+
+#if LIST_HAVE_POSIX
+    {
+        /* Getting a saved list back: rebuilding it, reading it from
+           the streaming format, and mapping an image of it */
+        int i;
+        list lst = list_create();
+        FILE* stream_file = tmpfile();
+        FILE* image_file = tmpfile();
+        for (i = 0; i < 10*iteration_list_size; i++)
+        {
+            list_insert_end(&lst, (void *)i);
+        }
+        list_write(&lst, fileno(stream_file), sizeof(void *), NULL, NULL);
+        list_write_image(&lst, fileno(image_file), NULL, NULL, NULL);
+        list_destroy(&lst);
+        time_elapsed("load_cdsl_list_rebuild", 10,
+            list rebuilt = list_create();
+            for (i = 0; i < 10*iteration_list_size; i++)
+            {
+                list_insert_end(&rebuilt, (void *)i);
+            }
+            list_destroy(&rebuilt);
+        );
+        time_elapsed("load_cdsl_list_read", 10,
+            list read_lst = list_create();
+            lseek(fileno(stream_file), 0, SEEK_SET);
+            list_read(&read_lst, fileno(stream_file), sizeof(void *), NULL, NULL);
+            list_destroy(&read_lst);
+        );
+        time_elapsed("load_cdsl_list_map_image", 10000,
+            list_image image;
+            list_map_image(&image, fileno(image_file));
+            list_unmap_image(&image);
+        );
+        time_elapsed("load_and_iterate_cdsl_list_map_image", 10,
+            list_image image;
+            int sum = 0;
+            list_map_image(&image, fileno(image_file));
+            LIST_ITERATE(&image.lst, iter)
+                sum += (int)list_get_data(iter);
+            LIST_ITERATE_END()
+            list_unmap_image(&image);
+        );
+        fclose(stream_file);
+        fclose(image_file);
+    }
+
+    {
+        /* Writing a list's elements out through a flat buffer, and
+           straight from its nodes, then reading them back both ways */
+        int i;
+        list lst = list_create();
+        list read_lst = list_create();
+        FILE* file = tmpfile();
+        void** buffer = (void **)malloc(10*iteration_list_size * sizeof(void *));
+        for (i = 0; i < 10*iteration_list_size; i++)
+        {
+            list_insert_end(&lst, (void *)i);
+        }
+        time_elapsed("write_cdsl_list_flat_buffer", 10,
+            int count = 0;
+            LIST_ITERATE(&lst, iter)
+                buffer[count++] = list_get_data(iter);
+            LIST_ITERATE_END()
+            lseek(fileno(file), 0, SEEK_SET);
+            write(fileno(file), buffer, count * sizeof(void *));
+        );
+        time_elapsed("write_cdsl_list_writev", 10,
+            lseek(fileno(file), 0, SEEK_SET);
+            list_writev(&lst, fileno(file));
+        );
+        time_elapsed("read_cdsl_list_flat_buffer", 10,
+            lseek(fileno(file), 0, SEEK_SET);
+            read(fileno(file), buffer, lst.size * sizeof(void *));
+            list_append_range(&read_lst, buffer, lst.size);
+            list_destroy(&read_lst);
+        );
+        time_elapsed("read_cdsl_list_readv", 10,
+            lseek(fileno(file), 0, SEEK_SET);
+            list_readv_append(&read_lst, fileno(file), lst.size);
+            list_destroy(&read_lst);
+        );
+        free(buffer);
+        fclose(file);
+        list_destroy(&lst);
+    }
+#endif
+
+    {
+        /* Memory used per element, by nodes of one, two and four cache
+           lines, when appended in order and after every other element is removed */
+        int num_lines;
+        for (num_lines = 1; num_lines <= 4; num_lines *= 2)
+        {
+            char name[64];
+            int i;
+            list lst = list_create_with_capacity(list_node_capacity_for_cache_lines(num_lines));
+            list_iter iter;
+            for (i = 0; i < iteration_list_size; i++)
+            {
+                list_insert_end(&lst, (void *)i);
+            }
+            sprintf(name, "footprint_cdsl_list_%d_lines_appended", num_lines);
+            report_footprint(name, &lst);
+            for (iter = list_first(&lst); !list_at_end(iter); list_next(&iter))
+            {
+                list_remove(&iter);
+                if (list_at_end(iter))
+                {
+                    break;
+                }
+            }
+            sprintf(name, "footprint_cdsl_list_%d_lines_thinned", num_lines);
+            report_footprint(name, &lst);
+            list_destroy(&lst);
+        }
+    }
+
     return 0;
 }
@@ -6,10 +6,23 @@
    releases all rights. This notice may be modified or removed.
 */
 
+/* Needed for fileno() and ftruncate() in strict ANSI modes */
+#define _XOPEN_SOURCE 600
+
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "../list.h"
+#include "../typed_list.h"
+#if LIST_HAVE_POSIX
+#include <pthread.h>
+#include <unistd.h>
+#include "../list_io.h"
+#include "../list_parallel.h"
+#include "../list_queue.h"
+#endif
 
 void test_create_destroy()
 {
@@ -250,9 +263,9 @@ void test_random_walk(int list_size, int num_steps)
     list_destroy(&lst);
 }
 
-void test_random_operations(int list_size, int num_operations)
+void test_random_operations(int list_size, int num_operations, int node_capacity)
 {
-    list lst = list_create();
+    list lst = list_create_with_capacity(node_capacity);
     list_iter iter;
     int repeat;
     int i;
@@ -296,6 +309,12 @@ void test_random_operations(int list_size, int num_operations)
 	    assert(0);
 	}
     }
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+    if (lst.first_node != NULL)
+    {
+        assert((size_t)lst.first_node % LIST_CACHE_LINE_SIZE == 0);
+    }
+#endif
     list_destroy(&lst);
 }
 
@@ -330,6 +349,2614 @@ void test_swap(int size1, int size2)
     assert (i == size1 + size2);
 }
 
+void test_pooled(int list_size, int num_operations)
+{
+    list_node_pool pool = list_node_pool_create(16);
+    list lst1 = list_create_pooled(&pool);
+    list lst2 = list_create_pooled(&pool);
+    list_iter iter;
+    int num_slabs;
+    int repeat;
+    int i;
+    for (i=0; i < list_size; i++)
+    {
+        list_insert_end(&lst1, (void *)i);
+        list_insert_beginning(&lst2, (void *)i);
+    }
+    iter = list_first(&lst1);
+    for (repeat=0; repeat < num_operations; repeat++)
+    {
+        switch (rand() % 4)
+	{
+	case 0:
+	    if (!list_at_end(iter))
+	    {
+		list_next(&iter);
+	    }
+	    break;
+	case 1:
+	    if (!list_at_end(iter))
+	    {
+	        list_insert_after(&iter, (void*)(rand()));
+	    }
+	    break;
+	case 2:
+	    list_insert_before(&iter, (void*)(rand()));
+	    break;
+	case 3:
+	    if (!list_at_end(iter))
+	    {
+	        list_remove(&iter);
+	    }
+	    break;
+	}
+    }
+    i = list_size - 1;
+    LIST_ITERATE(&lst2, iter)
+        assert((int)list_get_data(iter) == i);
+        i--;
+    LIST_ITERATE_END()
+
+    /* Destroyed nodes are recycled rather than freed */
+    num_slabs = pool.num_slabs;
+    assert(num_slabs > 0);
+    list_destroy(&lst1);
+    list_destroy(&lst2);
+    lst1 = list_create_pooled(&pool);
+    for (i=0; i < list_size; i++)
+    {
+        list_insert_end(&lst1, (void *)i);
+    }
+    assert(pool.num_slabs == num_slabs);
+    i = 0;
+    LIST_ITERATE(&lst1, iter)
+        assert((int)list_get_data(iter) == i);
+        i++;
+    LIST_ITERATE_END()
+    list_destroy(&lst1);
+    list_node_pool_destroy(&pool);
+    assert(pool.num_slabs == 0);
+}
+void test_iter_at(int list_size)
+{
+    list lst = list_create();
+    int i;
+    for (i=0; i < list_size; i++)
+    {
+        list_insert_end(&lst, (void *)i);
+    }
+    for (i=0; i <= list_size; i++)
+    {
+        list_iter iter = list_iter_at(&lst, i);
+        if (i == list_size)
+        {
+            assert(list_at_end(iter));
+        }
+        else
+        {
+            assert((int)list_get_data(iter) == i);
+        }
+        assert(list_iter_index(iter) == i);
+    }
+    list_destroy(&lst);
+}
+
+void build_index(list* lst)
+{
+    int success;
+    /* Compact nodes cannot be indexed, and the tests run unindexed */
+#if LIST_COMPACT_NODES
+    success = !list_build_index(lst);
+    assert(success);
+#else
+    success = list_build_index(lst);
+    assert(success);
+#endif
+}
+
+void test_indexed_random_operations(int list_size, int num_operations)
+{
+    list lst = list_create();
+    list_iter iter;
+    int position;
+    int repeat;
+    int i;
+    for (i=0; i < list_size; i++)
+    {
+        list_insert_end(&lst, (void *)i);
+    }
+    build_index(&lst);
+    iter = list_first(&lst);
+    position = 0;
+    for (repeat=0; repeat < num_operations; repeat++)
+    {
+	int success;
+        switch (rand() % 6)
+	{
+	case 0:
+	    /* Seek to a random position */
+	    position = rand() % (lst.size + 1);
+	    iter = list_iter_at(&lst, position);
+	    break;
+	case 1:
+	    if (!list_at_end(iter))
+	    {
+		success = list_insert_after(&iter, (void*)(rand()));
+		assert(success);
+	    }
+	    break;
+	case 2:
+	    success = list_insert_before(&iter, (void*)(rand()));
+	    assert(success);
+	    position++;
+	    break;
+	case 3:
+	    if (!list_at_end(iter))
+	    {
+		list_remove(&iter);
+	    }
+	    break;
+	case 4:
+	    success = list_insert_beginning(&lst, (void*)(rand()));
+	    assert(success);
+	    iter = list_iter_at(&lst, ++position);
+	    break;
+	case 5:
+	    if (lst.size > 1 && position < lst.size - 1)
+	    {
+		list_remove_end(&lst);
+		iter = list_iter_at(&lst, position);
+	    }
+	    break;
+	default:
+	    assert(0);
+	}
+	assert(list_iter_index(iter) == position);
+    }
+
+    /* Compare against a linear walk */
+    i = 0;
+    LIST_ITERATE(&lst, iter)
+        list_iter other = list_iter_at(&lst, i);
+        assert(other.node == iter.node && other.offset == iter.offset);
+        assert(list_iter_index(iter) == i);
+        i++;
+    LIST_ITERATE_END()
+    list_drop_index(&lst);
+    assert(!lst.indexed);
+    list_destroy(&lst);
+}
+void test_append_range(int list_size, int chunk_size)
+{
+    list lst = list_create();
+    void** values = (void **)malloc(chunk_size * sizeof(void *));
+    int i, j, success;
+    success = list_append_range(&lst, values, 0);
+    assert(success);
+    assert(lst.size == 0);
+    for (i=0; i < list_size; i += chunk_size)
+    {
+        for (j=0; j < chunk_size; j++)
+        {
+            values[j] = (void *)(i + j);
+        }
+        success = list_append_range(&lst, values, chunk_size);
+        assert(success);
+    }
+    i = 0;
+    LIST_ITERATE(&lst, iter)
+        assert((int)list_get_data(iter) == i);
+        i++;
+    LIST_ITERATE_END()
+    assert(i == lst.size);
+    free(values);
+    list_destroy(&lst);
+}
+
+void test_insert_range_after(int max_values, int num_operations)
+{
+    /* Mirrors every insertion in a plain array for comparison */
+    list lst = list_create();
+    int* expected = (int *)malloc((1 + max_values*num_operations) * sizeof(int));
+    void** values = (void **)malloc(max_values * sizeof(void *));
+    int next_value = 0;
+    int repeat;
+    int i;
+    values[0] = (void *)next_value;
+    expected[0] = next_value++;
+    list_append_range(&lst, values, 1);
+    build_index(&lst);
+    for (repeat=0; repeat < num_operations; repeat++)
+    {
+        int position = rand() % lst.size;
+        list_iter iter = list_iter_at(&lst, position);
+        int num_values = rand() % max_values;
+        int success;
+        memmove(expected + position + 1 + num_values,
+                expected + position + 1,
+                (lst.size - (position + 1)) * sizeof(int));
+        for (i=0; i < num_values; i++)
+        {
+            values[i] = (void *)next_value;
+            expected[position + 1 + i] = next_value++;
+        }
+        success = list_insert_range_after(&iter, values, num_values);
+        assert(success);
+        assert((int)list_get_data(iter) == expected[position]);
+        assert(list_iter_index(iter) == position);
+    }
+    i = 0;
+    LIST_ITERATE(&lst, iter)
+        assert((int)list_get_data(iter) == expected[i]);
+        i++;
+    LIST_ITERATE_END()
+    assert(i == next_value);
+    free(values);
+    free(expected);
+    list_destroy(&lst);
+}
+
+void check_list_contents(list* lst, int* expected, int size)
+{
+    int i = 0;
+    assert(lst->size == size);
+    LIST_ITERATE(lst, iter)
+        assert((int)list_get_data(iter) == expected[i]);
+        i++;
+    LIST_ITERATE_END()
+    assert(i == size);
+}
+
+void test_splice(int list_size, int num_operations, int indexed)
+{
+    /* Moves ranges back and forth between two lists, mirroring them
+       in plain arrays */
+    list lsts[2];
+    int* expected[2];
+    int repeat;
+    int i;
+    for (i=0; i < 2; i++)
+    {
+        lsts[i] = list_create();
+        expected[i] = (int *)malloc(2 * list_size * sizeof(int));
+    }
+    for (i=0; i < list_size; i++)
+    {
+        list_insert_end(&lsts[0], (void *)i);
+        expected[0][i] = i;
+    }
+    if (indexed)
+    {
+        build_index(&lsts[0]);
+    }
+    for (repeat=0; repeat < num_operations; repeat++)
+    {
+        int from = rand() % 2;
+        list* src = &lsts[from];
+        list* dst = &lsts[1 - from];
+        int* src_expected = expected[from];
+        int* dst_expected = expected[1 - from];
+        int src_size = src->size;
+        int dst_size = dst->size;
+        int start = rand() % (src->size + 1);
+        int end = start + rand() % (src->size - start + 1);
+        int dst_position = rand() % (dst->size + 1);
+        list_iter first = list_iter_at(src, start);
+        list_iter last = list_iter_at(src, end);
+        list_iter dst_iter = list_iter_at(dst, dst_position);
+        int success;
+        switch (rand() % 3)
+        {
+        case 0:
+            success = list_splice_range(&dst_iter, &first, &last);
+            break;
+        case 1:
+            end = src->size;
+            success = list_chop(&first, dst);
+            last = first;
+            dst_position = dst->size - (end - start);
+            dst_iter = list_iter_at(dst, dst->size);
+            break;
+        default:
+            start = 0;
+            end = src->size;
+            success = list_splice(&dst_iter, src);
+            last = list_first(src);
+            break;
+        }
+        assert(success);
+        memmove(dst_expected + dst_position + (end - start),
+                dst_expected + dst_position,
+                (dst_size - dst_position) * sizeof(int));
+        memcpy(dst_expected + dst_position,
+               src_expected + start,
+               (end - start) * sizeof(int));
+        memmove(src_expected + start,
+                src_expected + end,
+                (src_size - end) * sizeof(int));
+        check_list_contents(src, src_expected, src_size - (end - start));
+        check_list_contents(dst, dst_expected, dst_size + (end - start));
+        assert(list_iter_index(last) == start);
+        assert(list_iter_index(dst_iter) == dst_position + (end - start));
+        if (indexed && !dst->indexed)
+        {
+            build_index(dst);
+        }
+    }
+    for (i=0; i < 2; i++)
+    {
+        list_destroy(&lsts[i]);
+        free(expected[i]);
+    }
+}
+void test_remove_range(int list_size, int indexed)
+{
+    list lst = list_create();
+    int* expected = (int *)malloc(list_size * sizeof(int));
+    int i;
+    for (i=0; i < list_size; i++)
+    {
+        list_insert_end(&lst, (void *)i);
+        expected[i] = i;
+    }
+    if (indexed)
+    {
+        build_index(&lst);
+    }
+    while (lst.size > 0)
+    {
+        int size = lst.size;
+        int start = rand() % (size + 1);
+        int end = start + rand() % ((size - start)/4 + 2);
+        list_iter first, last;
+        if (end > size)
+        {
+            end = size;
+        }
+        first = list_iter_at(&lst, start);
+        last = list_iter_at(&lst, end);
+        list_remove_range(&first, &last);
+        assert(first.node == last.node && first.offset == last.offset);
+        assert(list_iter_index(last) == start);
+        memmove(expected + start, expected + end, (size - end) * sizeof(int));
+        check_list_contents(&lst, expected, size - (end - start));
+    }
+    free(expected);
+    list_destroy(&lst);
+}
+int is_multiple(void* value, void* context)
+{
+    return ((int)value % (int)context) == 0;
+}
+
+void test_remove_if(int list_size, int modulus, int indexed)
+{
+    list lst = list_create();
+    int i, success;
+    for (i=0; i < list_size; i++)
+    {
+        list_insert_end(&lst, (void *)i);
+    }
+    if (indexed)
+    {
+        build_index(&lst);
+    }
+    success = list_remove_if(&lst, is_multiple, (void *)modulus) ==
+              (list_size + modulus - 1)/modulus;
+    assert(success);
+    i = 0;
+    LIST_ITERATE(&lst, iter)
+        if (i % modulus == 0)
+        {
+            i++;
+        }
+        assert((int)list_get_data(iter) == i);
+        assert(list_iter_index(iter) == i - i/modulus - 1);
+        i++;
+    LIST_ITERATE_END()
+    assert(lst.size == list_size - (list_size + modulus - 1)/modulus);
+    success = list_remove_if(&lst, is_multiple, (void *)1) == list_size - (list_size + modulus - 1)/modulus;
+    assert(success);
+    assert(lst.size == 0 && lst.first_node == NULL);
+    list_destroy(&lst);
+}
+
+void test_deque_operations(int max_size, int num_operations)
+{
+    list lst = list_create();
+    int* model = malloc(2*(max_size + num_operations)*sizeof(int));
+    int head = max_size + num_operations, tail = head;
+    int next_value = 0;
+    int i, success;
+    srand(0);
+    for (i=0; i < num_operations; i++)
+    {
+        int op = rand() % 4;
+        if (tail - head >= max_size)
+        {
+            op |= 2;
+        }
+        else if (tail == head)
+        {
+            op &= 1;
+        }
+        switch (op)
+        {
+        case 0:
+            success = list_insert_beginning(&lst, (void *)next_value);
+            assert(success);
+            model[--head] = next_value++;
+            break;
+        case 1:
+            success = list_insert_end(&lst, (void *)next_value);
+            assert(success);
+            model[tail++] = next_value++;
+            break;
+        case 2:
+            list_remove_beginning(&lst);
+            head++;
+            break;
+        case 3:
+            list_remove_end(&lst);
+            tail--;
+            break;
+        }
+        if (i % 97 == 0)
+        {
+            check_list_contents(&lst, model + head, tail - head);
+        }
+    }
+    check_list_contents(&lst, model + head, tail - head);
+    free(model);
+    list_destroy(&lst);
+}
+
+void test_insert_typing(int list_size)
+{
+    /* Inserts repeatedly just after a cursor that follows each new
+       element, like typing into a text buffer; the nodes left behind
+       should stay full. */
+    list lst = list_create();
+    list_iter iter;
+    list_node* node;
+    int num_nodes = 0;
+    int i, success;
+    list_insert_end(&lst, (void *)0);
+    list_insert_end(&lst, (void *)list_size);
+    iter = list_first(&lst);
+    for (i=1; i < list_size; i++)
+    {
+        success = list_insert_after(&iter, (void *)i);
+        assert(success);
+        list_next(&iter);
+        assert((int)list_get_data(iter) == i);
+    }
+    i = 0;
+    LIST_ITERATE(&lst, iter2)
+        assert((int)list_get_data(iter2) == i);
+        i++;
+    LIST_ITERATE_END()
+    assert(i == list_size + 1);
+    for (node = lst.first_node; node != NULL; node = node->next)
+    {
+        num_nodes++;
+    }
+    assert(num_nodes <= list_size/(lst.node_capacity - 1) + 2);
+    list_destroy(&lst);
+}
+
+void check_span(void** data, int count, void* context)
+{
+    /* Each span must continue the sequence from the previous one */
+    int* next_value = (int *)context;
+    int i;
+    assert(count >= 1);
+    for (i=0; i < count; i++)
+    {
+        assert((int)data[i] == *next_value);
+        (*next_value)++;
+    }
+}
+
+void test_iterate_spans(int list_size)
+{
+    list lst = list_create();
+    int next_value = 0;
+    int num_spans = 0;
+    int i;
+    list_for_each_span(&lst, check_span, &next_value);
+    assert(next_value == 0);
+    for (i=0; i < list_size; i++)
+    {
+        list_insert_end(&lst, (void *)i);
+    }
+    /* Leave some nodes part full and some elements offset */
+    for (i=0; i < list_size/4; i++)
+    {
+        list_remove_beginning(&lst);
+    }
+    next_value = list_size/4;
+    list_for_each_span(&lst, check_span, &next_value);
+    assert(next_value == list_size);
+    next_value = list_size/4;
+    LIST_ITERATE_SPANS(&lst, data, count)
+        check_span(data, count, &next_value);
+        num_spans++;
+    LIST_ITERATE_SPANS_END()
+    assert(next_value == list_size);
+    assert(num_spans <= 2*lst.size/lst.node_capacity + 2);
+    list_destroy(&lst);
+}
+
+#if LIST_HAVE_POSIX
+void double_span(void** data, int count, void* context)
+{
+    int i;
+    for (i=0; i < count; i++)
+    {
+        data[i] = (void *)(2*(int)data[i]);
+    }
+}
+
+void sum_span(void** data, int count, void* accumulator, void* context)
+{
+    int i;
+    for (i=0; i < count; i++)
+    {
+        *(long *)accumulator += (int)data[i];
+    }
+}
+
+void add_sums(void* accumulator, void* partial, void* context)
+{
+    *(long *)accumulator += *(long *)partial;
+}
+
+void first_span(void** data, int count, void* accumulator, void* context)
+{
+    /* Keeps the first element seen, or -1 if none yet */
+    if (*(int *)accumulator == -1)
+    {
+        *(int *)accumulator = (int)data[0];
+    }
+}
+
+void keep_first(void* accumulator, void* partial, void* context)
+{
+    if (*(int *)accumulator == -1)
+    {
+        *(int *)accumulator = *(int *)partial;
+    }
+}
+
+void test_parallel(int list_size, int indexed)
+{
+    list lst = list_create();
+    int num_threads, success;
+    int i;
+    long sum;
+    int first;
+    for (num_threads = 1; num_threads <= 9; num_threads += 2)
+    {
+        sum = 0;
+        success = list_parallel_reduce(&lst, sum_span, add_sums, &sum, sizeof(sum),
+                                       NULL, num_threads);
+        assert(success);
+        assert(sum == 0);
+    }
+    for (i=0; i < list_size; i++)
+    {
+        list_insert_end(&lst, (void *)i);
+    }
+    if (indexed)
+    {
+        build_index(&lst);
+    }
+    for (num_threads = 0; num_threads <= 9; num_threads++)
+    {
+        success = list_parallel_for_each(&lst, double_span, NULL, num_threads);
+        assert(success);
+        sum = 0;
+        success = list_parallel_reduce(&lst, sum_span, add_sums, &sum, sizeof(sum),
+                                       NULL, num_threads);
+        assert(success);
+        assert(sum == (long)list_size*(list_size - 1));
+        first = -1;
+        success = list_parallel_reduce(&lst, first_span, keep_first, &first, sizeof(first),
+                                       NULL, num_threads);
+        assert(success);
+        assert(first == 0);
+        success = list_parallel_for_each(&lst, double_span, NULL, 1000);
+        assert(success);
+        LIST_ITERATE(&lst, iter)
+            list_get_data(iter) = (void *)((int)list_get_data(iter) / 4);
+        LIST_ITERATE_END()
+    }
+    i = 0;
+    LIST_ITERATE(&lst, iter)
+        assert((int)list_get_data(iter) == i);
+        i++;
+    LIST_ITERATE_END()
+    list_destroy(&lst);
+}
+#endif
+
+int compare_keys(void* left, void* right, void* context)
+{
+    /* Elements are key*65536 + sequence number; compare keys only */
+    return ((int)left >> 16) - ((int)right >> 16);
+}
+
+void fill_random_keys(list* lst, int list_size, int num_keys, int first_sequence)
+{
+    int i;
+    for (i=0; i < list_size; i++)
+    {
+        list_insert_end(lst, (void *)((rand() % num_keys << 16) + first_sequence + i));
+    }
+}
+
+void check_sorted(list* lst, int list_size)
+{
+    /* Stability means equal keys keep increasing sequence numbers, so
+       the whole values are strictly increasing */
+    int previous = -1;
+    assert(lst->size == list_size);
+    LIST_ITERATE(lst, iter)
+        assert((int)list_get_data(iter) > previous);
+        previous = (int)list_get_data(iter);
+    LIST_ITERATE_END()
+}
+
+void test_sort(int list_size, int num_keys, int indexed)
+{
+    list lst = list_create();
+    list lst2 = list_create();
+#if LIST_HAVE_POSIX
+    int num_threads;
+#endif
+    int success;
+    srand(list_size);
+    fill_random_keys(&lst, list_size, num_keys, 0);
+    if (indexed)
+    {
+        build_index(&lst);
+    }
+    success = list_sort(&lst, compare_keys, NULL);
+    assert(success);
+    check_sorted(&lst, list_size);
+    if (list_size > 0)
+    {
+        assert(list_iter_index(list_last(&lst)) == list_size - 1);
+    }
+
+    /* Merge in a second sorted list with later sequence numbers */
+    fill_random_keys(&lst2, list_size/2, num_keys, list_size);
+    success = list_sort(&lst2, compare_keys, NULL);
+    assert(success);
+    success = list_merge_sorted(&lst, &lst2, compare_keys, NULL);
+    assert(success);
+    assert(lst2.size == 0 && lst2.first_node == NULL);
+    check_sorted(&lst, list_size + list_size/2);
+    list_destroy(&lst);
+
+#if LIST_HAVE_POSIX
+    for (num_threads = 1; num_threads <= 8; num_threads++)
+    {
+        fill_random_keys(&lst2, list_size, num_keys, 0);
+        success = list_parallel_sort(&lst2, compare_keys, NULL, num_threads);
+        assert(success);
+        check_sorted(&lst2, list_size);
+        list_destroy(&lst2);
+    }
+#endif
+}
+
+void test_sort_pooled(int list_size)
+{
+    list_node_pool pool = list_node_pool_create(0);
+    list lst = list_create_pooled(&pool);
+    list lst2 = list_create_pooled(&pool);
+    int success;
+    fill_random_keys(&lst, list_size, 100, 0);
+    fill_random_keys(&lst2, list_size, 100, list_size);
+#if LIST_HAVE_POSIX
+    success = list_parallel_sort(&lst, compare_keys, NULL, 4);
+#else
+    success = list_sort(&lst, compare_keys, NULL);
+#endif
+    assert(success);
+    success = list_sort(&lst2, compare_keys, NULL);
+    assert(success);
+    success = list_merge_sorted(&lst, &lst2, compare_keys, NULL);
+    assert(success);
+    check_sorted(&lst, 2*list_size);
+    list_destroy(&lst);
+    list_destroy(&lst2);
+    list_node_pool_destroy(&pool);
+}
+
+void check_set_operation(list* dst, list* a, list* b, int num_keys, int prefix_size,
+                         int (*expected_count)(int, int))
+{
+    /* After the prefix dst already had, keys must be in order, each
+       appearing as often as expected_count says */
+    int* counts = (int *)calloc(3 * num_keys, sizeof(int));
+    int key, i = 0, previous = 0;
+    LIST_ITERATE(a, iter)
+        counts[(int)list_get_data(iter) >> 16]++;
+    LIST_ITERATE_END()
+    LIST_ITERATE(b, iter)
+        counts[num_keys + ((int)list_get_data(iter) >> 16)]++;
+    LIST_ITERATE_END()
+    LIST_ITERATE(dst, iter)
+        if (i++ >= prefix_size)
+        {
+            key = (int)list_get_data(iter) >> 16;
+            assert(key >= previous);
+            counts[2*num_keys + key]++;
+            previous = key;
+        }
+    LIST_ITERATE_END()
+    for (key = 0; key < num_keys; key++)
+    {
+        assert(counts[2*num_keys + key] ==
+               expected_count(counts[key], counts[num_keys + key]));
+    }
+    free(counts);
+}
+
+int union_count(int m, int n)
+{
+    return m > n ? m : n;
+}
+
+int intersection_count(int m, int n)
+{
+    return m < n ? m : n;
+}
+
+int difference_count(int m, int n)
+{
+    return m > n ? m - n : 0;
+}
+
+void test_set_operations(int list_size, int num_keys, int indexed)
+{
+    list a = list_create();
+    list b = list_create();
+    list dst = list_create();
+    list lst = list_create();
+    list lst2 = list_create();
+    int i, previous, success;
+    srand(list_size + num_keys);
+    fill_random_keys(&a, list_size, num_keys, 0);
+    fill_random_keys(&b, list_size/2, num_keys, list_size);
+    success = list_sort(&a, compare_keys, NULL);
+    assert(success);
+    success = list_sort(&b, compare_keys, NULL);
+    assert(success);
+
+    /* Results are appended to whatever dst already holds */
+    fill_random_keys(&dst, 3, num_keys, 2*list_size);
+    if (indexed)
+    {
+        build_index(&dst);
+    }
+    success = list_set_union(&dst, &a, &b, compare_keys, NULL);
+    assert(success);
+    check_set_operation(&dst, &a, &b, num_keys, 3, union_count);
+    list_destroy(&dst);
+    success = list_set_intersection(&dst, &a, &b, compare_keys, NULL);
+    assert(success);
+    check_set_operation(&dst, &a, &b, num_keys, 0, intersection_count);
+    /* Equivalent elements are taken from a */
+    LIST_ITERATE(&dst, iter)
+        assert(((int)list_get_data(iter) & 0xFFFF) < list_size);
+    LIST_ITERATE_END()
+    list_destroy(&dst);
+    success = list_set_difference(&dst, &a, &b, compare_keys, NULL);
+    assert(success);
+    check_set_operation(&dst, &a, &b, num_keys, 0, difference_count);
+    list_destroy(&dst);
+    success = list_set_difference(&dst, &a, &a, compare_keys, NULL);
+    assert(success);
+    assert(dst.size == 0 && dst.first_node == NULL);
+    success = list_set_union(&dst, &a, &a, compare_keys, NULL);
+    assert(success);
+    check_set_operation(&dst, &a, &a, num_keys, 0, union_count);
+    list_destroy(&dst);
+
+    /* Lists that interleave in long blocks merge mostly by relinking
+       whole nodes, and must stay sorted and stable */
+    for (i = 0; i < list_size; i++)
+    {
+        int block = i / 1000;
+        list_insert_end((block % 2 == 0) ? &lst : &lst2,
+                        (void *)((block << 16) + i));
+    }
+    success = list_merge_sorted(&lst, &lst2, compare_keys, NULL);
+    assert(success);
+    assert(lst.size == list_size && lst2.size == 0);
+    previous = -1;
+    LIST_ITERATE(&lst, iter)
+        assert(((int)list_get_data(iter) & 0xFFFF) == previous + 1);
+        previous++;
+    LIST_ITERATE_END()
+
+    list_destroy(&a);
+    list_destroy(&b);
+    list_destroy(&lst);
+}
+
+#if LIST_HAVE_POSIX
+void test_queue_batches(int num_values, int multi_producer)
+{
+    list_queue queue = list_queue_create(multi_producer);
+    void* values[100];
+    void* value;
+    int pushed = 0, popped = 0;
+    int i, count, success;
+    success = !list_queue_pop(&queue, &value);
+    assert(success);
+    srand(num_values);
+    while (popped < num_values)
+    {
+        /* Batches of varying size, often straddling nodes */
+        count = rand() % 100;
+        if (count > num_values - pushed)
+        {
+            count = num_values - pushed;
+        }
+        for (i = 0; i < count; i++)
+        {
+            values[i] = (void *)(pushed + i);
+        }
+        success = list_queue_push_batch(&queue, values, count) == count;
+        assert(success);
+        pushed += count;
+        if (rand() % 2 == 0)
+        {
+            success = list_queue_push(&queue, (void *)pushed);
+            assert(success);
+            pushed++;
+            success = list_queue_pop(&queue, &value);
+            assert(success);
+            assert((int)value == popped);
+            popped++;
+        }
+        count = list_queue_pop_batch(&queue, values, rand() % 100);
+        for (i = 0; i < count; i++)
+        {
+            assert((int)values[i] == popped + i);
+        }
+        popped += count;
+        if (pushed >= num_values)
+        {
+            while ((count = list_queue_pop_batch(&queue, values, 100)) > 0)
+            {
+                for (i = 0; i < count; i++)
+                {
+                    assert((int)values[i] == popped + i);
+                }
+                popped += count;
+            }
+            assert(popped == pushed);
+        }
+    }
+    success = !list_queue_pop(&queue, &value);
+    assert(success);
+
+    /* Leave some elements behind for list_queue_destroy() */
+    success = list_queue_push_batch(&queue, values, 100) == 100;
+    assert(success);
+    list_queue_destroy(&queue);
+}
+
+typedef struct
+{
+    list_queue* queue;
+    int producer;
+    int num_values;
+} queue_producer_args;
+
+void* queue_producer(void* args_ptr)
+{
+    queue_producer_args* args = (queue_producer_args *)args_ptr;
+    void* values[37];
+    int i, j, success;
+    for (i = 0; i < args->num_values; i += 37)
+    {
+        int count = (args->num_values - i < 37) ? args->num_values - i : 37;
+        for (j = 0; j < count; j++)
+        {
+            values[j] = (void *)((args->producer << 24) + i + j);
+        }
+        success = list_queue_push_batch(args->queue, values, count) == count;
+        assert(success);
+    }
+    return NULL;
+}
+
+void test_queue_threads(int num_values, int num_producers)
+{
+    list_queue queue = list_queue_create(num_producers > 1);
+    queue_producer_args args[8];
+    pthread_t threads[8];
+    int next_value[8];
+    void* values[50];
+    int popped = 0;
+    int i, success;
+    for (i = 0; i < num_producers; i++)
+    {
+        args[i].queue = &queue;
+        args[i].producer = i;
+        args[i].num_values = num_values;
+        next_value[i] = 0;
+        success = pthread_create(&threads[i], NULL, queue_producer, &args[i]) == 0;
+        assert(success);
+    }
+    while (popped < num_values * num_producers)
+    {
+        /* Each producer's values must arrive in the order pushed */
+        int count = list_queue_pop_batch(&queue, values, 50);
+        for (i = 0; i < count; i++)
+        {
+            int producer = (int)values[i] >> 24;
+            assert((int)values[i] == (producer << 24) + next_value[producer]);
+            next_value[producer]++;
+        }
+        popped += count;
+    }
+    for (i = 0; i < num_producers; i++)
+    {
+        pthread_join(threads[i], NULL);
+        assert(next_value[i] == num_values);
+    }
+    list_queue_destroy(&queue);
+}
+#endif
+
+void test_spare_nodes(int num_cycles)
+{
+    list_node_pool pool = list_node_pool_create(0);
+    list lst = list_create();
+    list lst2 = list_create_pooled(&pool);
+    list_node* node;
+    int i, j, success;
+    assert(lst.num_spare_nodes == 0);
+
+    /* Oscillating across a node boundary reuses the same cached node */
+    for (i = 0; i < lst.node_capacity; i++)
+    {
+        success = list_insert_end(&lst, (void *)i);
+        assert(success);
+    }
+    success = list_insert_end(&lst, (void *)i);
+    assert(success);
+    node = lst.last_node;
+    for (i = 0; i < num_cycles; i++)
+    {
+        list_remove_end(&lst);
+        assert(lst.num_spare_nodes == 1);
+        success = list_insert_end(&lst, (void *)i);
+        assert(success);
+        assert(lst.num_spare_nodes == 0);
+        assert(lst.last_node == node);
+    }
+
+    /* The cache holds at most its high-water mark */
+    while (lst.size > 0)
+    {
+        list_remove_beginning(&lst);
+    }
+    assert(lst.num_spare_nodes == LIST_DEFAULT_MAX_SPARE_NODES);
+    list_set_max_spare_nodes(&lst, 1);
+    assert(lst.num_spare_nodes == 1);
+
+    /* Reserved nodes are used up by appending, and may exceed the mark */
+    success = list_reserve(&lst, 10*lst.node_capacity);
+    assert(success);
+    assert(lst.num_spare_nodes == 10);
+    success = list_reserve(&lst, 5*lst.node_capacity);
+    assert(success);
+    assert(lst.num_spare_nodes == 10);
+    for (i = 0; i < 10*lst.node_capacity; i++)
+    {
+        success = list_insert_end(&lst, (void *)i);
+        assert(success);
+    }
+    assert(lst.num_spare_nodes == 0);
+    j = 0;
+    LIST_ITERATE(&lst, iter)
+        assert((int)list_get_data(iter) == j);
+        j++;
+    LIST_ITERATE_END()
+    list_destroy(&lst);
+    assert(lst.num_spare_nodes == 0);
+    assert(lst.max_spare_nodes == 1);
+
+    /* A pooled list returns its spare nodes to the pool */
+    success = list_reserve(&lst2, 3*lst2.node_capacity);
+    assert(success);
+    assert(lst2.num_spare_nodes == 3);
+    list_destroy(&lst2);
+    assert(lst2.num_spare_nodes == 0);
+    i = 0;
+    for (node = pool.free_nodes; node != NULL; node = node->next)
+    {
+        i++;
+    }
+    assert(i == pool.nodes_per_slab);
+    list_node_pool_destroy(&pool);
+}
+
+void check_compacted(list* lst, int modulus)
+{
+    /* Every node but the last is full, holding the multiples of modulus */
+    list_node* node;
+    int i = 0;
+    for (node = lst->first_node; node != NULL; node = node->next)
+    {
+        assert(node->next == NULL || node->count == lst->node_capacity);
+    }
+    LIST_ITERATE(lst, iter)
+        assert((int)list_get_data(iter) == i);
+        i += modulus;
+    LIST_ITERATE_END()
+}
+
+void test_find(int list_size, int modulus)
+{
+    /* Values repeat with the given modulus; nodes are left with
+       varied starts and odd counts so the vector loops hit every
+       alignment and tail length */
+    list lst = list_create();
+    list_iter iter;
+    int counts[16];
+    int value, i, success;
+    assert(modulus <= 16);
+    memset(counts, 0, sizeof(counts));
+    for (i=0; i < list_size; i++)
+    {
+        if (i % 2 == 0)
+        {
+            success = list_insert_end(&lst, (void *)(i % modulus));
+            assert(success);
+        }
+        else
+        {
+            success = list_insert_beginning(&lst, (void *)(i % modulus));
+            assert(success);
+        }
+    }
+    for (iter = list_first(&lst); !list_at_end(iter); )
+    {
+        if (rand() % 5 == 0)
+        {
+            list_remove(&iter);
+        }
+        else
+        {
+            counts[(int)list_get_data(iter)]++;
+            list_next(&iter);
+        }
+    }
+
+    for (value = 0; value <= modulus; value++)
+    {
+        /* Each match found must be the next one in list order */
+        list_iter expected = list_first(&lst);
+        int num_found = 0;
+        iter = list_find(&lst, (void *)value);
+        for (;;)
+        {
+            while (!list_at_end(expected) && (int)list_get_data(expected) != value)
+            {
+                list_next(&expected);
+            }
+            assert(iter.node == expected.node && iter.offset == expected.offset);
+            if (list_at_end(iter))
+            {
+                break;
+            }
+            num_found++;
+            list_next(&iter);
+            list_next(&expected);
+            iter = list_find_from(iter, (void *)value);
+        }
+        assert(num_found == (value < modulus ? counts[value] : 0));
+        assert(list_count(&lst, (void *)value) == num_found);
+    }
+    iter = list_first(&lst);
+    while (!list_at_end(iter))
+    {
+        list_next(&iter);
+    }
+    assert(list_at_end(list_find_from(iter, (void *)0)));
+    list_destroy(&lst);
+    assert(list_at_end(list_find(&lst, (void *)0)));
+    assert(list_count(&lst, (void *)0) == 0);
+}
+
+void test_lazy_rebalancing(int list_size, int max_lazy_removals, int indexed)
+{
+    list_node_pool pool = list_node_pool_create(0);
+    list lst = list_create_pooled(&pool);
+    list_iter iter;
+    list_node* node;
+    int i, success;
+    for (i = 0; i < list_size; i++)
+    {
+        list_insert_end(&lst, (void *)i);
+    }
+    if (indexed)
+    {
+        build_index(&lst);
+    }
+    list_set_lazy_rebalancing(&lst, max_lazy_removals);
+
+    /* Remove all but the multiples of 3, with the iterator staying
+       valid across any automatic compactions */
+    iter = list_first(&lst);
+    for (i = 0; i < list_size; i++)
+    {
+        assert((int)list_get_data(iter) == i);
+        if (i % 3 == 0)
+        {
+            list_next(&iter);
+        }
+        else
+        {
+            list_remove(&iter);
+        }
+    }
+    assert(list_at_end(iter));
+    assert(lst.size == (list_size + 2)/3);
+    list_compact(&lst);
+    check_compacted(&lst, 3);
+    if (indexed)
+    {
+        assert((int)list_get_data(list_iter_at(&lst, lst.size - 1)) == 3*(lst.size - 1));
+    }
+
+    /* Remove all but the multiples of 6, then move into one new slab */
+    iter = list_first(&lst);
+    while (!list_at_end(iter))
+    {
+        if ((int)list_get_data(iter) % 6 != 0)
+        {
+            list_remove(&iter);
+        }
+        else
+        {
+            list_next(&iter);
+        }
+    }
+    success = list_compact_contiguous(&lst);
+    assert(success);
+    check_compacted(&lst, 6);
+    for (node = lst.first_node; node != NULL && node->next != NULL; node = node->next)
+    {
+        assert((char *)node->next - (char *)node ==
+               (char *)lst.first_node->next - (char *)lst.first_node);
+    }
+    if (indexed)
+    {
+        assert((int)list_get_data(list_iter_at(&lst, lst.size/2)) == 6*(lst.size/2));
+    }
+
+    /* Returning to eager rebalancing compacts the list */
+    iter = list_first(&lst);
+    while (!list_at_end(iter))
+    {
+        list_next(&iter);
+        if (!list_at_end(iter))
+        {
+            list_remove(&iter);
+        }
+    }
+    list_set_lazy_rebalancing(&lst, 0);
+    check_compacted(&lst, 12);
+    list_destroy(&lst);
+
+    /* Merging takes on the thinned-out nodes of a lazy source list */
+    for (i = 0; i < 10; i++)
+    {
+        list_insert_end(&lst, (void *)(8*i));
+    }
+    {
+        list src = list_create_pooled(&pool);
+        for (i = 0; i < 20*list_size/1000; i++)
+        {
+            list_insert_end(&src, (void *)i);
+        }
+        list_set_lazy_rebalancing(&src, max_lazy_removals);
+        iter = list_first(&src);
+        while (!list_at_end(iter))
+        {
+            if ((int)list_get_data(iter) % 8 != 0)
+            {
+                list_remove(&iter);
+            }
+            else
+            {
+                list_next(&iter);
+            }
+        }
+        success = list_merge_sorted(&lst, &src, compare_keys, NULL);
+        assert(success);
+        assert(lst.size == 10 + (20*list_size/1000 + 7)/8 && src.size == 0);
+        list_destroy(&src);
+    }
+    list_destroy(&lst);
+
+    /* Thinned-out nodes linked into an indexed list each get an index
+       entry, though there are more of them than a full list would need */
+    for (i = 0; i < lst.node_capacity; i++)
+    {
+        list_insert_end(&lst, (void *)i);
+    }
+    build_index(&lst);
+    {
+        list src = list_create_pooled(&pool);
+        for (i = 0; i < 4*lst.node_capacity; i++)
+        {
+            list_insert_end(&src, (void *)(lst.node_capacity + i));
+        }
+        list_set_lazy_rebalancing(&src, INT_MAX);
+        iter = list_first(&src);
+        while (!list_at_end(iter))
+        {
+            list_next(&iter);
+            if (!list_at_end(iter))
+            {
+                list_remove(&iter);
+            }
+        }
+        success = list_merge_sorted(&lst, &src, compare_keys, NULL);
+        assert(success);
+        assert(lst.size == 3*lst.node_capacity && src.size == 0);
+        for (i = 0; i < lst.size; i++)
+        {
+            int expected = (i < lst.node_capacity) ? i : 2*i - lst.node_capacity;
+            assert((int)list_get_data(list_iter_at(&lst, i)) == expected);
+        }
+        list_destroy(&src);
+    }
+    list_destroy(&lst);
+    list_node_pool_destroy(&pool);
+}
+
+/* A value type larger than a pointer, for the typed list tests */
+typedef struct
+{
+    int key;
+    double weight;
+    char tag[20];
+} test_point;
+
+DECLARE_LIST(test_point_list, test_point);
+DEFINE_LIST(test_point_list, test_point)
+
+DECLARE_LIST(test_int_list, int);
+DEFINE_LIST(test_int_list, int)
+
+void check_typed_list(test_point_list* points, list* keys)
+{
+    /* The typed list must hold the same keys as the untyped one, in
+       well-formed nodes */
+    test_point_list_node* node;
+    list_iter key_iter = list_first(keys);
+    int size = 0;
+    for (node = points->first_node; node != NULL; node = node->next)
+    {
+        assert(node->count >= 1);
+        assert(node->start >= 0);
+        assert(node->start + node->count <= TYPED_LIST_NODE_CAPACITY(test_point));
+        assert(node->next == NULL || node->next->prev == node);
+        size += node->count;
+    }
+    assert(size == points->size && points->size == keys->size);
+    TYPED_LIST_ITERATE(test_point_list, points, iter)
+        assert(list_get_data(iter).key == (int)list_get_data(key_iter));
+        assert(list_get_data(iter).weight == list_get_data(iter).key / 2.0);
+        assert(strcmp(list_get_data(iter).tag, "point") == 0);
+        list_next(&key_iter);
+    TYPED_LIST_ITERATE_END()
+}
+
+void test_typed_list(int list_size, int num_operations)
+{
+    test_point_list points = test_point_list_create();
+    test_int_list ints = test_int_list_create();
+    list keys = list_create();
+    test_point_list_iter iter;
+    list_iter key_iter;
+    test_point point;
+    int i, success;
+    strcpy(point.tag, "point");
+    for (i=0; i < list_size; i++)
+    {
+        point.key = i;
+        point.weight = i / 2.0;
+        success = test_point_list_insert_end(&points, point);
+        assert(success);
+        success = list_insert_end(&keys, (void *)i);
+        assert(success);
+        success = test_int_list_insert_beginning(&ints, i);
+        assert(success);
+    }
+    check_typed_list(&points, &keys);
+
+    /* Apply the same random operations to both lists */
+    iter = test_point_list_first(&points);
+    key_iter = list_first(&keys);
+    for (i=0; i < num_operations; i++)
+    {
+        point.key = rand();
+        point.weight = point.key / 2.0;
+        switch (rand() % 7)
+        {
+        case 0:
+            if (!list_at_end(iter))
+            {
+                list_next(&iter);
+                list_next(&key_iter);
+            }
+            break;
+        case 1:
+            if (!list_at_beginning(iter) && !list_at_end(iter))
+            {
+                list_prev(&iter);
+                list_prev(&key_iter);
+            }
+            break;
+        case 2:
+            if (!list_at_end(iter))
+            {
+                success = test_point_list_insert_after(&iter, point);
+                assert(success);
+                success = list_insert_after(&key_iter, (void *)point.key);
+                assert(success);
+            }
+            break;
+        case 3:
+            success = test_point_list_insert_before(&iter, point);
+            assert(success);
+            success = list_insert_before(&key_iter, (void *)point.key);
+            assert(success);
+            break;
+        case 4:
+        case 5:
+            if (!list_at_end(iter))
+            {
+                test_point_list_remove(&iter);
+                list_remove(&key_iter);
+            }
+            break;
+        case 6:
+            if (points.size > 0 && rand() % 2 == 0)
+            {
+                test_point_list_remove_beginning(&points);
+                list_remove_beginning(&keys);
+            }
+            else if (points.size > 0)
+            {
+                test_point_list_remove_end(&points);
+                list_remove_end(&keys);
+            }
+            iter = test_point_list_first(&points);
+            key_iter = list_first(&keys);
+            break;
+        default:
+            assert(0);
+        }
+        assert(list_at_end(iter) == list_at_end(key_iter));
+        assert(list_at_end(iter) ||
+               list_get_data(iter).key == (int)list_get_data(key_iter));
+    }
+    check_typed_list(&points, &keys);
+
+    /* Values inserted at the beginning come out in reverse */
+    i = list_size;
+    TYPED_LIST_ITERATE(test_int_list, &ints, int_iter)
+        assert(list_get_data(int_iter) == --i);
+        list_get_data(int_iter) *= 2;
+    TYPED_LIST_ITERATE_END()
+    assert(i == 0);
+    iter = test_point_list_last(&points);
+    for (i=0; i < list_size; i++)
+    {
+        test_int_list_iter int_iter = test_int_list_last(&ints);
+        assert(list_get_data(int_iter) == 2*i);
+        test_int_list_remove_end(&ints);
+    }
+    assert(ints.size == 0 && ints.first_node == NULL && ints.last_node == NULL);
+
+    test_int_list_destroy(&ints);
+    test_point_list_destroy(&points);
+    list_destroy(&keys);
+}
+
+void check_snapshot(list_snapshot* snapshot, int* values, int num_values)
+{
+    int i = 0;
+    assert(snapshot->size == num_values);
+    LIST_SNAPSHOT_ITERATE(snapshot, iter)
+        assert(i < num_values);
+        assert((int)list_snapshot_get_data(iter) == values[i]);
+        i++;
+    LIST_SNAPSHOT_ITERATE_END()
+    assert(i == num_values);
+}
+
+int* save_list_values(list* lst)
+{
+    int* values = (int *)malloc((lst->size + 1) * sizeof(int));
+    int i = 0;
+    LIST_ITERATE(lst, iter)
+        values[i++] = (int)list_get_data(iter);
+    LIST_ITERATE_END()
+    return values;
+}
+
+void random_list_edit(list* lst, list_iter* iter)
+{
+    int success;
+    switch (rand() % 10)
+    {
+    case 0:
+        if (!list_at_end(*iter))
+        {
+            list_next(iter);
+        }
+        break;
+    case 1:
+        if (!list_at_end(*iter) && !list_at_beginning(*iter))
+        {
+            list_prev(iter);
+        }
+        break;
+    case 2:
+        if (!list_at_end(*iter))
+        {
+            success = list_insert_after(iter, (void *)rand());
+            assert(success);
+        }
+        break;
+    case 3:
+        success = list_insert_before(iter, (void *)rand());
+        assert(success);
+        break;
+    case 4:
+        if (!list_at_end(*iter))
+        {
+            list_remove(iter);
+        }
+        break;
+    case 5:
+        success = list_insert_end(lst, (void *)rand());
+        assert(success);
+        *iter = list_first(lst);
+        break;
+    case 6:
+        success = list_insert_beginning(lst, (void *)rand());
+        assert(success);
+        *iter = list_first(lst);
+        break;
+    case 7:
+        if (lst->size > 0)
+        {
+            list_remove_end(lst);
+        }
+        *iter = list_first(lst);
+        break;
+    case 8:
+        if (lst->size > 0)
+        {
+            list_remove_beginning(lst);
+        }
+        *iter = list_first(lst);
+        break;
+    case 9:
+        if (rand() % 50 == 0)
+        {
+            list_remove_if(lst, is_multiple, (void *)7);
+            *iter = list_first(lst);
+        }
+        break;
+    default:
+        assert(0);
+    }
+}
+
+long value_weight(void* value, void* context)
+{
+    /* Some elements weigh nothing, and so contain no offset */
+    return (int)value % (int)context;
+}
+
+void check_weights(list* lst, int modulus)
+{
+    /* Compare seeks and prefix weights against a linear walk */
+    long prefix = 0;
+    LIST_ITERATE(lst, iter)
+        long weight = (int)list_get_data(iter) % modulus;
+        long offset;
+        assert(list_prefix_weight(iter) == prefix);
+        for (offset = prefix; offset < prefix + weight; offset++)
+        {
+            list_iter found = list_seek_weight(lst, offset);
+            assert(found.node == iter.node && found.offset == iter.offset);
+        }
+        prefix += weight;
+    LIST_ITERATE_END()
+    assert(list_prefix_weight(list_iter_at(lst, lst->size)) == prefix);
+    assert(list_at_end(list_seek_weight(lst, prefix)));
+    assert(list_at_end(list_seek_weight(lst, prefix + 100)));
+}
+
+void test_weighted_index(int list_size, int num_operations)
+{
+    list lst = list_create();
+    list other = list_create();
+    list_iter iter;
+    int modulus = 5;
+    int repeat, success;
+    int i;
+    for (i=0; i < list_size; i++)
+    {
+        list_insert_end(&lst, (void *)i);
+        list_insert_end(&other, (void *)i);
+    }
+#if LIST_COMPACT_NODES
+    success = !list_build_weighted_index(&lst, value_weight, (void *)modulus);
+    assert(success);
+    assert(lst.weight == NULL);
+#else
+    success = list_build_weighted_index(&lst, value_weight, (void *)modulus);
+    assert(success);
+    success = list_build_weighted_index(&other, value_weight, (void *)modulus);
+    assert(success);
+    check_weights(&lst, modulus);
+    iter = list_first(&lst);
+    for (repeat=0; repeat < num_operations; repeat++)
+    {
+        switch (rand() % 20)
+        {
+        case 0:
+            /* Move a range over from the other list, and back again */
+            {
+                int start = rand() % (other.size + 1);
+                list_iter first = list_iter_at(&other, start);
+                list_iter last = list_iter_at(&other, start + rand() % (other.size - start + 1));
+                success = list_splice_range(&iter, &first, &last);
+                assert(success);
+                check_weights(&other, modulus);
+                iter = list_iter_at(&lst, rand() % (lst.size + 1));
+                last = list_iter_at(&lst, lst.size - rand() % (lst.size - list_iter_index(iter) + 1));
+                first = list_iter_at(&other, other.size);
+                success = list_splice_range(&first, &iter, &last);
+                assert(success);
+                check_weights(&other, modulus);
+            }
+            iter = list_first(&lst);
+            break;
+        case 1:
+            if (rand() % 10 == 0)
+            {
+                success = list_sort(&lst, compare_keys, NULL);
+                assert(success);
+                iter = list_first(&lst);
+            }
+            break;
+        case 2:
+            list_compact(&lst);
+            iter = list_first(&lst);
+            break;
+        case 3:
+            /* Change an element's weight in place */
+            if (!list_at_end(iter))
+            {
+                list_get_data(iter) = (void *)rand();
+                list_update_weight(iter);
+            }
+            break;
+        default:
+            random_list_edit(&lst, &iter);
+            break;
+        }
+        if (repeat % 16 == 0)
+        {
+            check_weights(&lst, modulus);
+        }
+    }
+    check_weights(&lst, modulus);
+    list_drop_index(&lst);
+    assert(lst.weight == NULL);
+#endif
+    list_destroy(&other);
+    list_destroy(&lst);
+}
+
+#if LIST_HAVE_POSIX
+typedef struct
+{
+    list_snapshot* snapshot;
+    int* values;
+    int num_passes;
+} snapshot_reader_args;
+
+void* read_snapshot(void* args_ptr)
+{
+    snapshot_reader_args* args = (snapshot_reader_args *)args_ptr;
+    int pass;
+    for (pass = 0; pass < args->num_passes; pass++)
+    {
+        check_snapshot(args->snapshot, args->values, args->snapshot->size);
+    }
+    /* Releasing from this thread races with the writer's own releases */
+    list_snapshot_destroy(args->snapshot);
+    return NULL;
+}
+#endif
+
+void test_snapshot(int list_size, int num_operations, int indexed)
+{
+    list lst = list_create();
+    list_snapshot first, second, empty;
+    list_node* node;
+    list_iter iter;
+    int* first_values;
+    int* second_values = NULL;
+    int i, success;
+    for (i=0; i < list_size; i++)
+    {
+        success = list_insert_end(&lst, (void *)i);
+        assert(success);
+    }
+    if (indexed)
+    {
+        build_index(&lst);
+    }
+
+    /* An edit copies only the node it touches */
+    first_values = save_list_values(&lst);
+    success = list_take_snapshot(&lst, &first);
+    assert(success);
+    success = list_insert_end(&lst, (void *)-1);
+    assert(success);
+    i = 0;
+    for (node = lst.first_node; node != NULL && node->next != NULL; node = node->next)
+    {
+        if (i < first.num_spans - 1)
+        {
+            assert(node == first.spans[i].node && node->refcount == 2);
+        }
+        i++;
+    }
+    if (list_size > 0)
+    {
+        assert(lst.last_node->refcount == 1);
+    }
+    check_snapshot(&first, first_values, list_size);
+
+    /* Overlapping snapshots each keep their own view */
+    iter = list_first(&lst);
+    for (i=0; i < num_operations; i++)
+    {
+        random_list_edit(&lst, &iter);
+        if (i == num_operations/3)
+        {
+            second_values = save_list_values(&lst);
+            success = list_take_snapshot(&lst, &second);
+            assert(success);
+            iter = list_first(&lst);
+        }
+        if (i == 2*num_operations/3)
+        {
+            check_snapshot(&first, first_values, list_size);
+            list_snapshot_destroy(&first);
+        }
+    }
+    success = list_take_snapshot(&lst, &first);
+    assert(success);
+    list_snapshot_destroy(&first);
+
+    /* Bulk operations copy the shared nodes first */
+    free(first_values);
+    first_values = save_list_values(&lst);
+    success = list_take_snapshot(&lst, &first);
+    assert(success);
+    success = list_sort(&lst, compare_keys, NULL);
+    assert(success);
+    success = list_compact(&lst);
+    assert(success);
+    success = list_unshare(&lst);
+    assert(success);
+    assert(!lst.shared);
+    check_snapshot(&first, first_values, first.size);
+
+    /* Snapshots outlive the list */
+    list_destroy(&lst);
+    success = list_take_snapshot(&lst, &empty);
+    assert(success);
+    assert(empty.size == 0 && list_snapshot_at_end(list_snapshot_first(&empty)));
+    list_snapshot_destroy(&empty);
+    check_snapshot(&second, second_values, second.size);
+    check_snapshot(&first, first_values, first.size);
+    list_snapshot_destroy(&second);
+    list_snapshot_destroy(&first);
+    free(first_values);
+    free(second_values);
+}
+
+#if LIST_HAVE_POSIX
+void test_snapshot_threads(int list_size, int num_operations)
+{
+    /* A reader walks a snapshot while the list is edited */
+    list lst = list_create();
+    list_snapshot snapshot;
+    snapshot_reader_args args;
+    pthread_t reader;
+    list_iter iter;
+    int i, success;
+    for (i=0; i < list_size; i++)
+    {
+        success = list_insert_end(&lst, (void *)i);
+        assert(success);
+    }
+    args.values = save_list_values(&lst);
+    args.snapshot = &snapshot;
+    args.num_passes = 20;
+    success = list_take_snapshot(&lst, &snapshot);
+    assert(success);
+    success = pthread_create(&reader, NULL, read_snapshot, &args) == 0;
+    assert(success);
+    iter = list_first(&lst);
+    for (i=0; i < num_operations; i++)
+    {
+        random_list_edit(&lst, &iter);
+    }
+    pthread_join(reader, NULL);
+    list_destroy(&lst);
+    free(args.values);
+}
+
+void encode_int(void* value, void* record, void* context)
+{
+    int int_value = (int)value * (int)context;
+    memcpy(record, &int_value, sizeof(int));
+}
+
+void* decode_int(const void* record, void* context)
+{
+    int int_value;
+    memcpy(&int_value, record, sizeof(int));
+    return (void *)(int_value / (int)context);
+}
+
+void test_list_io(int list_size)
+{
+    list lst = list_create();
+    list read_lst = list_create();
+    list_image image, relocated;
+    FILE* file = tmpfile();
+    int fd = fileno(file);
+    int* values;
+    char trailer[4];
+    int i, success;
+    for (i=0; i < list_size; i++)
+    {
+        success = list_insert_end(&lst, (void *)i);
+        assert(success);
+    }
+    /* Leave some nodes part full */
+    list_set_lazy_rebalancing(&lst, INT_MAX);
+    list_remove_if(&lst, is_multiple, (void *)3);
+    values = save_list_values(&lst);
+
+    /* Encoded records, followed by data that must be left unread */
+    success = list_write(&lst, fd, sizeof(int), encode_int, (void *)2);
+    assert(success);
+    success = write(fd, "end", 4) == 4;
+    assert(success);
+    lseek(fd, 0, SEEK_SET);
+    success = list_read(&read_lst, fd, sizeof(int), decode_int, (void *)2);
+    assert(success);
+    check_list_contents(&read_lst, values, lst.size);
+    success = read(fd, trailer, 4) == 4 && strcmp(trailer, "end") == 0;
+    assert(success);
+
+    /* The elements are appended, and a mismatched size is rejected */
+    lseek(fd, 0, SEEK_SET);
+    success = !list_read(&read_lst, fd, sizeof(short), decode_int, (void *)2);
+    assert(success);
+    assert(read_lst.size == lst.size);
+    lseek(fd, 0, SEEK_SET);
+    success = list_read(&read_lst, fd, sizeof(int), decode_int, (void *)2);
+    assert(success);
+    assert(read_lst.size == 2*lst.size);
+    list_destroy(&read_lst);
+
+    /* Raw pointers, then a truncated file */
+    lseek(fd, 0, SEEK_SET);
+    success = ftruncate(fd, 0) == 0;
+    assert(success);
+    success = list_write(&lst, fd, sizeof(void *), NULL, NULL);
+    assert(success);
+    lseek(fd, 0, SEEK_SET);
+    success = list_read(&read_lst, fd, sizeof(void *), NULL, NULL);
+    assert(success);
+    check_list_contents(&read_lst, values, lst.size);
+    list_destroy(&read_lst);
+    if (lst.size > 0)
+    {
+        success = ftruncate(fd, lseek(fd, 0, SEEK_END) - 1) == 0;
+        assert(success);
+        lseek(fd, 0, SEEK_SET);
+        success = !list_read(&read_lst, fd, sizeof(void *), NULL, NULL);
+        assert(success);
+        list_destroy(&read_lst);
+    }
+
+    /* An image maps at its base address; a second mapping of it
+       finds the address taken and is relocated */
+    lseek(fd, 0, SEEK_SET);
+    success = ftruncate(fd, 0) == 0;
+    assert(success);
+    success = list_write_image(&lst, fd, NULL, NULL, NULL);
+    assert(success);
+    success = list_map_image(&image, fd);
+    assert(success);
+    assert(image.address == LIST_IMAGE_DEFAULT_BASE_ADDRESS);
+    success = list_map_image(&relocated, fd);
+    assert(success);
+    assert(relocated.address != image.address);
+    check_list_contents(&image.lst, values, lst.size);
+    check_list_contents(&relocated.lst, values, lst.size);
+    for (i=0; i < lst.size; i += 1 + lst.size/10)
+    {
+        list_iter iter = list_iter_at(&relocated.lst, i);
+        assert((int)list_get_data(iter) == values[i]);
+        assert(list_iter_index(list_find(&image.lst, (void *)values[i])) == i);
+    }
+    list_unmap_image(&image);
+    list_unmap_image(&relocated);
+
+    /* Encoded words, at a chosen address */
+    lseek(fd, 0, SEEK_SET);
+    success = ftruncate(fd, 0) == 0;
+    assert(success);
+    success = list_write_image(&lst, fd, encode_int, (void *)1,
+                               (char *)LIST_IMAGE_DEFAULT_BASE_ADDRESS + 0x10000000);
+    assert(success);
+    success = list_map_image(&image, fd);
+    assert(success);
+    check_list_contents(&image.lst, values, lst.size);
+    list_unmap_image(&image);
+
+    /* Anything else is rejected */
+    lseek(fd, 0, SEEK_SET);
+    success = ftruncate(fd, 0) == 0;
+    assert(success);
+    success = list_write(&lst, fd, sizeof(void *), NULL, NULL);
+    assert(success);
+    success = !list_map_image(&image, fd);
+    assert(success);
+
+    fclose(file);
+    free(values);
+    list_destroy(&lst);
+}
+
+void test_list_iovec(int list_size)
+{
+    list lst = list_create();
+    list read_lst = list_create();
+    struct iovec vectors[4];
+    list_iter iter;
+    FILE* file = tmpfile();
+    int fd = fileno(file);
+    int* values;
+    int num_vectors, num_covered, success;
+    int i;
+    for (i=0; i < list_size; i++)
+    {
+        success = list_insert_end(&lst, (void *)i);
+        assert(success);
+    }
+    list_set_lazy_rebalancing(&lst, INT_MAX);
+    list_remove_if(&lst, is_multiple, (void *)5);
+    values = save_list_values(&lst);
+
+    /* Vectors cover the list node by node, from any element on */
+    iter = list_iter_at(&lst, lst.size/2);
+    num_covered = lst.size/2;
+    while ((num_vectors = list_to_iovec(&iter, vectors, 4)) > 0)
+    {
+        for (i=0; i < num_vectors; i++)
+        {
+            void** data = (void **)vectors[i].iov_base;
+            int j;
+            for (j=0; j < (int)(vectors[i].iov_len / sizeof(void *)); j++)
+            {
+                assert((int)data[j] == values[num_covered++]);
+            }
+        }
+    }
+    assert(num_covered == lst.size && list_at_end(iter));
+
+    /* Round trip, appending after an existing element */
+    success = list_writev(&lst, fd);
+    assert(success);
+    success = lseek(fd, 0, SEEK_CUR) == (off_t)(lst.size * sizeof(void *));
+    assert(success);
+    lseek(fd, 0, SEEK_SET);
+    success = list_insert_end(&read_lst, (void *)-1);
+    assert(success);
+    success = list_readv_append(&read_lst, fd, lst.size) == lst.size;
+    assert(success);
+    assert(read_lst.size == lst.size + 1);
+    list_remove_beginning(&read_lst);
+    check_list_contents(&read_lst, values, lst.size);
+    list_destroy(&read_lst);
+
+    /* Asking for more than the file holds, with a partial element */
+    if (lst.size > 0)
+    {
+        success = ftruncate(fd, lst.size * sizeof(void *) - 1) == 0;
+        assert(success);
+        lseek(fd, 0, SEEK_SET);
+        success = list_readv_append(&read_lst, fd, lst.size + 100) == lst.size - 1;
+        assert(success);
+        check_list_contents(&read_lst, values, lst.size - 1);
+        list_destroy(&read_lst);
+    }
+
+    /* Nothing past the elements requested is consumed from a pipe */
+    if (lst.size * sizeof(void *) < 4096)
+    {
+        int pipe_fds[2];
+        char trailer[4];
+        success = pipe(pipe_fds) == 0;
+        assert(success);
+        success = list_writev(&lst, pipe_fds[1]);
+        assert(success);
+        success = write(pipe_fds[1], "end", 4) == 4;
+        assert(success);
+        success = list_readv_append(&read_lst, pipe_fds[0], lst.size) == lst.size;
+        assert(success);
+        check_list_contents(&read_lst, values, lst.size);
+        success = read(pipe_fds[0], trailer, 4) == 4 && strcmp(trailer, "end") == 0;
+        assert(success);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        list_destroy(&read_lst);
+    }
+
+    fclose(file);
+    free(values);
+    list_destroy(&lst);
+}
+#endif
+
+#define NUM_TEST_FINGERS 8
+
+void shift_finger_positions(int* positions, int position, int count)
+{
+    /* Fingers at or after an insertion of count elements at position */
+    int i;
+    for (i = 0; i < NUM_TEST_FINGERS; i++)
+    {
+        if (positions[i] >= position)
+        {
+            positions[i] += count;
+        }
+    }
+}
+
+void drop_finger_positions(int* positions, int first, int last)
+{
+    /* Fingers on removed elements move to the element after them */
+    int i;
+    for (i = 0; i < NUM_TEST_FINGERS; i++)
+    {
+        if (positions[i] >= last)
+        {
+            positions[i] -= last - first;
+        }
+        else if (positions[i] > first)
+        {
+            positions[i] = first;
+        }
+    }
+}
+
+void check_fingers(list* lst, list_finger* fingers, int* positions, int* expected)
+{
+    int i;
+    for (i = 0; i < NUM_TEST_FINGERS; i++)
+    {
+        list_iter iter = list_finger_iter(&fingers[i]);
+        assert(iter.lst == lst);
+        if (positions[i] == lst->size)
+        {
+            assert(list_at_end(iter));
+        }
+        else
+        {
+            assert(!list_at_end(iter));
+            assert((int)list_get_data(iter) == expected[positions[i]]);
+        }
+    }
+}
+
+void test_fingers(int list_size, int num_operations, int node_capacity, int max_lazy_removals)
+{
+    /* Edits at random fingers, mirrored in a plain array along with
+       the position each finger should have */
+    list lst = list_create_with_capacity(node_capacity);
+    list other = list_create_with_capacity(node_capacity);
+    list_finger fingers[NUM_TEST_FINGERS];
+    int positions[NUM_TEST_FINGERS];
+    int* expected = (int *)malloc((list_size + 4*num_operations) * sizeof(int));
+    void* values[3];
+    list_snapshot snapshot;
+    int have_snapshot = 0;
+    int next_value = 0;
+    int repeat, success;
+    int i;
+    list_set_lazy_rebalancing(&lst, max_lazy_removals);
+    for (i = 0; i < list_size; i++)
+    {
+        expected[i] = next_value;
+        list_insert_end(&lst, (void *)next_value++);
+    }
+    for (i = 0; i < NUM_TEST_FINGERS; i++)
+    {
+        positions[i] = rand() % (lst.size + 1);
+        list_add_finger(&fingers[i], list_iter_at(&lst, positions[i]));
+    }
+    for (repeat = 0; repeat < num_operations; repeat++)
+    {
+        int finger = rand() % NUM_TEST_FINGERS;
+        int position = positions[finger];
+        list_iter iter = list_finger_iter(&fingers[finger]);
+        int at_end = (position == lst.size);
+        switch (rand() % 16)
+        {
+        case 0:
+        case 1:
+            success = list_insert_before(&iter, (void *)next_value);
+            assert(success);
+            memmove(expected + position + 1, expected + position,
+                    (lst.size - 1 - position) * sizeof(int));
+            expected[position] = next_value++;
+            shift_finger_positions(positions, position, 1);
+            assert(at_end ? list_at_end(iter) :
+                   (int)list_get_data(iter) == expected[position + 1]);
+            break;
+        case 2:
+        case 3:
+            if (!at_end)
+            {
+                success = list_insert_after(&iter, (void *)next_value);
+                assert(success);
+                memmove(expected + position + 2, expected + position + 1,
+                        (lst.size - 2 - position) * sizeof(int));
+                expected[position + 1] = next_value++;
+                shift_finger_positions(positions, position + 1, 1);
+            }
+            break;
+        case 4:
+        case 5:
+        case 6:
+            if (!at_end)
+            {
+                list_remove(&iter);
+                memmove(expected + position, expected + position + 1,
+                        (lst.size - position) * sizeof(int));
+                drop_finger_positions(positions, position, position + 1);
+            }
+            break;
+        case 7:
+            success = list_insert_beginning(&lst, (void *)next_value);
+            assert(success);
+            memmove(expected + 1, expected, (lst.size - 1) * sizeof(int));
+            expected[0] = next_value++;
+            shift_finger_positions(positions, 0, 1);
+            break;
+        case 8:
+            success = list_insert_end(&lst, (void *)next_value);
+            assert(success);
+            expected[lst.size - 1] = next_value++;
+            shift_finger_positions(positions, lst.size - 1, 1);
+            break;
+        case 9:
+            if (lst.size > 0)
+            {
+                list_remove_beginning(&lst);
+                memmove(expected, expected + 1, lst.size * sizeof(int));
+                drop_finger_positions(positions, 0, 1);
+            }
+            if (lst.size > 0)
+            {
+                list_remove_end(&lst);
+                drop_finger_positions(positions, lst.size, lst.size + 1);
+            }
+            break;
+        case 10:
+            if (!at_end)
+            {
+                for (i = 0; i < 3; i++)
+                {
+                    values[i] = (void *)next_value++;
+                }
+                success = list_insert_range_after(&iter, values, 3);
+                assert(success);
+                memmove(expected + position + 4, expected + position + 1,
+                        (lst.size - 3 - (position + 1)) * sizeof(int));
+                for (i = 0; i < 3; i++)
+                {
+                    expected[position + 1 + i] = (int)values[i];
+                }
+                shift_finger_positions(positions, position + 1, 3);
+            }
+            break;
+        case 11:
+            /* Remove the range between two fingers */
+            {
+                int other_position = positions[rand() % NUM_TEST_FINGERS];
+                int first = (position < other_position) ? position : other_position;
+                int last = (position < other_position) ? other_position : position;
+                list_iter first_iter, last_iter;
+                if (last - first > 50)
+                {
+                    last = first + 50;
+                }
+                first_iter = list_iter_at(&lst, first);
+                last_iter = list_iter_at(&lst, last);
+                list_remove_range(&first_iter, &last_iter);
+                memmove(expected + first, expected + last,
+                        (lst.size + (last - first) - last) * sizeof(int));
+                drop_finger_positions(positions, first, last);
+            }
+            break;
+        case 12:
+            if (rand() % 20 == 0)
+            {
+                /* Survivors keep their fingers, removed elements pass
+                   theirs on to the next survivor */
+                int new_positions[NUM_TEST_FINGERS];
+                int old_size = lst.size;
+                int kept = 0;
+                list_remove_if(&lst, is_multiple, (void *)5);
+                for (i = 0; i < NUM_TEST_FINGERS; i++)
+                {
+                    new_positions[i] = -1;
+                }
+                for (position = 0; position <= old_size; position++)
+                {
+                    for (i = 0; i < NUM_TEST_FINGERS; i++)
+                    {
+                        if (new_positions[i] < 0 && positions[i] <= position)
+                        {
+                            new_positions[i] = kept;
+                        }
+                    }
+                    if (position < old_size && expected[position] % 5 != 0)
+                    {
+                        expected[kept++] = expected[position];
+                    }
+                }
+                memcpy(positions, new_positions, sizeof(positions));
+            }
+            break;
+        case 13:
+            if (rand() % 2 == 0)
+            {
+                list_compact(&lst);
+            }
+            else
+            {
+                success = list_compact_contiguous(&lst);
+                assert(success);
+            }
+            break;
+        case 14:
+            /* Later edits copy the nodes shared with the snapshot */
+            if (have_snapshot)
+            {
+                list_snapshot_destroy(&snapshot);
+            }
+            success = list_take_snapshot(&lst, &snapshot);
+            assert(success);
+            have_snapshot = 1;
+            break;
+        case 15:
+            positions[finger] = rand() % (lst.size + 1);
+            if (rand() % 2 == 0)
+            {
+                list_set_finger(&fingers[finger], list_iter_at(&lst, positions[finger]));
+            }
+            else
+            {
+                list_remove_finger(&fingers[finger]);
+                list_add_finger(&fingers[finger], list_iter_at(&lst, positions[finger]));
+            }
+            break;
+        default:
+            assert(0);
+        }
+        check_fingers(&lst, fingers, positions, expected);
+    }
+
+    /* Fingers follow their list when it is swapped */
+    list_swap(&lst, &other);
+    check_fingers(&other, fingers, positions, expected);
+    list_swap(&lst, &other);
+    check_fingers(&lst, fingers, positions, expected);
+
+    /* Sorting moves every finger to the end */
+    success = list_sort(&lst, compare_keys, NULL);
+    assert(success);
+    for (i = 0; i < NUM_TEST_FINGERS; i++)
+    {
+        assert(list_at_end(list_finger_iter(&fingers[i])));
+    }
+    if (have_snapshot)
+    {
+        list_snapshot_destroy(&snapshot);
+    }
+    list_destroy(&lst);
+    for (i = 0; i < NUM_TEST_FINGERS; i++)
+    {
+        list_remove_finger(&fingers[i]);
+    }
+    assert(lst.fingers == NULL);
+    list_destroy(&other);
+    free(expected);
+}
+
+void add_moving_fingers(list_finger* fingers, list** lists, int* values, int count,
+                        list* lst)
+{
+    /* Remembers each finger's list and value, or -1 for the end */
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        list_iter iter = list_iter_at(lst, rand() % (lst->size + 1));
+        list_add_finger(&fingers[i], iter);
+        lists[i] = lst;
+        values[i] = list_at_end(iter) ? -1 : (int)list_get_data(iter);
+    }
+}
+
+void check_moving_fingers(list_finger* fingers, list** lists, int* values, int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        list_iter iter = list_finger_iter(&fingers[i]);
+        assert(iter.lst == lists[i]);
+        assert(values[i] < 0 ? list_at_end(iter) :
+               (int)list_get_data(iter) == values[i]);
+        list_remove_finger(&fingers[i]);
+    }
+}
+
+void test_moving_fingers(int list_size, int num_repeats, int node_capacity)
+{
+    /* Fingers of list elements move between lists with their elements,
+       which are told apart by value */
+    list_finger fingers[2*NUM_TEST_FINGERS];
+    list* lists[2*NUM_TEST_FINGERS];
+    int values[2*NUM_TEST_FINGERS];
+    int repeat, i, success;
+    for (repeat = 0; repeat < num_repeats; repeat++)
+    {
+        list lst = list_create_with_capacity(node_capacity);
+        list other = list_create_with_capacity(node_capacity);
+        int other_size = rand() % (list_size + 1);
+        int first = rand() % (list_size + 1);
+        int last = first + rand() % (list_size + 1 - first);
+        list_iter dst_iter, first_iter, last_iter;
+        for (i = 0; i < list_size; i++)
+        {
+            list_insert_end(&lst, (void *)i);
+        }
+        for (i = 0; i < other_size; i++)
+        {
+            list_insert_end(&other, (void *)(list_size + i));
+        }
+        add_moving_fingers(fingers, lists, values, NUM_TEST_FINGERS, &lst);
+        add_moving_fingers(fingers + NUM_TEST_FINGERS, lists + NUM_TEST_FINGERS,
+                           values + NUM_TEST_FINGERS, NUM_TEST_FINGERS, &other);
+        dst_iter = list_iter_at(&other, rand() % (other_size + 1));
+        switch (rand() % 3)
+        {
+        case 0:
+            first_iter = list_iter_at(&lst, first);
+            last_iter = list_iter_at(&lst, last);
+            success = list_splice_range(&dst_iter, &first_iter, &last_iter);
+            break;
+        case 1:
+            first = 0;
+            last = list_size;
+            success = list_splice(&dst_iter, &lst);
+            break;
+        default:
+            last = list_size;
+            first_iter = list_iter_at(&lst, first);
+            success = list_chop(&first_iter, &other);
+            break;
+        }
+        assert(success);
+        for (i = 0; i < NUM_TEST_FINGERS; i++)
+        {
+            if (values[i] >= first && values[i] < last)
+            {
+                lists[i] = &other;
+            }
+        }
+        check_moving_fingers(fingers, lists, values, 2*NUM_TEST_FINGERS);
+        list_destroy(&lst);
+        list_destroy(&other);
+
+        /* Merging keeps the fingers on nodes linked in whole, here all
+           of them, since the lists do not overlap and every node of
+           lst is full. Fingers on merged elements move to the end. */
+        for (i = 0; i < list_size - list_size % lst.node_capacity; i++)
+        {
+            list_insert_end(&lst, (void *)i);
+        }
+        for (i = 0; i < other_size; i++)
+        {
+            list_insert_end(&other, (void *)(list_size + i));
+        }
+        add_moving_fingers(fingers, lists, values, NUM_TEST_FINGERS, &lst);
+        add_moving_fingers(fingers + NUM_TEST_FINGERS, lists + NUM_TEST_FINGERS,
+                           values + NUM_TEST_FINGERS, NUM_TEST_FINGERS, &other);
+        success = list_merge_sorted(&lst, &other, compare_keys, NULL);
+        assert(success);
+        for (i = NUM_TEST_FINGERS; i < 2*NUM_TEST_FINGERS; i++)
+        {
+            if (values[i] >= 0)
+            {
+                lists[i] = &lst;
+            }
+        }
+        check_moving_fingers(fingers, lists, values, 2*NUM_TEST_FINGERS);
+        list_destroy(&lst);
+        for (i = 0; i < list_size; i++)
+        {
+            list_insert_end((i % 2 == 0) ? &lst : &other, (void *)i);
+        }
+        add_moving_fingers(fingers, lists, values, NUM_TEST_FINGERS, &lst);
+        add_moving_fingers(fingers + NUM_TEST_FINGERS, lists + NUM_TEST_FINGERS,
+                           values + NUM_TEST_FINGERS, NUM_TEST_FINGERS, &other);
+        success = list_merge_sorted(&lst, &other, compare_keys, NULL);
+        assert(success);
+        for (i = 0; i < 2*NUM_TEST_FINGERS; i++)
+        {
+            list_iter iter = list_finger_iter(&fingers[i]);
+            assert(list_at_end(iter) ||
+                   (iter.lst == &lst && (int)list_get_data(iter) == values[i]));
+            list_remove_finger(&fingers[i]);
+        }
+        list_destroy(&lst);
+        list_destroy(&other);
+    }
+}
+
+typedef struct
+{
+    int position;
+    int remove;
+    int value;
+    int sequence;
+} test_batch_edit;
+
+void record_test_batch_edit(list_batch* batch, test_batch_edit* edit)
+{
+    list_iter iter = list_iter_at(batch->lst, edit->position);
+    int success;
+    if (edit->remove)
+    {
+        success = list_batch_remove(batch, iter);
+        assert(success);
+    }
+    else
+    {
+        success = list_batch_insert(batch, iter, (void *)edit->value);
+        assert(success);
+    }
+}
+
+int compare_test_batch_edits(const void* left_ptr, const void* right_ptr)
+{
+    const test_batch_edit* left = (const test_batch_edit *)left_ptr;
+    const test_batch_edit* right = (const test_batch_edit *)right_ptr;
+    if (left->position != right->position)
+    {
+        return left->position - right->position;
+    }
+    if (left->remove != right->remove)
+    {
+        return left->remove - right->remove;
+    }
+    return left->sequence - right->sequence;
+}
+
+void test_batch(int list_size, int num_batches, int max_edits, int node_capacity, int indexed)
+{
+    /* Applies random batches, mirroring them by merging the sorted
+       edits into a plain array, and tracks fingers and a snapshot */
+    list lst = list_create_with_capacity(node_capacity);
+    list_batch batch = list_batch_create(&lst);
+    list_finger fingers[NUM_TEST_FINGERS];
+    int positions[NUM_TEST_FINGERS];
+    int max_size = list_size + num_batches*max_edits;
+    int* expected = (int *)malloc(max_size * sizeof(int));
+    int* result = (int *)malloc(max_size * sizeof(int));
+    int* new_positions = (int *)malloc((max_size + 1) * sizeof(int));
+    char* removed = (char *)malloc(max_size);
+    test_batch_edit* edits = (test_batch_edit *)malloc(max_edits * sizeof(test_batch_edit));
+    list_snapshot snapshot;
+    int next_value = 0;
+    int repeat, success;
+    int i;
+    for (i = 0; i < list_size; i++)
+    {
+        expected[i] = next_value;
+        list_insert_end(&lst, (void *)next_value++);
+    }
+    if (indexed)
+    {
+        build_index(&lst);
+    }
+    for (i = 0; i < NUM_TEST_FINGERS; i++)
+    {
+        positions[i] = rand() % (lst.size + 1);
+        list_add_finger(&fingers[i], list_iter_at(&lst, positions[i]));
+    }
+    success = list_batch_apply(&batch);
+    assert(success);
+    for (repeat = 0; repeat < num_batches; repeat++)
+    {
+        int num_edits = rand() % (max_edits + 1);
+        int size = lst.size;
+        int num_results = 0;
+        int e = 0, end_edit;
+        int use_snapshot = (rand() % 4 == 0);
+        memset(removed, 0, size);
+        for (i = 0; i < num_edits; i++)
+        {
+            edits[i].position = rand() % (size + 1);
+            edits[i].remove = (edits[i].position < size &&
+                               !removed[edits[i].position] && rand() % 2 == 0);
+            edits[i].value = next_value++;
+            edits[i].sequence = i;
+            if (edits[i].remove)
+            {
+                removed[edits[i].position] = 1;
+            }
+        }
+        qsort(edits, num_edits, sizeof(test_batch_edit), compare_test_batch_edits);
+
+        /* Edits are recorded in list order, a removal sometimes ahead
+           of the insertions at its position */
+        for (i = 0; i < num_edits; i = end_edit)
+        {
+            int j;
+            for (end_edit = i; end_edit < num_edits && edits[end_edit].position == edits[i].position;
+                 end_edit++)
+            {
+            }
+            if (edits[end_edit - 1].remove && rand() % 2 == 0)
+            {
+                record_test_batch_edit(&batch, &edits[end_edit - 1]);
+                for (j = i; j < end_edit - 1; j++)
+                {
+                    record_test_batch_edit(&batch, &edits[j]);
+                }
+            }
+            else
+            {
+                for (j = i; j < end_edit; j++)
+                {
+                    record_test_batch_edit(&batch, &edits[j]);
+                }
+            }
+        }
+        assert(batch.num_edits == num_edits);
+        for (i = 0; i <= size; i++)
+        {
+            for ( ; e < num_edits && edits[e].position == i && !edits[e].remove; e++)
+            {
+                result[num_results++] = edits[e].value;
+            }
+            new_positions[i] = -1;
+            if (e < num_edits && edits[e].position == i)
+            {
+                e++;
+            }
+            else if (i < size)
+            {
+                new_positions[i] = num_results;
+                result[num_results++] = expected[i];
+            }
+        }
+        /* A removed element's fingers go to the next element kept */
+        new_positions[size] = num_results;
+        for (i = size - 1; i >= 0; i--)
+        {
+            if (new_positions[i] < 0)
+            {
+                new_positions[i] = new_positions[i + 1];
+            }
+        }
+        for (i = 0; i < NUM_TEST_FINGERS; i++)
+        {
+            positions[i] = (positions[i] == size) ? num_results : new_positions[positions[i]];
+        }
+        if (use_snapshot)
+        {
+            success = list_take_snapshot(&lst, &snapshot);
+            assert(success);
+        }
+        success = list_batch_apply(&batch);
+        assert(success);
+        assert(batch.num_edits == 0);
+        memcpy(expected, result, num_results * sizeof(int));
+        check_list_contents(&lst, expected, num_results);
+        check_fingers(&lst, fingers, positions, expected);
+        if (use_snapshot)
+        {
+            list_snapshot_destroy(&snapshot);
+        }
+        if (indexed)
+        {
+            for (i = 0; i < num_results; i += 1 + num_results/10)
+            {
+                assert((int)list_get_data(list_iter_at(&lst, i)) == expected[i]);
+            }
+        }
+    }
+    for (i = 0; i < NUM_TEST_FINGERS; i++)
+    {
+        list_remove_finger(&fingers[i]);
+    }
+
+    /* Removing everything leaves an empty list, which then takes
+       insertions at the end */
+    for (i = 0; i < lst.size; i++)
+    {
+        success = list_batch_remove(&batch, list_iter_at(&lst, i));
+        assert(success);
+    }
+    success = list_batch_apply(&batch);
+    assert(success);
+    assert(lst.size == 0);
+    for (i = 0; i < 3*lst.node_capacity; i++)
+    {
+        expected[i] = i;
+        success = list_batch_insert(&batch, list_iter_at(&lst, 0), (void *)i);
+        assert(success);
+    }
+    success = list_batch_apply(&batch);
+    assert(success);
+    check_list_contents(&lst, expected, 3*lst.node_capacity);
+    list_batch_destroy(&batch);
+    list_destroy(&lst);
+    free(edits);
+    free(removed);
+    free(new_positions);
+    free(result);
+    free(expected);
+}
 
 int main()
 {
@@ -344,7 +2971,85 @@ int main()
     test_insert_remove_beginning(10000);
     test_backwards_iterate(10000);
     test_random_walk(1000, 3000);
-    test_random_operations(1000, 10000);
+    test_random_operations(1000, 10000, 0);
+    test_random_operations(1000, 10000, 2);
+    test_random_operations(1000, 10000, list_node_capacity_for_cache_lines(1));
+    test_random_operations(1000, 10000, list_node_capacity_for_cache_lines(4));
     test_swap(1000, 2000);
+    test_pooled(1000, 10000);
+    test_iter_at(1000);
+    test_indexed_random_operations(1000, 10000);
+    test_weighted_index(0, 100);
+    test_weighted_index(1000, 5000);
+    test_append_range(10000, 1);
+    test_append_range(10000, 7);
+    test_append_range(10000, 100);
+    test_insert_range_after(40, 1000);
+    test_splice(1000, 1000, 0);
+    test_splice(1000, 1000, 1);
+    test_remove_range(10000, 0);
+    test_remove_range(10000, 1);
+    test_remove_if(10000, 1, 0);
+    test_remove_if(10000, 3, 0);
+    test_remove_if(10000, 1000, 1);
+    test_deque_operations(100, 100000);
+    test_insert_typing(10000);
+    test_spare_nodes(1000);
+    test_lazy_rebalancing(10000, 100, 0);
+    test_lazy_rebalancing(10000, 100, 1);
+    test_lazy_rebalancing(10000, INT_MAX, 0);
+    test_find(1, 1);
+    test_find(10000, 1);
+    test_find(10000, 7);
+    test_find(10000, 16);
+    test_iterate_spans(10000);
+#if LIST_HAVE_POSIX
+    test_parallel(10, 0);
+    test_parallel(10000, 0);
+    test_parallel(10000, 1);
+#endif
+    test_sort(0, 1, 0);
+    test_sort(1, 1, 0);
+    test_sort(7, 3, 0);
+    test_sort(10000, 10, 0);
+    test_sort(10000, 10000, 1);
+    test_sort(40000, 100, 0);
+    test_sort_pooled(10000);
+    test_set_operations(0, 1, 0);
+    test_set_operations(1000, 10, 0);
+    test_set_operations(10000, 5000, 1);
+#if LIST_HAVE_POSIX
+    test_queue_batches(10000, 0);
+    test_queue_batches(10000, 1);
+    test_queue_threads(100000, 1);
+    test_queue_threads(100000, 4);
+#endif
+    test_snapshot(0, 100, 0);
+    test_snapshot(1000, 10000, 0);
+    test_snapshot(1000, 10000, 1);
+#if LIST_HAVE_POSIX
+    test_snapshot_threads(10000, 100000);
+    test_list_io(0);
+    test_list_io(1);
+    test_list_io(100000);
+    test_list_iovec(0);
+    test_list_iovec(3);
+    test_list_iovec(400);
+    test_list_iovec(200000);
+#endif
+    test_fingers(0, 1000, 0, 0);
+    test_fingers(1000, 20000, 0, 0);
+    test_fingers(1000, 20000, 4, 0);
+    test_fingers(1000, 20000, 4, 10);
+    test_moving_fingers(0, 10, 0);
+    test_moving_fingers(1000, 200, 0);
+    test_moving_fingers(1000, 200, 4);
+    test_batch(0, 10, 5, 0, 0);
+    test_batch(1000, 200, 50, 0, 0);
+    test_batch(1000, 200, 50, 4, 0);
+    test_batch(1000, 200, 500, 0, 1);
+    test_batch(100, 200, 3, 4, 1);
+    test_typed_list(0, 1000);
+    test_typed_list(1000, 100000);
     return 0;
 }
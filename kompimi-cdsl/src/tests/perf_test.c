@@ -6,14 +6,40 @@
    releases all rights. This notice may be modified or removed.
 */
 
+/* Needed for clock_gettime() in strict ANSI modes */
+#define _POSIX_C_SOURCE 199309L
+
 #include <stdio.h>
 
+#include "../config.h"
 #include "perf_test.h"
 
+static void report_seconds(char* name, double seconds_per_iteration);
+
 void report_time(char* name, int iterations, time_t clock_duration)
 {
-    double seconds_per_iteration =
-	(((double)clock_duration)/CLOCKS_PER_SEC)/iterations;
+    report_seconds(name, (((double)clock_duration)/CLOCKS_PER_SEC)/iterations);
+}
+
+void report_wall_time(char* name, int iterations, double seconds)
+{
+    report_seconds(name, seconds/iterations);
+}
+
+double wall_clock_seconds(void)
+{
+#if LIST_HAVE_POSIX
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec*1E-9;
+#else
+    /* Only single-threaded code is timed here, so CPU time will do */
+    return ((double)clock())/CLOCKS_PER_SEC;
+#endif
+}
+
+static void report_seconds(char* name, double seconds_per_iteration)
+{
     if (seconds_per_iteration < 1E-6)
     {
 	printf("%s: %f ns per iteration\n", name, seconds_per_iteration*1E9);
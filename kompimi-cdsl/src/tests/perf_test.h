@@ -25,6 +25,25 @@
 	report_time((name), (iterations), time_elapsed_duration); \
     } while(0)
             
+/* Like time_elapsed, but measures elapsed wall-clock time rather
+   than processor time, for bodies that run on several threads. */
+#define /*void*/ wall_time_elapsed(/*char**/ name, /*int*/ iterations, body) \
+    do \
+    { \
+	double time_elapsed_begin_time = wall_clock_seconds(); \
+	int time_elapsed_i; \
+	for (time_elapsed_i=0; time_elapsed_i < (iterations); time_elapsed_i++) \
+	{ \
+	    body \
+	} \
+	report_wall_time((name), (iterations), \
+	                 wall_clock_seconds() - time_elapsed_begin_time); \
+    } while(0)
+            
 void report_time(char* name, int iterations, time_t clock_duration);
 
+void report_wall_time(char* name, int iterations, double seconds);
+
+double wall_clock_seconds(void);
+
 #endif /* #ifndef _PERF_TEST_ */
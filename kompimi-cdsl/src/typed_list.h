@@ -0,0 +1,515 @@
+/* Originally distributed as part of the Kompimi C Data Structure Library.
+   For updates, see: https://sourceforge.net/projects/kompimi-cdsl/
+
+   All content in this document is granted into the public
+   domain. Where this is not legally possible, the copyright owner
+   releases all rights. This notice may be modified or removed.
+*/
+
+/** @defgroup typed_list typed_list module
+    Macros that generate lists storing values of a given type inline.
+
+   A list stores only void* elements, so storing small values means
+   casting them to pointers or allocating each one separately. The
+   macros here instead generate a list type, a node type holding an
+   array of values of the given type T, and functions operating on
+   them, for each type they are instantiated with:
+
+   \code
+   DECLARE_LIST(point_list, point)  -- in a header, declares the types
+   DEFINE_LIST(point_list, point)   -- in one source file, the functions
+   \endcode
+
+   The generated lists use the same unrolled layout and the same node
+   splitting and rebalancing as a list, but element sizes and node
+   capacities are compile-time constants, so element moves compile to
+   fixed-size copies. Node capacity is chosen so that each node fills
+   ::LIST_DEFAULT_NODE_CACHE_LINES cache lines, with a minimum of two
+   elements. Generated lists have no node pools, spare node caches,
+   indexes or lazy rebalancing.
+
+   Generated iterators have the same fields as a list_iter, so the
+   list_next(), list_prev(), list_at_end(), list_at_beginning() and
+   list_get_data() macros of the list module work on them unchanged,
+   list_get_data() yielding an lvalue of type T.
+
+   See tests/list_test.c for example code.
+
+    @{
+*/
+
+#ifndef _TYPED_LIST_
+#define _TYPED_LIST_
+
+#include <assert.h>
+
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "list.h"
+
+/*! \brief (Internal) The metadata at the start of every generated
+    node type, used to size their data arrays. */
+typedef struct
+{
+    int count;
+    int start;
+    void* next;
+    void* prev;
+} typed_list_node_header;
+
+/*! \brief (Internal) The number of values of type T that fit in a
+    node filling ::LIST_DEFAULT_NODE_CACHE_LINES cache lines. */
+#define TYPED_LIST_FIT(T) \
+    ((int)((LIST_DEFAULT_NODE_CACHE_LINES*LIST_CACHE_LINE_SIZE - \
+            sizeof(typed_list_node_header)) / sizeof(T)))
+
+/*! \brief The node capacity of a list generated for type T. */
+#define TYPED_LIST_NODE_CAPACITY(T) \
+    (TYPED_LIST_FIT(T) >= 2 ? TYPED_LIST_FIT(T) : 2)
+
+/*! \brief (Internal) Allocates a node of the given size, aligned to
+    a cache line boundary where the C library supports it. */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define typed_list_allocate_node(size) \
+    aligned_alloc(LIST_CACHE_LINE_SIZE, \
+                  ((size) + LIST_CACHE_LINE_SIZE - 1) & ~(size_t)(LIST_CACHE_LINE_SIZE - 1))
+#else
+#define typed_list_allocate_node(size) malloc(size)
+#endif
+
+/*! \brief Declares a list type storing values of type T.
+
+   Declares the types name, name##_node and name##_iter, and
+   prototypes for the following functions, which behave like the list
+   functions of the same names but take and store values of type T:
+
+   \code
+   name           name##_create(void);
+   void           name##_destroy(name* lst);
+   int            name##_insert_end(name* lst, T value);
+   int            name##_insert_beginning(name* lst, T value);
+   int            name##_insert_after(name##_iter* iter, T value);
+   int            name##_insert_before(name##_iter* iter, T value);
+   void           name##_remove(name##_iter* iter);
+   void           name##_remove_beginning(name* lst);
+   void           name##_remove_end(name* lst);
+   name##_iter    name##_first(name* lst);
+   name##_iter    name##_last(name* lst);
+   \endcode
+
+   The insert functions return zero if out of memory, nonzero if
+   successful.
+
+   \param name The name of the list type, and prefix of its functions.
+   \param T The element type, which must be copyable by assignment.
+*/
+#define DECLARE_LIST(name, T) \
+    typedef struct name##_node_t \
+    { \
+        int count; \
+        int start; \
+        struct name##_node_t* next; \
+        struct name##_node_t* prev; \
+        T data[TYPED_LIST_NODE_CAPACITY(T)]; \
+    } name##_node; \
+    \
+    typedef struct \
+    { \
+        int size; \
+        name##_node* first_node; \
+        name##_node* last_node; \
+    } name; \
+    \
+    typedef struct \
+    { \
+        name* lst; \
+        name##_node* node; \
+        int offset; \
+    } name##_iter; \
+    \
+    name name##_create(void); \
+    void name##_destroy(name* lst); \
+    int name##_insert_end(name* lst, T value); \
+    int name##_insert_beginning(name* lst, T value); \
+    int name##_insert_after(name##_iter* iter, T value); \
+    int name##_insert_before(name##_iter* iter, T value); \
+    void name##_remove(name##_iter* iter); \
+    void name##_remove_beginning(name* lst); \
+    void name##_remove_end(name* lst); \
+    name##_iter name##_first(name* lst); \
+    name##_iter name##_last(name* lst)
+
+/*! \brief Defines the functions of a list type declared by DECLARE_LIST().
+
+   Must appear exactly once in a program for each name, after the
+   matching DECLARE_LIST() and at file scope.
+
+   \param name The name given to DECLARE_LIST().
+   \param T The element type given to DECLARE_LIST().
+*/
+#define DEFINE_LIST(name, T) \
+    static int name##_insert_empty_node_after(name* lst, name##_node* node) \
+    { \
+        name##_node* new_node = \
+            (name##_node *)typed_list_allocate_node(sizeof(name##_node)); \
+        if (new_node == NULL) \
+        { \
+            return 0; \
+        } \
+        new_node->count = 0; \
+        new_node->start = 0; \
+        new_node->prev = node; \
+        new_node->next = (node != NULL) ? node->next : lst->first_node; \
+        if (node != NULL) \
+        { \
+            node->next = new_node; \
+        } \
+        else \
+        { \
+            lst->first_node = new_node; \
+        } \
+        if (new_node->next != NULL) \
+        { \
+            new_node->next->prev = new_node; \
+        } \
+        else \
+        { \
+            lst->last_node = new_node; \
+        } \
+        return 1; \
+    } \
+    \
+    static void name##_remove_node(name* lst, name##_node* node) \
+    { \
+        if (node->prev != NULL) \
+        { \
+            node->prev->next = node->next; \
+        } \
+        else \
+        { \
+            lst->first_node = node->next; \
+        } \
+        if (node->next != NULL) \
+        { \
+            node->next->prev = node->prev; \
+        } \
+        else \
+        { \
+            lst->last_node = node->prev; \
+        } \
+        free(node); \
+    } \
+    \
+    static void name##_pack_node_front(name##_node* node) \
+    { \
+        if (node->start > 0) \
+        { \
+            memmove(node->data, node->data + node->start, node->count * sizeof(T)); \
+            node->start = 0; \
+        } \
+    } \
+    \
+    static T* name##_open_gap(name##_node* node, int offset) \
+    { \
+        T* elements; \
+        assert(node->count < TYPED_LIST_NODE_CAPACITY(T)); \
+        if (node->start > 0 && \
+            (offset < node->count - offset || \
+             node->start + node->count == TYPED_LIST_NODE_CAPACITY(T))) \
+        { \
+            node->start--; \
+            elements = node->data + node->start; \
+            memmove(elements, elements + 1, offset * sizeof(T)); \
+        } \
+        else \
+        { \
+            elements = node->data + node->start; \
+            memmove(elements + offset + 1, elements + offset, \
+                    (node->count - offset) * sizeof(T)); \
+        } \
+        node->count++; \
+        return elements + offset; \
+    } \
+    \
+    static void name##_close_gap(name##_node* node, int offset) \
+    { \
+        T* elements = node->data + node->start; \
+        if (offset < node->count - (offset + 1)) \
+        { \
+            memmove(elements + 1, elements, offset * sizeof(T)); \
+            node->start++; \
+        } \
+        else \
+        { \
+            memmove(elements + offset, elements + offset + 1, \
+                    (node->count - (offset + 1)) * sizeof(T)); \
+        } \
+        node->count--; \
+    } \
+    \
+    static int name##_split_node(name##_iter* iter) \
+    { \
+        name##_node* node = iter->node; \
+        if (!name##_insert_empty_node_after(iter->lst, node)) \
+        { \
+            return 0; \
+        } \
+        node->next->count = node->count - node->count/2; \
+        node->count = node->count/2; \
+        memcpy(node->next->data, node->data + node->start + node->count, \
+               node->next->count * sizeof(T)); \
+        if (iter->offset >= node->count) \
+        { \
+            iter->node = node->next; \
+            iter->offset -= node->count; \
+        } \
+        return 1; \
+    } \
+    \
+    static void name##_fixup_iter_node(name##_iter* iter) \
+    { \
+        while (iter->node != NULL && iter->offset >= iter->node->count) \
+        { \
+            iter->offset -= iter->node->count; \
+            iter->node = iter->node->next; \
+        } \
+    } \
+    \
+    static void name##_rebalance_nodes(name##_iter* iter) \
+    { \
+        name##_node* node = iter->node; \
+        name##_node* prev = node->prev; \
+        name##_node* next = node->next; \
+        int elements_sum; \
+        if (next == NULL || prev == NULL) \
+        { \
+            if (node->count == 0) \
+            { \
+                name##_fixup_iter_node(iter); \
+                name##_remove_node(iter->lst, node); \
+            } \
+            return; \
+        } \
+        elements_sum = next->count + node->count + prev->count; \
+        if (elements_sum <= TYPED_LIST_NODE_CAPACITY(T)) \
+        { \
+            name##_pack_node_front(node); \
+            memmove(node->data + prev->count, node->data, node->count * sizeof(T)); \
+            memcpy(node->data, prev->data + prev->start, prev->count * sizeof(T)); \
+            memcpy(node->data + prev->count + node->count, \
+                   next->data + next->start, next->count * sizeof(T)); \
+            node->count = elements_sum; \
+            iter->offset += prev->count; \
+            name##_remove_node(iter->lst, prev); \
+            name##_remove_node(iter->lst, next); \
+        } \
+        else if ((elements_sum + 1)/2 <= TYPED_LIST_NODE_CAPACITY(T)) \
+        { \
+            int node1_count = (elements_sum + 0)/2; \
+            int node2_count = (elements_sum + 1)/2; \
+            name##_pack_node_front(prev); \
+            name##_pack_node_front(node); \
+            if (prev->count <= node1_count) \
+            { \
+                int move_total = node1_count - prev->count; \
+                int move_1 = (move_total < node->count) ? move_total : node->count; \
+                int move_2 = move_total - move_1; \
+                memcpy(prev->data + prev->count, node->data, move_1 * sizeof(T)); \
+                memcpy(prev->data + prev->count + move_1, \
+                       next->data + next->start, move_2 * sizeof(T)); \
+                memmove(node->data, node->data + move_1, \
+                        (node->count - move_1) * sizeof(T)); \
+                memcpy(node->data + node->count - move_1, \
+                       next->data + next->start + move_2, \
+                       (next->count - move_2) * sizeof(T)); \
+                iter->offset -= move_total; \
+            } \
+            else \
+            { \
+                int move_1 = prev->count - node1_count; \
+                memmove(node->data + move_1, node->data, node->count * sizeof(T)); \
+                memcpy(node->data, prev->data + node1_count, move_1 * sizeof(T)); \
+                memcpy(node->data + node->count + move_1, \
+                       next->data + next->start, next->count * sizeof(T)); \
+                iter->offset += move_1; \
+            } \
+            prev->count = node1_count; \
+            node->count = node2_count; \
+            name##_remove_node(iter->lst, next); \
+        } \
+        if (iter->offset < 0) \
+        { \
+            /* The element after the removed one moved to the previous node */ \
+            iter->node = node->prev; \
+            iter->offset += node->prev->count; \
+        } \
+    } \
+    \
+    name name##_create(void) \
+    { \
+        name result; \
+        result.size = 0; \
+        result.first_node = NULL; \
+        result.last_node = NULL; \
+        return result; \
+    } \
+    \
+    void name##_destroy(name* lst) \
+    { \
+        name##_node* node = lst->first_node; \
+        while (node != NULL) \
+        { \
+            name##_node* next = node->next; \
+            free(node); \
+            node = next; \
+        } \
+        lst->size = 0; \
+        lst->first_node = NULL; \
+        lst->last_node = NULL; \
+    } \
+    \
+    int name##_insert_end(name* lst, T value) \
+    { \
+        name##_node* node = lst->last_node; \
+        if (node == NULL || node->count == TYPED_LIST_NODE_CAPACITY(T)) \
+        { \
+            if (!name##_insert_empty_node_after(lst, node)) \
+            { \
+                return 0; \
+            } \
+            node = lst->last_node; \
+        } \
+        if (node->start + node->count == TYPED_LIST_NODE_CAPACITY(T)) \
+        { \
+            name##_pack_node_front(node); \
+        } \
+        node->data[node->start + node->count] = value; \
+        node->count++; \
+        lst->size++; \
+        return 1; \
+    } \
+    \
+    int name##_insert_beginning(name* lst, T value) \
+    { \
+        name##_node* node = lst->first_node; \
+        if (node == NULL || node->count == TYPED_LIST_NODE_CAPACITY(T)) \
+        { \
+            if (!name##_insert_empty_node_after(lst, NULL)) \
+            { \
+                return 0; \
+            } \
+            node = lst->first_node; \
+            /* Fill new front nodes from the back, so that further \
+               insertions at the beginning need not move anything */ \
+            node->start = TYPED_LIST_NODE_CAPACITY(T); \
+        } \
+        *name##_open_gap(node, 0) = value; \
+        lst->size++; \
+        return 1; \
+    } \
+    \
+    int name##_insert_after(name##_iter* iter, T value) \
+    { \
+        assert(!list_at_end(*iter)); \
+        if (iter->node->count == TYPED_LIST_NODE_CAPACITY(T) && \
+            !name##_split_node(iter)) \
+        { \
+            return 0; \
+        } \
+        *name##_open_gap(iter->node, iter->offset + 1) = value; \
+        iter->lst->size++; \
+        return 1; \
+    } \
+    \
+    int name##_insert_before(name##_iter* iter, T value) \
+    { \
+        if (iter->node == NULL) \
+        { \
+            /* Insert before end iterator is insert at end */ \
+            return name##_insert_end(iter->lst, value); \
+        } \
+        if (iter->node->count == TYPED_LIST_NODE_CAPACITY(T) && \
+            !name##_split_node(iter)) \
+        { \
+            return 0; \
+        } \
+        *name##_open_gap(iter->node, iter->offset) = value; \
+        iter->lst->size++; \
+        iter->offset++; \
+        return 1; \
+    } \
+    \
+    void name##_remove(name##_iter* iter) \
+    { \
+        assert(!list_at_end(*iter)); \
+        name##_close_gap(iter->node, iter->offset); \
+        iter->lst->size--; \
+        name##_rebalance_nodes(iter); \
+        /* Need to fix up if deleted rightmost element in the node */ \
+        name##_fixup_iter_node(iter); \
+    } \
+    \
+    void name##_remove_beginning(name* lst) \
+    { \
+        name##_node* node = lst->first_node; \
+        node->start++; \
+        node->count--; \
+        lst->size--; \
+        if (node->count == 0) \
+        { \
+            name##_remove_node(lst, node); \
+        } \
+    } \
+    \
+    void name##_remove_end(name* lst) \
+    { \
+        name##_node* node = lst->last_node; \
+        node->count--; \
+        lst->size--; \
+        if (node->count == 0) \
+        { \
+            name##_remove_node(lst, node); \
+        } \
+    } \
+    \
+    name##_iter name##_first(name* lst) \
+    { \
+        name##_iter result; \
+        result.lst = lst; \
+        result.node = lst->first_node; \
+        result.offset = 0; \
+        return result; \
+    } \
+    \
+    name##_iter name##_last(name* lst) \
+    { \
+        name##_iter result; \
+        result.lst = lst; \
+        result.node = lst->last_node; \
+        result.offset = (result.node != NULL) ? result.node->count - 1 : 0; \
+        return result; \
+    }
+
+/*! \brief Begins a loop iterating through a list generated by
+   DEFINE_LIST(), ended by TYPED_LIST_ITERATE_END().
+
+   \param name The name of the list type.
+   \param lst Pointer to the list to iterate over.
+   \param iterator The name to use for the iterator, of type name##_iter.
+*/
+#define TYPED_LIST_ITERATE(name, lst, iterator) \
+    { \
+        name##_iter iterator; \
+        for ((iterator) = name##_first(lst); !list_at_end(iterator); list_next(&iterator)) \
+        {
+
+/*! \brief Closes a loop opened by TYPED_LIST_ITERATE(). */
+#define TYPED_LIST_ITERATE_END() \
+        } \
+    }
+
+#endif /* #ifndef _TYPED_LIST_ */
+
+/** @} */ /* end of group typed_list */